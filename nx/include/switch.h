@@ -22,27 +22,37 @@ extern "C" {
 #include "switch/kernel/svc.h"
 #include "switch/kernel/wait.h"
 #include "switch/kernel/tmem.h"
+#include "switch/kernel/tmemcache.h"
 #include "switch/kernel/shmem.h"
 #include "switch/kernel/mutex.h"
 #include "switch/kernel/event.h"
 #include "switch/kernel/levent.h"
+#include "switch/kernel/futex.h"
 #include "switch/kernel/uevent.h"
 #include "switch/kernel/utimer.h"
+#include "switch/kernel/timerwheel.h"
+#include "switch/kernel/fiber.h"
 #include "switch/kernel/rwlock.h"
 #include "switch/kernel/condvar.h"
 #include "switch/kernel/thread.h"
+#include "switch/kernel/sched.h"
 #include "switch/kernel/semaphore.h"
 #include "switch/kernel/virtmem.h"
 #include "switch/kernel/detect.h"
 #include "switch/kernel/random.h"
 #include "switch/kernel/jit.h"
+#include "switch/kernel/jitcache.h"
 #include "switch/kernel/barrier.h"
+#include "switch/kernel/queue.h"
 
 #include "switch/sf/hipc.h"
 #include "switch/sf/cmif.h"
 #include "switch/sf/service.h"
+#include "switch/sf/server.h"
 #include "switch/sf/sessionmgr.h"
+#include "switch/sf/stub.h"
 #include "switch/sf/tipc.h"
+#include "switch/sf/trace.h"
 
 #include "switch/services/sm.h"
 #include "switch/services/smm.h"
@@ -172,6 +182,11 @@ extern "C" {
 #include "switch/runtime/pad.h"
 #include "switch/runtime/ringcon.h"
 #include "switch/runtime/btdev.h"
+#include "switch/runtime/threadpool.h"
+#include "switch/runtime/eventloop.h"
+#include "switch/runtime/dmapool.h"
+#include "switch/runtime/heap.h"
+#include "switch/runtime/memprof.h"
 
 #include "switch/runtime/util/utf.h"
 
@@ -0,0 +1,123 @@
+/**
+ * @file fiber.h
+ * @brief Fibers (stackful coroutines), switched cooperatively in user mode.
+ * @copyright libnx Authors
+ *
+ * Switching between fibers only saves and restores the callee-saved registers, without entering the kernel.
+ * Each thread implicitly runs in its own thread fiber until it switches to another fiber. Fibers share the TLS
+ * of the thread running them, and must not be moved between threads.
+ *
+ * Fiber stacks are mapped in the stack region with unmapped guard pages around them, so that stack overflows fault.
+ * Freed stacks are kept in a small pool, so that creating fibers usually doesn't need any syscall.
+ */
+#pragma once
+#include "../types.h"
+#include "wait.h"
+
+#define FIBER_STACK_POOL_SIZE 16 ///< Maximum number of freed fiber stacks kept for reuse.
+
+typedef struct Fiber Fiber;
+
+/// Fiber entrypoint. When it returns, the fiber finishes and execution goes back to the fiber which last switched to it.
+typedef void (*FiberFunc)(void* arg);
+
+/// Fiber state.
+typedef enum {
+    FiberState_Suspended = 0, ///< Created or switched away from.
+    FiberState_Running   = 1, ///< Currently running.
+    FiberState_Finished  = 2, ///< Entrypoint returned.
+} FiberState;
+
+/// Saved registers: x19-x30, sp and d8-d15.
+typedef struct {
+    u64 x[12];
+    u64 sp;
+    u64 padding;
+    u64 d[8];
+} FiberContext;
+
+/// Fiber structure.
+struct Fiber {
+    FiberContext ctx;
+    Fiber* caller;       ///< Fiber which last switched to this one, resumed by \ref fiberYield.
+    FiberFunc entry;
+    void* arg;
+    void* stack_mem;     ///< Pointer to stack memory.
+    void* stack_mirror;  ///< Pointer to stack memory mirror, used as the actual stack.
+    size_t stack_sz;     ///< Stack size.
+    u8 state;            ///< \ref FiberState.
+};
+
+/**
+ * @brief Scheduler hooks, letting blocking operations started from a fiber suspend it instead of blocking the thread.
+ * @note The hooks are called from the fiber about to block. They must register the fiber with the scheduler, switch away
+ *       from it, and return once the scheduler has switched back to it.
+ */
+typedef struct {
+    Result (*wait)(void* userdata, Fiber* f, Waiter waiter, u64 timeout);            ///< Suspends the fiber until the waiter is signaled, see \ref fiberWait.
+    Result (*waitSocket)(void* userdata, Fiber* f, int fd, s16 events, u64 timeout); ///< Suspends the fiber until the socket is ready, see \ref fiberWaitSocket.
+    void* userdata;                                                                  ///< User data passed to the hooks.
+} FiberScheduler;
+
+/**
+ * @brief Creates a fiber.
+ * @param[out] f Fiber structure which will be filled in.
+ * @param[in] entry Entrypoint of the fiber.
+ * @param[in] arg Argument to pass to the entrypoint.
+ * @param[in] stack_sz Stack size (must be page-aligned).
+ * @return Result code.
+ * @note The fiber starts running the first time it is switched to.
+ */
+Result fiberCreate(Fiber* f, FiberFunc entry, void* arg, size_t stack_sz);
+
+/**
+ * @brief Frees the resources of a fiber.
+ * @param[in] f Fiber, which must not be running.
+ * @note A fiber which hasn't finished is simply discarded: its stack is not unwound.
+ */
+void fiberClose(Fiber* f);
+
+/**
+ * @brief Switches to a fiber, suspending the current one.
+ * @param[in] f Suspended fiber, which will return to the current fiber when it yields or finishes.
+ */
+void fiberSwitch(Fiber* f);
+
+/**
+ * @brief Switches back to the fiber which last switched to the current one.
+ * @note Does nothing when called from a thread fiber.
+ */
+void fiberYield(void);
+
+/// Returns the fiber running on the current thread (the thread fiber, if no other fiber was switched to).
+Fiber* fiberGetCurrent(void);
+
+/// Returns whether the current thread is running its thread fiber.
+bool fiberIsThreadFiber(void);
+
+/**
+ * @brief Sets the scheduler hooks of the current thread, used by \ref fiberWait and \ref fiberWaitSocket.
+ * @param[in] sched Scheduler hooks (must stay valid while set), or NULL to remove them.
+ */
+void fiberSetScheduler(const FiberScheduler* sched);
+
+/**
+ * @brief Waits on a generic waitable synchronization object. From a fiber with a scheduler set, only the fiber is suspended.
+ * @param[in] waiter \ref Waiter structure.
+ * @param[in] timeout Timeout (in nanoseconds).
+ * @return Result code.
+ * @note Without a scheduler, or from a thread fiber, this blocks the thread like \ref waitSingle.
+ */
+Result fiberWait(Waiter waiter, u64 timeout);
+
+/**
+ * @brief Waits until a BSD socket is ready (as a non-blocking socket operation would), suspending the current fiber.
+ * @param[in] fd BSD socket descriptor.
+ * @param[in] events Poll events to wait for (POLLIN, POLLOUT...).
+ * @param[in] timeout Timeout (in nanoseconds).
+ * @return Result code. LibnxError_NotInitialized when called without a scheduler, or from a thread fiber: the caller should then use blocking socket operations.
+ */
+Result fiberWaitSocket(int fd, s16 events, u64 timeout);
+
+/// Frees the stacks kept in the fiber stack pool.
+void fiberStackPoolClear(void);
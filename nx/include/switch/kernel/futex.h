@@ -0,0 +1,48 @@
+/**
+ * @file futex.h
+ * @brief Futex-style wait/wake primitives over kernel address arbitration [4.0.0+]
+ * @copyright libnx Authors
+ *
+ * These are thin wrappers around \ref svcWaitForAddress and \ref svcSignalToAddress, meant as
+ * building blocks for custom synchronization primitives: a thread sleeps on a 32-bit word as long
+ * as it holds an expected value, and is woken up by another thread after it changes the word.
+ */
+#pragma once
+#include "../types.h"
+#include "../result.h"
+#include "svc.h"
+
+/**
+ * @brief Waits on an address as long as it holds the expected value.
+ * @param[in] addr Address of the 32-bit word to wait on (must be 4-byte aligned).
+ * @param[in] expected Value the word is expected to hold.
+ * @param[in] timeout_ns Timeout in nanoseconds (UINT64_MAX for no timeout).
+ * @return Result code: 0 if woken up, KERNELRESULT(InvalidState) if the word didn't hold the expected value,
+ *         KERNELRESULT(TimedOut) on timeout.
+ * @note Like any futex, the wait may end without the value having changed, so callers must recheck it.
+ */
+NX_INLINE Result futexWait(u32* addr, u32 expected, u64 timeout_ns)
+{
+    return svcWaitForAddress(addr, ArbitrationType_WaitIfEqual, expected,
+        timeout_ns == UINT64_MAX ? -1 : (s64)timeout_ns);
+}
+
+/**
+ * @brief Wakes up threads waiting on an address.
+ * @param[in] addr Address of the 32-bit word.
+ * @param[in] count Maximum number of threads to wake up (-1 for all of them).
+ * @note The word should be updated before calling this function, so that woken up threads see the new value.
+ */
+NX_INLINE void futexWake(u32* addr, s32 count)
+{
+    svcSignalToAddress(addr, SignalType_Signal, 0, count);
+}
+
+/**
+ * @brief Wakes up all threads waiting on an address.
+ * @param[in] addr Address of the 32-bit word.
+ */
+NX_INLINE void futexWakeAll(u32* addr)
+{
+    futexWake(addr, -1);
+}
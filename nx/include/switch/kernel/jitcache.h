@@ -0,0 +1,155 @@
+/**
+ * @file jitcache.h
+ * @brief JIT code cache, sub-allocating code blocks from a \ref Jit buffer.
+ * @copyright libnx Authors
+ *
+ * Blocks are allocated with a bump pointer, and recycled through size-class free lists once freed. Writes are
+ * tracked as dirty ranges, so that \ref jitcacheCommit only performs cache maintenance over the code which actually
+ * changed. With \ref JitType_CodeMemory the RW alias stays writable while the code runs, so blocks can be written and
+ * patched without any permission transition.
+ *
+ * A code cache is not thread-safe: it is meant to be used by a single compiler thread.
+ */
+#pragma once
+#include "../types.h"
+#include "jit.h"
+
+#define JITCACHE_ALIGN             64 ///< Alignment and size granularity of code blocks (cache line size), in bytes.
+#define JITCACHE_NUM_CLASSES       16 ///< Number of free list size classes (powers of two of \ref JITCACHE_ALIGN).
+#define JITCACHE_MAX_DIRTY_RANGES  16 ///< Maximum number of separate dirty ranges tracked before they get merged.
+
+typedef struct JitCodeCache JitCodeCache;
+typedef struct JitCodeBlock JitCodeBlock;
+
+/// Eviction callback, called before a block is evicted to make room for a new one. References to the block must be removed.
+typedef void (*JitCodeCacheEvictFunc)(JitCodeCache* c, JitCodeBlock* block, void* userdata);
+
+/// Code block.
+struct JitCodeBlock {
+    JitCodeBlock* prev;       ///< Previous block in address order.
+    JitCodeBlock* next;       ///< Next block in address order.
+    JitCodeBlock* list_prev;  ///< Links in the free list (free blocks) or the allocation order list (used blocks).
+    JitCodeBlock* list_next;
+    size_t offset;            ///< Offset of the block in the \ref Jit buffer.
+    size_t size;              ///< Size of the block.
+    bool is_free;
+    void* userdata;           ///< User data, free for use by the owner of the block.
+};
+
+/// Range of a \ref Jit buffer, as offsets.
+typedef struct {
+    size_t start;
+    size_t end;
+} JitCodeRange;
+
+/// JIT code cache object.
+struct JitCodeCache {
+    Jit jit;                                        ///< Underlying JIT buffer.
+    size_t bump;                                    ///< Offset of the unallocated space at the end of the buffer.
+    JitCodeBlock* first;                            ///< Blocks in address order.
+    JitCodeBlock* last;
+    JitCodeBlock* free_lists[JITCACHE_NUM_CLASSES];
+    JitCodeBlock* oldest;                           ///< Used blocks in allocation order, evicted first.
+    JitCodeBlock* newest;
+    JitCodeCacheEvictFunc evict;
+    void* evict_userdata;
+    u32 num_dirty;
+    JitCodeRange dirty[JITCACHE_MAX_DIRTY_RANGES];
+};
+
+/**
+ * @brief Creates a JIT code cache.
+ * @param[out] c JIT code cache.
+ * @param[in] size Size of the underlying JIT buffer.
+ * @return Result code.
+ */
+Result jitcacheCreate(JitCodeCache* c, size_t size);
+
+/**
+ * @brief Destroys a JIT code cache, freeing all of its blocks.
+ * @param[in] c JIT code cache.
+ * @return Result code.
+ */
+Result jitcacheClose(JitCodeCache* c);
+
+/**
+ * @brief Enables eviction: when the cache is full, the oldest blocks are evicted to make room for new ones.
+ * @param[in] c JIT code cache.
+ * @param[in] evict Callback called for each evicted block, or NULL to disable eviction.
+ * @param[in] userdata User data passed to the callback.
+ */
+void jitcacheSetEvictCallback(JitCodeCache* c, JitCodeCacheEvictFunc evict, void* userdata);
+
+/**
+ * @brief Allocates a code block.
+ * @param[in] c JIT code cache.
+ * @param[in] size Size of the block, rounded up to \ref JITCACHE_ALIGN.
+ * @return Code block, or NULL if the cache is full (and nothing could be evicted).
+ */
+JitCodeBlock* jitcacheAlloc(JitCodeCache* c, size_t size);
+
+/**
+ * @brief Frees a code block.
+ * @param[in] c JIT code cache.
+ * @param[in] block Code block.
+ */
+void jitcacheFree(JitCodeCache* c, JitCodeBlock* block);
+
+/// Gets the address of the writable alias of a code block.
+NX_CONSTEXPR void* jitcacheGetRwAddr(JitCodeCache* c, JitCodeBlock* block) {
+    return (u8*)c->jit.rw_addr + block->offset;
+}
+
+/// Gets the address of the executable alias of a code block.
+NX_CONSTEXPR void* jitcacheGetRxAddr(JitCodeCache* c, JitCodeBlock* block) {
+    return (u8*)c->jit.rx_addr + block->offset;
+}
+
+/// Converts an address in the executable alias to the matching address in the writable alias.
+NX_CONSTEXPR void* jitcacheRxToRw(JitCodeCache* c, const void* rx) {
+    return (u8*)c->jit.rw_addr + ((uintptr_t)rx - (uintptr_t)c->jit.rx_addr);
+}
+
+/**
+ * @brief Makes the cache writable. Must be called before writing to blocks.
+ * @param[in] c JIT code cache.
+ * @return Result code.
+ * @note This is a no-op with \ref JitType_CodeMemory, where code can be written while it runs. With
+ *       \ref JitType_SetProcessMemoryPermission the whole buffer is unmapped from the executable alias until the next commit.
+ */
+Result jitcacheBeginWrite(JitCodeCache* c);
+
+/**
+ * @brief Marks a range of the writable alias as modified, so that it is flushed by the next \ref jitcacheCommit.
+ * @param[in] c JIT code cache.
+ * @param[in] rw Address in the writable alias.
+ * @param[in] size Size of the range.
+ */
+void jitcacheMarkDirty(JitCodeCache* c, void* rw, size_t size);
+
+/**
+ * @brief Copies code into a block, and marks it as dirty.
+ * @param[in] c JIT code cache.
+ * @param[in] block Code block.
+ * @param[in] offset Offset in the block.
+ * @param[in] data Code to copy.
+ * @param[in] size Size of the code.
+ */
+void jitcacheWrite(JitCodeCache* c, JitCodeBlock* block, size_t offset, const void* data, size_t size);
+
+/**
+ * @brief Patches a B/BL instruction in executable code, and marks it as dirty.
+ * @param[in] c JIT code cache.
+ * @param[in] rx_site Address of the instruction to patch, in the executable alias.
+ * @param[in] rx_target Branch target, in the executable alias (or any other executable address within range).
+ * @param[in] link Whether to emit BL rather than B.
+ * @return Result code. LibnxError_BadInput if an address is misaligned or the target is out of the ±128MiB branch range.
+ */
+Result jitcachePatchBranch(JitCodeCache* c, void* rx_site, const void* rx_target, bool link);
+
+/**
+ * @brief Makes the cache executable, flushing the data cache and invalidating the instruction cache over the dirty ranges only.
+ * @param[in] c JIT code cache.
+ * @return Result code.
+ */
+Result jitcacheCommit(JitCodeCache* c);
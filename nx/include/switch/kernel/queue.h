@@ -0,0 +1,179 @@
+/**
+ * @file queue.h
+ * @brief Lock-free bounded queues (single-producer/single-consumer ring and multi-producer/multi-consumer queue).
+ * @copyright libnx Authors
+ *
+ * Both queues store fixed-size elements (copied in and out) in caller-provided storage, with a power-of-two capacity.
+ * The Try functions never block. The blocking functions only sleep (on a \ref LEvent) when the queue is empty or full.
+ * Queues can also be waited on with \ref waitObjects, in which case they are signaled while they are not empty.
+ */
+#pragma once
+#include "../types.h"
+#include "../result.h"
+#include "wait.h"
+#include "levent.h"
+
+/// Size of the storage needed by a \ref SpscQueue.
+#define SPSCQUEUE_STORAGE_SIZE(_capacity, _elem_size) ((size_t)(_capacity) * (_elem_size))
+
+/// Size of the storage needed by a \ref MpmcQueue (each element is stored along with a sequence number).
+#define MPMCQUEUE_STORAGE_SIZE(_capacity, _elem_size) ((size_t)(_capacity) * (8 + (((_elem_size) + 7) &~ 7)))
+
+/// Lock-free single-producer single-consumer queue (ring buffer).
+typedef struct SpscQueue {
+    Waitable waitable;
+    LEvent not_empty;
+    LEvent not_full;
+    u8* storage;
+    u32 elem_size;
+    u32 mask;
+
+    u32 head __attribute__((aligned(64))); ///< Next element to be popped, written by the consumer.
+    u32 cached_tail;                       ///< Consumer's copy of tail.
+
+    u32 tail __attribute__((aligned(64))); ///< Next element to be pushed, written by the producer.
+    u32 cached_head;                       ///< Producer's copy of head.
+} SpscQueue;
+
+/// Lock-free multi-producer multi-consumer bounded queue.
+typedef struct MpmcQueue {
+    Waitable waitable;
+    LEvent not_empty;
+    LEvent not_full;
+    u8* storage;
+    u32 elem_size;
+    u32 stride;
+    u32 mask;
+
+    u32 enqueue_pos __attribute__((aligned(64)));
+    u32 dequeue_pos __attribute__((aligned(64)));
+} MpmcQueue;
+
+/// Creates a waiter for a single-producer single-consumer queue, signaled while the queue is not empty.
+static inline Waiter waiterForSpscQueue(SpscQueue* q)
+{
+    Waiter wait_obj;
+    wait_obj.type = WaiterType_Waitable;
+    wait_obj.waitable = &q->waitable;
+    return wait_obj;
+}
+
+/// Creates a waiter for a multi-producer multi-consumer queue, signaled while the queue is not empty.
+static inline Waiter waiterForMpmcQueue(MpmcQueue* q)
+{
+    Waiter wait_obj;
+    wait_obj.type = WaiterType_Waitable;
+    wait_obj.waitable = &q->waitable;
+    return wait_obj;
+}
+
+/**
+ * @brief Initializes a single-producer single-consumer queue.
+ * @param[out] q Queue object.
+ * @param[in] storage Storage for the elements, of size \ref SPSCQUEUE_STORAGE_SIZE.
+ * @param[in] elem_size Size of an element.
+ * @param[in] capacity Maximum number of elements in the queue, must be a power of two.
+ * @return Result code.
+ * @note A single thread may push elements at a time, and a single thread may pop elements at a time.
+ */
+Result spscqueueInit(SpscQueue* q, void* storage, u32 elem_size, u32 capacity);
+
+/**
+ * @brief Pushes an element to a single-producer single-consumer queue without waiting.
+ * @param[in] q Queue object.
+ * @param[in] elem Element to copy into the queue.
+ * @return true if the element was pushed, false if the queue is full.
+ */
+bool spscqueueTryPush(SpscQueue* q, const void* elem);
+
+/**
+ * @brief Pops an element from a single-producer single-consumer queue without waiting.
+ * @param[in] q Queue object.
+ * @param[out] elem Output element.
+ * @return true if an element was popped, false if the queue is empty.
+ */
+bool spscqueueTryPop(SpscQueue* q, void* elem);
+
+/**
+ * @brief Pushes an element to a single-producer single-consumer queue, waiting while the queue is full.
+ * @param[in] q Queue object.
+ * @param[in] elem Element to copy into the queue.
+ * @param[in] timeout_ns Timeout in nanoseconds (pass UINT64_MAX to wait indefinitely).
+ * @return true if the element was pushed, false on timeout.
+ */
+bool spscqueuePush(SpscQueue* q, const void* elem, u64 timeout_ns);
+
+/**
+ * @brief Pops an element from a single-producer single-consumer queue, waiting while the queue is empty.
+ * @param[in] q Queue object.
+ * @param[out] elem Output element.
+ * @param[in] timeout_ns Timeout in nanoseconds (pass UINT64_MAX to wait indefinitely).
+ * @return true if an element was popped, false on timeout.
+ */
+bool spscqueuePop(SpscQueue* q, void* elem, u64 timeout_ns);
+
+/**
+ * @brief Gets the number of elements in a single-producer single-consumer queue.
+ * @param[in] q Queue object.
+ * @note The result is only a snapshot if the queue is being used by other threads.
+ */
+NX_INLINE u32 spscqueueGetCount(SpscQueue* q)
+{
+    return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Initializes a multi-producer multi-consumer queue.
+ * @param[out] q Queue object.
+ * @param[in] storage Storage for the elements, of size \ref MPMCQUEUE_STORAGE_SIZE (must be 8-byte aligned).
+ * @param[in] elem_size Size of an element.
+ * @param[in] capacity Maximum number of elements in the queue, must be a power of two.
+ * @return Result code.
+ */
+Result mpmcqueueInit(MpmcQueue* q, void* storage, u32 elem_size, u32 capacity);
+
+/**
+ * @brief Pushes an element to a multi-producer multi-consumer queue without waiting.
+ * @param[in] q Queue object.
+ * @param[in] elem Element to copy into the queue.
+ * @return true if the element was pushed, false if the queue is full.
+ */
+bool mpmcqueueTryPush(MpmcQueue* q, const void* elem);
+
+/**
+ * @brief Pops an element from a multi-producer multi-consumer queue without waiting.
+ * @param[in] q Queue object.
+ * @param[out] elem Output element.
+ * @return true if an element was popped, false if the queue is empty.
+ */
+bool mpmcqueueTryPop(MpmcQueue* q, void* elem);
+
+/**
+ * @brief Pushes an element to a multi-producer multi-consumer queue, waiting while the queue is full.
+ * @param[in] q Queue object.
+ * @param[in] elem Element to copy into the queue.
+ * @param[in] timeout_ns Timeout in nanoseconds (pass UINT64_MAX to wait indefinitely).
+ * @return true if the element was pushed, false on timeout.
+ */
+bool mpmcqueuePush(MpmcQueue* q, const void* elem, u64 timeout_ns);
+
+/**
+ * @brief Pops an element from a multi-producer multi-consumer queue, waiting while the queue is empty.
+ * @param[in] q Queue object.
+ * @param[out] elem Output element.
+ * @param[in] timeout_ns Timeout in nanoseconds (pass UINT64_MAX to wait indefinitely).
+ * @return true if an element was popped, false on timeout.
+ */
+bool mpmcqueuePop(MpmcQueue* q, void* elem, u64 timeout_ns);
+
+/**
+ * @brief Gets the approximate number of elements in a multi-producer multi-consumer queue.
+ * @param[in] q Queue object.
+ * @note Elements being pushed or popped by other threads may or may not be counted.
+ */
+NX_INLINE u32 mpmcqueueGetCount(MpmcQueue* q)
+{
+    const u32 dequeue_pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_ACQUIRE);
+    const u32 enqueue_pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_ACQUIRE);
+    return (s32)(enqueue_pos - dequeue_pos) > 0 ? enqueue_pos - dequeue_pos : 0;
+}
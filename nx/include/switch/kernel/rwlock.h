@@ -6,20 +6,39 @@
  */
 #pragma once
 #include "../kernel/mutex.h"
-#include "../kernel/condvar.h"
 
-/// Read/write lock structure.
+/// Number of reader counters in a \ref DistRwLock.
+#define DRWLOCK_NUM_STRIPES 4
+
+/**
+ * @brief Read/write lock structure.
+ * @note Readers acquire the lock with a single atomic operation on the state word when no writer is
+ *       waiting. Writers are preferred: once a writer is waiting, new readers block until it is done.
+ */
 typedef struct {
-    Mutex mutex;
-    CondVar condvar_reader_wait;
-    CondVar condvar_writer_wait;
-    u32 read_lock_count;
-    u32 read_waiter_count;
+    u32 state;              ///< Reader count and wait flags.
+    Mutex write_mutex;      ///< Serializes writers, held for the whole duration of the write lock.
     u32 write_lock_count;
-    u32 write_waiter_count;
+    u32 read_lock_count;    ///< Read locks taken by the thread holding the write lock.
     u32 write_owner_tag;
 } RwLock;
 
+/**
+ * @brief Read-mostly read/write lock structure, with reader counters spread over several cache lines.
+ * @note Readers only touch one of the counters (selected from the current thread), so readers running on
+ *       different cores don't contend on a single cache line. This makes write locking more expensive, and
+ *       unlike \ref RwLock, recursive locking is not supported.
+ * @note The structure should be 64-byte aligned to avoid false sharing between the counters.
+ */
+typedef struct {
+    struct {
+        u32 count;
+        u32 padding[15];
+    } stripes[DRWLOCK_NUM_STRIPES];
+    u32 write_pending;
+    Mutex write_mutex;
+} DistRwLock;
+
 /**
  * @brief Initializes the read/write lock.
  * @param r Read/write lock object.
@@ -78,3 +97,48 @@ bool rwlockIsWriteLockHeldByCurrentThread(RwLock* r);
  *         while it held the write lock, and 0 if it does not.
  */
 bool rwlockIsOwnedByCurrentThread(RwLock* r);
+
+/**
+ * @brief Initializes a read-mostly read/write lock.
+ * @param r Read-mostly read/write lock object.
+ */
+void drwlockInit(DistRwLock* r);
+
+/**
+ * @brief Locks a read-mostly read/write lock for reading.
+ * @param r Read-mostly read/write lock object.
+ * @note The lock must be released by the same thread.
+ */
+void drwlockReadLock(DistRwLock* r);
+
+/**
+ * @brief Attempts to lock a read-mostly read/write lock for reading without waiting.
+ * @param r Read-mostly read/write lock object.
+ * @return 1 if the lock has been acquired successfully, and 0 on contention.
+ */
+bool drwlockTryReadLock(DistRwLock* r);
+
+/**
+ * @brief Unlocks a read-mostly read/write lock for reading.
+ * @param r Read-mostly read/write lock object.
+ */
+void drwlockReadUnlock(DistRwLock* r);
+
+/**
+ * @brief Locks a read-mostly read/write lock for writing.
+ * @param r Read-mostly read/write lock object.
+ */
+void drwlockWriteLock(DistRwLock* r);
+
+/**
+ * @brief Attempts to lock a read-mostly read/write lock for writing without waiting.
+ * @param r Read-mostly read/write lock object.
+ * @return 1 if the lock has been acquired successfully, and 0 on contention.
+ */
+bool drwlockTryWriteLock(DistRwLock* r);
+
+/**
+ * @brief Unlocks a read-mostly read/write lock for writing.
+ * @param r Read-mostly read/write lock object.
+ */
+void drwlockWriteUnlock(DistRwLock* r);
@@ -0,0 +1,139 @@
+/**
+ * @file sched.h
+ * @brief Thread groups with core affinity and priority policies, and per-core load sampling.
+ * @copyright libnx Authors
+ *
+ * A \ref SchedGroup applies a core mask, a priority and an affinity policy to every thread added to it, and reapplies
+ * them when the policy of the group changes. Groups are registered by name, so that independent parts of a program
+ * can share them. The helper threads started by libnx itself (\ref EventLoop shards and \ref SessionMgr batch
+ * helpers) join the group selected with \ref schedSetHelperGroup, if any.
+ *
+ * Core load is sampled with \ref schedSampleCores, which reads the idle tick counter of each core, and turned into a
+ * busy fraction per core by \ref schedGetCoreLoad, from two samples. Both are meant to be polled periodically.
+ */
+#pragma once
+#include "../types.h"
+#include "mutex.h"
+
+#define SCHED_NUM_CORES          4  ///< Number of CPU cores.
+#define SCHED_GROUP_NAME_LEN     16 ///< Maximum length of a group name, including the terminator.
+#define SCHED_GROUP_MAX_THREADS  32 ///< Maximum number of threads in a group.
+
+/// Affinity policies.
+typedef enum {
+    SchedAffinity_Any      = 0, ///< Threads may run on any core of the group mask, the kernel picks the core.
+    SchedAffinity_Pinned   = 1, ///< Each thread is pinned to a single core of the group mask, assigned round-robin.
+    SchedAffinity_Balanced = 2, ///< Each thread is pinned to the core of the group mask with the fewest threads of the group.
+} SchedAffinityPolicy;
+
+/// Thread group.
+typedef struct SchedGroup {
+    struct SchedGroup* next;
+    Mutex mutex;
+    char name[SCHED_GROUP_NAME_LEN];
+    u64 core_mask;                             ///< Cores the threads may run on (restricted to the cores of the process).
+    s32 priority;                              ///< Priority of the threads, or -1 to leave it unchanged.
+    SchedAffinityPolicy policy;                ///< \ref SchedAffinityPolicy.
+    u32 next_core;                             ///< Round-robin cursor for \ref SchedAffinity_Pinned.
+    u32 num_threads;
+    Handle threads[SCHED_GROUP_MAX_THREADS];
+    s8 thread_cores[SCHED_GROUP_MAX_THREADS];  ///< Core each thread is pinned to, or -1.
+} SchedGroup;
+
+/// Sample of the idle tick counters of the cores.
+typedef struct {
+    u64 tick;                           ///< System tick at which the sample was taken.
+    u64 core_mask;                      ///< Cores which were sampled.
+    u64 idle_ticks[SCHED_NUM_CORES];    ///< Idle tick counter of each sampled core.
+} SchedCoreSample;
+
+/**
+ * @brief Creates a thread group and registers it under its name.
+ * @param[out] g Thread group.
+ * @param[in] name Name of the group.
+ * @param[in] core_mask Cores the threads may run on.
+ * @param[in] priority Priority of the threads, or -1 to leave it unchanged.
+ * @param[in] policy \ref SchedAffinityPolicy.
+ * @return Result code. LibnxError_AlreadyInitialized if a group with the same name exists.
+ */
+Result schedGroupCreate(SchedGroup* g, const char* name, u64 core_mask, s32 priority, SchedAffinityPolicy policy);
+
+/**
+ * @brief Unregisters a thread group. The threads keep their current affinity and priority.
+ * @param[in] g Thread group.
+ */
+void schedGroupClose(SchedGroup* g);
+
+/**
+ * @brief Finds a registered thread group by name.
+ * @param[in] name Name of the group.
+ * @return Thread group, or NULL if there is none with this name.
+ */
+SchedGroup* schedGroupFind(const char* name);
+
+/**
+ * @brief Changes the policy of a thread group, and reapplies it to all of its threads.
+ * @param[in] g Thread group.
+ * @param[in] core_mask Cores the threads may run on.
+ * @param[in] priority Priority of the threads, or -1 to leave it unchanged.
+ * @param[in] policy \ref SchedAffinityPolicy.
+ * @return Result code of the first failure, if any.
+ */
+Result schedGroupSetPolicy(SchedGroup* g, u64 core_mask, s32 priority, SchedAffinityPolicy policy);
+
+/**
+ * @brief Adds a thread to a group, applying the policy of the group to it.
+ * @param[in] g Thread group.
+ * @param[in] thread Thread handle. The handle must stay open while the thread is in the group.
+ * @return Result code.
+ */
+Result schedGroupAddThread(SchedGroup* g, Handle thread);
+
+/**
+ * @brief Removes a thread from a group. The thread keeps its current affinity and priority.
+ * @param[in] g Thread group.
+ * @param[in] thread Thread handle.
+ */
+void schedGroupRemoveThread(SchedGroup* g, Handle thread);
+
+/**
+ * @brief Gets the CPU time used by the threads of a group.
+ * @param[in] g Thread group.
+ * @param[out] out_ticks Sum of the tick counts of the threads, on all cores.
+ * @return Result code.
+ */
+Result schedGroupGetTicks(SchedGroup* g, u64* out_ticks);
+
+/**
+ * @brief Selects the group which the helper threads started by libnx join.
+ * @param[in] g Thread group, or NULL for none (helper threads then run on the default core of the process).
+ * @note This only affects helper threads started afterwards.
+ */
+void schedSetHelperGroup(SchedGroup* g);
+
+/**
+ * @brief Gets the CPU time used by a thread.
+ * @param[in] thread Thread handle.
+ * @param[in] core Core to get the time of, or -1 for all cores.
+ * @param[out] out_ticks Tick count.
+ * @return Result code.
+ */
+Result schedGetThreadTicks(Handle thread, s32 core, u64* out_ticks);
+
+/**
+ * @brief Samples the idle tick counters of the cores of the process.
+ * @param[out] out Sample.
+ * @return Result code. Cores which can't be sampled (the thread didn't get to run on them in time, or their counter
+ *         couldn't be read) are left out of out->core_mask instead of failing the whole sample.
+ * @note The idle tick counter of a core can only be read from that core, so the calling thread briefly migrates to
+ *       each core of the process. Its core mask is restored afterwards.
+ */
+Result schedSampleCores(SchedCoreSample* out);
+
+/**
+ * @brief Computes the load of each core between two samples.
+ * @param[in] prev Older sample.
+ * @param[in] cur Newer sample.
+ * @param[out] out_load Busy fraction of each core, between 0 and 1 (0 for the cores which weren't sampled).
+ */
+void schedGetCoreLoad(const SchedCoreSample* prev, const SchedCoreSample* cur, float out_load[SCHED_NUM_CORES]);
@@ -6,9 +6,16 @@
  */
 #pragma once
 #include "../types.h"
+#include "../arm/tls.h"
 #include "../arm/thread_context.h"
 #include "wait.h"
 
+#define THREAD_STACK_POOL_MAX_ENTRIES 16 ///< Maximum number of stacks kept in the thread stack pool.
+
+#define THREAD_TLS_INLINE_OFFSET 0x180 ///< Offset of the TLS slot array in the thread local region.
+#define THREAD_TLS_NUM_INLINE    11    ///< Number of TLS slots stored directly in the thread local region.
+#define THREAD_TLS_MAX_SLOTS     256   ///< Total number of TLS slots. Slots past the inline ones are stored in a per-thread array, allocated on first use.
+
 /// Thread information structure.
 typedef struct Thread {
     Handle handle;         ///< Thread handle.
@@ -42,6 +49,19 @@ Result threadCreate(
     Thread* t, ThreadFunc entry, void* arg, void *stack_mem, size_t stack_sz,
     int prio, int cpuid);
 
+/**
+ * @brief Sets the maximum amount of memory kept in the thread stack pool (0 by default, which disables it).
+ * @param max_size Maximum total size of the pooled stacks, including their tls and reent.
+ * @note When enabled, stacks allocated by \ref threadCreate stay mapped after \ref threadClose, and are reused by threads created with the same stack size. This avoids the allocation and the svcMapMemory/svcUnmapMemory calls.
+ */
+void threadStackPoolSetLimit(size_t max_size);
+
+/**
+ * @brief Releases pooled thread stacks until the pool holds at most the specified amount of memory.
+ * @param max_size Maximum total size of the pooled stacks to keep (0 to release all of them).
+ */
+void threadStackPoolTrim(size_t max_size);
+
 /**
  * @brief Starts the execution of a thread.
  * @param t Thread information structure.
@@ -107,25 +127,41 @@ Handle threadGetCurHandle(void);
  * @brief Allocates a TLS slot.
  * @param destructor Function to run automatically when a thread exits.
  * @return TLS slot ID on success, or a negative value on failure.
+ * @note The lowest free slot is returned, so the first \ref THREAD_TLS_NUM_INLINE slots (the fastest to access) go to the first users.
  */
 s32 threadTlsAlloc(void (* destructor)(void*));
 
+/// Retrieves the value stored in a TLS slot past the inline ones. Use \ref threadTlsGet instead.
+void* threadTlsGetExtended(s32 slot_id);
+
+/// Stores a value into a TLS slot past the inline ones, growing the per-thread array if needed. Use \ref threadTlsSet instead.
+void threadTlsSetExtended(s32 slot_id, void* value);
+
 /**
  * @brief Retrieves the value stored in a TLS slot.
  * @param slot_id TLS slot ID.
  * @return Value.
  */
-void* threadTlsGet(s32 slot_id);
+static inline void* threadTlsGet(s32 slot_id) {
+    if (__builtin_expect(slot_id < THREAD_TLS_NUM_INLINE, 1))
+        return ((void**)((u8*)armGetTls() + THREAD_TLS_INLINE_OFFSET))[slot_id];
+    return threadTlsGetExtended(slot_id);
+}
 
 /**
  * @brief Stores the specified value into a TLS slot.
  * @param slot_id TLS slot ID.
  * @param value Value.
  */
-void threadTlsSet(s32 slot_id, void* value);
+static inline void threadTlsSet(s32 slot_id, void* value) {
+    if (__builtin_expect(slot_id < THREAD_TLS_NUM_INLINE, 1))
+        ((void**)((u8*)armGetTls() + THREAD_TLS_INLINE_OFFSET))[slot_id] = value;
+    else
+        threadTlsSetExtended(slot_id, value);
+}
 
 /**
- * @brief Frees a TLS slot.
+ * @brief Frees a TLS slot, clearing its value in all threads.
  * @param slot_id TLS slot ID.
  */
 void threadTlsFree(s32 slot_id);
@@ -0,0 +1,104 @@
+/**
+ * @file timerwheel.h
+ * @brief Hierarchical timer wheel, multiplexing many user-mode timers onto a single waitable object.
+ * @copyright libnx Authors
+ *
+ * Timers are kept in a hierarchical wheel of \ref TIMERWHEEL_LEVELS levels of \ref TIMERWHEEL_SLOTS slots each,
+ * so starting and cancelling a timer are O(1) regardless of the number of timers. The wheel is signaled
+ * whenever timers have expired; their callbacks are then run in a batch by \ref timerwheelProcess.
+ */
+#pragma once
+#include "wait.h"
+
+#define TIMERWHEEL_LEVELS 4  ///< Number of levels of the wheel.
+#define TIMERWHEEL_SLOTS  64 ///< Number of slots per level.
+
+typedef struct TimerWheel TimerWheel;
+typedef struct TimerWheelTimer TimerWheelTimer;
+
+/// Timer callback, run from \ref timerwheelProcess.
+typedef void (*TimerWheelCallback)(TimerWheelTimer* timer, void* userdata);
+
+/// Timer managed by a \ref TimerWheel.
+struct TimerWheelTimer {
+    TimerWheelTimer* prev;
+    TimerWheelTimer* next;
+    TimerWheelTimer* fire_next;
+    u64 expires;                  ///< Expiration time, in wheel ticks.
+    u64 interval;                 ///< Period in wheel ticks for repeating timers, 0 for one-shot timers.
+    TimerWheelCallback callback;
+    void* userdata;
+    u8 state;
+    u8 level;
+    u8 slot;
+};
+
+/// Timer wheel object.
+struct TimerWheel {
+    Waitable waitable;
+    u64 base_tick;                ///< System tick corresponding to wheel tick 0.
+    u64 resolution;               ///< Length of a wheel tick, in system ticks.
+    u64 current;                  ///< First wheel tick not processed yet.
+    u64 armed;                    ///< Wheel tick a waiter is currently waiting for.
+    u64 occupied[TIMERWHEEL_LEVELS];
+    TimerWheelTimer* slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+    TimerWheelTimer* expired;     ///< Timers which have expired, waiting for \ref timerwheelProcess.
+};
+
+/// Creates a waiter for a timer wheel, signaled when timers have expired.
+static inline Waiter waiterForTimerWheel(TimerWheel* tw)
+{
+    Waiter wait_obj;
+    wait_obj.type = WaiterType_Waitable;
+    wait_obj.waitable = &tw->waitable;
+    return wait_obj;
+}
+
+/**
+ * @brief Creates a timer wheel.
+ * @param[out] tw TimerWheel object.
+ * @param[in] resolution_ns Length of a wheel tick, in nanoseconds. Timer expirations are rounded up to it.
+ * @note Timers further away than TIMERWHEEL_SLOTS^TIMERWHEEL_LEVELS wheel ticks are supported, but moved around the
+ *       top level several times before expiring.
+ */
+void timerwheelCreate(TimerWheel* tw, u64 resolution_ns);
+
+/**
+ * @brief Initializes a timer.
+ * @param[out] t Timer.
+ * @param[in] callback Callback run when the timer expires.
+ * @param[in] userdata User data passed to the callback.
+ */
+void timerwheelTimerInit(TimerWheelTimer* t, TimerWheelCallback callback, void* userdata);
+
+/**
+ * @brief Starts (or restarts) a timer.
+ * @param[in] tw TimerWheel object.
+ * @param[in] t Timer.
+ * @param[in] timeout_ns Time until the timer expires, in nanoseconds.
+ * @param[in] interval_ns Period for a repeating timer, or 0 for a one-shot timer.
+ */
+void timerwheelStart(TimerWheel* tw, TimerWheelTimer* t, u64 timeout_ns, u64 interval_ns);
+
+/**
+ * @brief Cancels a timer. Its callback won't be run anymore, even if it had already expired.
+ * @param[in] tw TimerWheel object.
+ * @param[in] t Timer.
+ * @note A timer must be cancelled (or have expired, for one-shot timers) before its memory can be reused.
+ */
+void timerwheelCancel(TimerWheel* tw, TimerWheelTimer* t);
+
+/**
+ * @brief Returns whether a timer is started (or expired and waiting for its callback to be run).
+ * @param[in] t Timer.
+ */
+bool timerwheelTimerIsActive(TimerWheelTimer* t);
+
+/**
+ * @brief Runs the callbacks of all the timers which have expired, and restarts repeating timers.
+ * @param[in] tw TimerWheel object.
+ * @return Number of callbacks run.
+ * @note Callbacks may start or cancel any timer of the wheel, but must not free a timer while it may still be
+ *       run by this function (including the timer being run, if it is a repeating timer).
+ */
+u32 timerwheelProcess(TimerWheel* tw);
@@ -0,0 +1,57 @@
+/**
+ * @file tmemcache.h
+ * @brief Cache of transfer memory objects, reused across service sessions.
+ * @copyright libnx Authors
+ *
+ * Services such as hwopus, irs or audren take a transfer memory object at session creation time. Creating it costs a
+ * heap allocation, and re-creating sessions in a loop (e.g. one decoder per track) churns the heap with large blocks.
+ * This cache can keep the memory of released transfer memory objects around, so that the next request with the same
+ * size gets the same memory back, wrapped in a new transfer memory object. Memory is only kept up to the limit set with
+ * \ref tmemcacheSetLimit, which is 0 by default: the memory is then freed on release, like with \ref tmemClose.
+ *
+ * A new object is needed since the service may not have unmapped the previous one yet when its session is closed, and a
+ * transfer memory object can only be mapped once at a time. Cached memory is only reused once the kernel has given it
+ * back, which happens when the previous object is unmapped; if that takes too long, new memory is allocated instead.
+ *
+ * Objects created over a caller provided buffer are shared by everyone passing the same buffer, size and permissions
+ * while they are in use, and are reference counted. They are closed when released by their last user.
+ */
+#pragma once
+#include "../types.h"
+#include "tmem.h"
+
+#define TMEMCACHE_MAX_ENTRIES 16 ///< Maximum number of transfer memory objects tracked by the cache.
+
+/**
+ * @brief Acquires a transfer memory object from the cache, creating it if needed.
+ * @param[out] t Transfer memory information structure that will be filled in.
+ * @param[in] buf Page-aligned buffer to create the object over, or NULL to have the cache provide the memory (like \ref tmemCreate).
+ * @param[in] size Size of the transfer memory object.
+ * @param[in] perm Permissions with which to protect the transfer memory in the local process.
+ * @return Result code.
+ * @note Memory provided by the cache is cleared, like with \ref tmemCreate, including when it is reused.
+ * @note The object must be given back with \ref tmemcacheRelease, and never with \ref tmemClose.
+ */
+Result tmemcacheAcquire(TransferMemory* t, void* buf, size_t size, Permission perm);
+
+/**
+ * @brief Gives back a transfer memory object acquired with \ref tmemcacheAcquire.
+ * @param[in] t Transfer memory information structure, which is cleared.
+ * @note The transfer memory handle is closed. Memory owned by the cache is kept for later reuse, as long as the total
+ *       amount of unused memory kept stays within the limit set with \ref tmemcacheSetLimit. Otherwise it is freed.
+ */
+void tmemcacheRelease(TransferMemory* t);
+
+/**
+ * @brief Sets the maximum amount of unused memory kept by the cache (0 by default, which disables reuse).
+ * @param[in] max_size Maximum total size of the memory kept from released objects.
+ * @note Unused memory over the new limit is freed, least recently released first. This waits for the services
+ *       which used the memory last to unmap it.
+ */
+void tmemcacheSetLimit(size_t max_size);
+
+/**
+ * @brief Frees the memory of all unused entries of the cache.
+ * @note This waits for the services which used the memory last to unmap it.
+ */
+void tmemcacheFlush(void);
@@ -126,6 +126,11 @@ enum {
     LibnxError_InvalidCmifOutHeader,
     LibnxError_ShouldNotHappen,
     LibnxError_Timeout,
+    LibnxError_InvalidCmifInHeader,
+    LibnxError_CmifCommandNotFound,
+    LibnxError_DomainObjectNotFound,
+    LibnxError_ServerFull,
+    LibnxError_ServerResponseTooLarge,
 };
 
 /// libnx binder error codes
@@ -22,6 +22,8 @@ typedef struct  {
 
     u32 num_bsd_sessions;                       ///< Number of BSD service sessions (typically 3).
     BsdServiceType bsd_service_type;            ///< BSD service type (typically \ref BsdServiceType_User).
+
+    u32 max_bsd_sessions;                       ///< Maximum number of BSD service sessions the pool may grow to under contention (0 to keep the number of sessions fixed).
 } SocketInitConfig;
 
 /// Fetch the default configuration for the socket driver.
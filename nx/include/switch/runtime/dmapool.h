@@ -0,0 +1,94 @@
+/**
+ * @file dmapool.h
+ * @brief Pool of page-aligned buffers for IPC transfers and devices.
+ * @copyright libnx Authors
+ *
+ * A DmaPool allocates its backing memory once, and optionally maps it once as a transfer memory object and/or
+ * as a nvmap object. Buffers are then handed out by a buddy allocator, in power-of-two multiples of 4 KiB aligned
+ * to their size, so that acquiring and releasing them never needs any allocation, syscall or IPC.
+ *
+ * The bookkeeping is kept outside of the pool memory, which can therefore be made inaccessible to the process
+ * (e.g. by a transfer memory object created with \ref Perm_None) without breaking the allocator.
+ */
+#pragma once
+#include "../types.h"
+#include "../kernel/mutex.h"
+#include "../kernel/tmem.h"
+#include "../nvidia/map.h"
+
+#define DMAPOOL_PAGE_SIZE  0x1000 ///< Granularity of the pool.
+#define DMAPOOL_NUM_ORDERS 20     ///< Number of buddy orders (largest block: DMAPOOL_PAGE_SIZE << (DMAPOOL_NUM_ORDERS-1)).
+
+/// DmaPool creation flags.
+typedef enum {
+    DmaPoolFlags_None           = 0,      ///< Plain page-aligned memory.
+    DmaPoolFlags_TransferMemory = BIT(0), ///< Create a transfer memory object over the whole pool.
+    DmaPoolFlags_NvMap          = BIT(1), ///< Create a nvmap object over the whole pool (\ref nvMapInit must have been called).
+} DmaPoolFlags;
+
+/// DmaPool structure.
+typedef struct {
+    Mutex mutex;
+    void* addr;                         ///< Pool memory.
+    size_t size;                        ///< Size of the pool memory.
+    u32 num_pages;
+    u32 flags;                          ///< \ref DmaPoolFlags.
+    size_t free_size;                   ///< Amount of free memory.
+    u8* page_order;                     ///< Per page: order of the block starting at this page, with the free flag.
+    u32* next;                          ///< Per page: links of the free block starting at this page.
+    u32* prev;
+    u32 free_heads[DMAPOOL_NUM_ORDERS];
+    TransferMemory tmem;                ///< Transfer memory object, with \ref DmaPoolFlags_TransferMemory.
+    NvMap nvmap;                        ///< Nvmap object, with \ref DmaPoolFlags_NvMap.
+} DmaPool;
+
+/**
+ * @brief Creates a DmaPool.
+ * @param[out] p DmaPool.
+ * @param[in] size Size of the pool (rounded up to \ref DMAPOOL_PAGE_SIZE).
+ * @param[in] flags \ref DmaPoolFlags.
+ * @param[in] tmem_perm Permissions with which to protect the pool memory in the local process, with \ref DmaPoolFlags_TransferMemory.
+ * @return Result code.
+ */
+Result dmapoolCreate(DmaPool* p, size_t size, u32 flags, Permission tmem_perm);
+
+/**
+ * @brief Closes a DmaPool, freeing its memory and closing its transfer memory and nvmap objects.
+ * @param[in] p DmaPool.
+ */
+void dmapoolClose(DmaPool* p);
+
+/**
+ * @brief Allocates a buffer from a DmaPool.
+ * @param[in] p DmaPool.
+ * @param[in] size Size of the buffer, rounded up to a power-of-two multiple of \ref DMAPOOL_PAGE_SIZE.
+ * @return Buffer aligned to its rounded size, or NULL if the pool has no free block large enough.
+ */
+void* dmapoolAlloc(DmaPool* p, size_t size);
+
+/**
+ * @brief Returns a buffer to a DmaPool.
+ * @param[in] p DmaPool.
+ * @param[in] buf Buffer allocated with \ref dmapoolAlloc.
+ */
+void dmapoolFree(DmaPool* p, void* buf);
+
+/// Returns the offset of a buffer in the pool, e.g. for use with the transfer memory or nvmap object of the pool.
+NX_CONSTEXPR size_t dmapoolGetOffset(DmaPool* p, const void* buf) {
+    return (uintptr_t)buf - (uintptr_t)p->addr;
+}
+
+/// Returns the transfer memory object of the pool (only valid with \ref DmaPoolFlags_TransferMemory).
+NX_CONSTEXPR TransferMemory* dmapoolGetTransferMemory(DmaPool* p) {
+    return &p->tmem;
+}
+
+/// Returns the nvmap object of the pool (only valid with \ref DmaPoolFlags_NvMap).
+NX_CONSTEXPR NvMap* dmapoolGetNvMap(DmaPool* p) {
+    return &p->nvmap;
+}
+
+/// Returns the amount of free memory in the pool.
+NX_CONSTEXPR size_t dmapoolGetFreeSize(DmaPool* p) {
+    return p->free_size;
+}
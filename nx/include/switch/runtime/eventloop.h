@@ -0,0 +1,198 @@
+/**
+ * @file eventloop.h
+ * @brief Event loop dispatching callbacks for kernel handles, user-mode waitables and sockets.
+ * @copyright libnx Authors
+ *
+ * Sources stay registered with the loop until removed, so the wait set is not rebuilt by the caller on every
+ * iteration, and their number is not limited by \ref MAX_WAIT_OBJECTS: the first \ref EVENTLOOP_SHARD_SIZE waiter
+ * sources are waited on by the thread running the loop, and further sources are spread over helper threads which
+ * forward them to the loop once signaled. Socket sources are waited on with \ref bsdPoll by a dedicated helper thread.
+ *
+ * All callbacks are run on the thread running the loop. A source is not waited on while it is pending dispatch or
+ * while its callback is running, and is waited on again once its callback has returned.
+ */
+#pragma once
+#include "../types.h"
+#include "../kernel/mutex.h"
+#include "../kernel/condvar.h"
+#include "../kernel/thread.h"
+#include "../kernel/event.h"
+#include "../kernel/uevent.h"
+#include "../kernel/utimer.h"
+
+#define EVENTLOOP_SHARD_SIZE (MAX_WAIT_OBJECTS-1) ///< Maximum number of waiter sources handled by a single thread.
+#define EVENTLOOP_SOCKET_POLL_INTERVAL_MS 100     ///< Poll timeout used by the socket thread when it can't be woken up otherwise.
+
+typedef struct EventLoop EventLoop;
+typedef struct EventLoopShard EventLoopShard;
+typedef struct EventLoopSource EventLoopSource;
+typedef struct EventLoopWork EventLoopWork;
+
+/// Source callback, run on the thread running the loop once the source is signaled.
+typedef void (*EventLoopCallback)(EventLoop* loop, EventLoopSource* src, void* userdata);
+
+/// Work function posted with \ref eventloopPost.
+typedef void (*EventLoopWorkFunc)(EventLoop* loop, void* userdata);
+
+/// Source type.
+typedef enum {
+    EventLoopSourceType_Waiter = 0, ///< Any \ref Waiter (kernel handle, \ref Event, \ref UEvent, \ref UTimer...).
+    EventLoopSourceType_Socket = 1, ///< BSD socket descriptor, waited on with \ref bsdPoll.
+} EventLoopSourceType;
+
+/// Source registered with an event loop.
+struct EventLoopSource {
+    EventLoopSource* prev;         ///< Links in the list of sources of the shard.
+    EventLoopSource* next;
+    EventLoopSource* ready_prev;   ///< Links in the list of sources pending dispatch.
+    EventLoopSource* ready_next;
+    EventLoopShard* shard;         ///< Shard the source is registered with, NULL if not registered.
+    EventLoopCallback callback;
+    void* userdata;
+    Waiter waiter;                 ///< Waiter, for \ref EventLoopSourceType_Waiter.
+    int fd;                        ///< Socket descriptor, for \ref EventLoopSourceType_Socket.
+    s16 events;                    ///< Poll events waited for, for \ref EventLoopSourceType_Socket.
+    s16 revents;                   ///< Poll events reported, valid during the callback of a socket source.
+    u8 type;                       ///< \ref EventLoopSourceType.
+    u8 state;
+};
+
+/// Work item posted to an event loop.
+struct EventLoopWork {
+    EventLoopWork* next;
+    EventLoopWorkFunc func;
+    void* userdata;
+};
+
+/// Set of sources waited on by a single thread.
+struct EventLoopShard {
+    EventLoopShard* next;
+    EventLoop* loop;
+    Thread thread;
+    UEvent control;                ///< Signaled when the set of sources waited on changes.
+    bool is_socket;
+    bool waiting;                  ///< Whether the thread is currently waiting on its sources.
+    u32 seq;                       ///< Incremented every time the thread stops waiting.
+    u32 num_sources;
+    EventLoopSource* sources;
+};
+
+/// Event loop structure.
+struct EventLoop {
+    Mutex mutex;
+    CondVar seq_condvar;           ///< Signaled when a shard stops waiting or a callback returns (see seq and dispatch_seq).
+    UEvent wakeup;                 ///< Wakes up the thread running the loop.
+    bool exiting;
+    bool stop;
+    int prio;
+    size_t stack_sz;
+    Handle owner;                  ///< Thread currently running the loop.
+    EventLoopShard main;           ///< Sources waited on by the thread running the loop.
+    EventLoopShard* helpers;       ///< Sources waited on by helper threads.
+    EventLoopShard* sockets;       ///< Socket sources, created on demand.
+    int wake_fd;                   ///< Loopback datagram socket used to wake up the socket thread, or -1.
+    EventLoopSource* ready_head;
+    EventLoopSource* ready_tail;
+    u32 num_ready;
+    EventLoopSource* dispatching;  ///< Source whose callback is currently running.
+    u32 dispatch_seq;              ///< Incremented every time a callback returns.
+    EventLoopWork* work_head;
+    EventLoopWork* work_tail;
+};
+
+/**
+ * @brief Creates an event loop.
+ * @param[out] loop Event loop (must stay at the same address until closed).
+ * @param[in] prio Priority of the helper threads, created on demand.
+ * @param[in] stack_sz Stack size of the helper threads.
+ * @return Result code.
+ */
+Result eventloopCreate(EventLoop* loop, int prio, size_t stack_sz);
+
+/**
+ * @brief Stops the helper threads of an event loop and frees its resources.
+ * @param[in] loop Event loop.
+ * @note The loop must not be running. Sources still registered are dropped, and posted work which hasn't run yet is discarded.
+ */
+void eventloopClose(EventLoop* loop);
+
+/**
+ * @brief Registers a waiter source.
+ * @param[in] loop Event loop.
+ * @param[out] src Source, which must stay valid until removed.
+ * @param[in] waiter Waiter to wait on.
+ * @param[in] callback Callback run every time the waiter is signaled.
+ * @param[in] userdata User data passed to the callback.
+ * @return Result code.
+ * @note Waiters are level-triggered: a kernel event without autoclear must be cleared by the callback, else it is dispatched again.
+ */
+Result eventloopAddWaiter(EventLoop* loop, EventLoopSource* src, Waiter waiter, EventLoopCallback callback, void* userdata);
+
+/**
+ * @brief Registers a socket source.
+ * @param[in] loop Event loop.
+ * @param[out] src Source, which must stay valid until removed.
+ * @param[in] fd BSD socket descriptor (as used by \ref bsdPoll, not a newlib file descriptor).
+ * @param[in] events Poll events to wait for (POLLIN, POLLOUT...). Reported events are found in src->revents.
+ * @param[in] callback Callback run every time the socket is ready.
+ * @param[in] userdata User data passed to the callback.
+ * @return Result code.
+ */
+Result eventloopAddSocket(EventLoop* loop, EventLoopSource* src, int fd, s16 events, EventLoopCallback callback, void* userdata);
+
+/// Registers a kernel \ref Event source. See \ref eventloopAddWaiter.
+static inline Result eventloopAddEvent(EventLoop* loop, EventLoopSource* src, Event* e, EventLoopCallback callback, void* userdata)
+{
+    return eventloopAddWaiter(loop, src, waiterForEvent(e), callback, userdata);
+}
+
+/// Registers a \ref UEvent source. See \ref eventloopAddWaiter.
+static inline Result eventloopAddUEvent(EventLoop* loop, EventLoopSource* src, UEvent* e, EventLoopCallback callback, void* userdata)
+{
+    return eventloopAddWaiter(loop, src, waiterForUEvent(e), callback, userdata);
+}
+
+/// Registers a \ref UTimer source. See \ref eventloopAddWaiter.
+static inline Result eventloopAddUTimer(EventLoop* loop, EventLoopSource* src, UTimer* t, EventLoopCallback callback, void* userdata)
+{
+    return eventloopAddWaiter(loop, src, waiterForUTimer(t), callback, userdata);
+}
+
+/**
+ * @brief Unregisters a source.
+ * @param[in] loop Event loop.
+ * @param[in] src Source.
+ * @note Once this function returns, the source is not waited on anymore and its callback is not running, so the source and
+ *       the object it waits on may be freed. This can be called from any thread, including from the callback of the source.
+ */
+void eventloopRemove(EventLoop* loop, EventLoopSource* src);
+
+/**
+ * @brief Posts work to be run on the thread running the loop. Can be called from any thread.
+ * @param[in] loop Event loop.
+ * @param[out] work Work item, which must stay valid until its function has been run.
+ * @param[in] func Work function.
+ * @param[in] userdata User data passed to the function.
+ */
+void eventloopPost(EventLoop* loop, EventLoopWork* work, EventLoopWorkFunc func, void* userdata);
+
+/**
+ * @brief Waits until sources are signaled or work is posted, and dispatches them.
+ * @param[in] loop Event loop.
+ * @param[in] timeout Timeout (in nanoseconds).
+ * @return Number of callbacks and work functions run, which may be 0 if the loop was woken up for another reason.
+ * @note Only one thread may run the loop at a time.
+ */
+u32 eventloopRunOnce(EventLoop* loop, u64 timeout);
+
+/**
+ * @brief Runs the loop until \ref eventloopStop is called.
+ * @param[in] loop Event loop.
+ */
+void eventloopRun(EventLoop* loop);
+
+/**
+ * @brief Makes \ref eventloopRun return once the current callback has completed. Can be called from any thread.
+ * @param[in] loop Event loop.
+ */
+void eventloopStop(EventLoop* loop);
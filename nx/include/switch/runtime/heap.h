@@ -0,0 +1,35 @@
+/**
+ * @file heap.h
+ * @brief Program break of the newlib heap, with optional on-demand memory commit.
+ * @copyright libnx Authors
+ *
+ * By default the heap is allocated once at startup (sized by the weak symbol __nx_heap_size), and the program break only moves within it.
+ *
+ * When the weak symbol __nx_heap_growable is set to non-zero, the heap instead reserves a range of the alias region, and maps physical memory
+ * into it with \ref svcMapPhysicalMemory in \ref HEAP_CHUNK_SIZE chunks as the break grows. When the break shrinks (for
+ * example when malloc trims its free memory), whole chunks above it are unmapped again, giving the memory back to the system.
+ */
+#pragma once
+#include "../types.h"
+
+#define HEAP_CHUNK_SIZE 0x200000 ///< Granularity at which memory is mapped into and unmapped from a growable heap.
+
+/// Returns whether the heap is growable. This is false if __nx_heap_growable isn't set, or if \ref svcMapPhysicalMemory isn't usable by the process.
+bool heapIsGrowable(void);
+
+/**
+ * @brief Moves the program break, like sbrk. This is the function used by newlib's malloc.
+ * @param[in] incr Amount by which to grow (or with a negative value, shrink) the heap.
+ * @return Previous program break, or (void*)-1 if the heap can't grow (or shrink) by this amount.
+ */
+void* heapSbrk(ptrdiff_t incr);
+
+/**
+ * @brief Unmaps the memory of a growable heap above the program break.
+ * @param[in] pad Amount of memory to keep mapped above the program break.
+ * @return Amount of memory which was given back to the system.
+ */
+size_t heapTrim(size_t pad);
+
+/// Returns the amount of memory currently mapped into the heap (the whole heap, when it isn't growable).
+size_t heapGetCommittedSize(void);
@@ -0,0 +1,94 @@
+/**
+ * @file memprof.h
+ * @brief Memory usage and allocation profiling.
+ * @copyright libnx Authors
+ *
+ * When enabled with \ref memprofSetEnabled, allocations made through __libnx_alloc/__libnx_aligned_alloc are
+ * recorded per call site (return address of the allocation call), with the number of live bytes and allocations.
+ * Live allocations are tracked in lock-free hash tables, so recording doesn't take any lock. When disabled, the
+ * allocation functions only pay for the check of a flag.
+ *
+ * Allocations made with newlib's malloc family can be recorded as well, by linking the program with:
+ *
+ *     -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free,--wrap=memalign,--wrap=aligned_alloc
+ *
+ * Without these flags, the wrappers aren't linked in at all. Memory allocated by newlib internally (through the
+ * reentrant _malloc_r functions) isn't seen by the wrappers.
+ */
+#pragma once
+#include <stdio.h>
+#include "../types.h"
+
+#define MEMPROF_MAX_SITES  1024   ///< Maximum number of distinct call sites tracked.
+#define MEMPROF_MAX_ALLOCS 0x8000 ///< Maximum number of live allocations tracked at once.
+
+/// Statistics for a single allocation call site.
+typedef struct {
+    uintptr_t site;   ///< Return address of the allocation call.
+    u64 live_bytes;   ///< Bytes currently allocated from this site.
+    u64 live_count;   ///< Number of allocations from this site which are still live.
+    u64 total_bytes;  ///< Bytes allocated from this site since profiling was enabled.
+    u64 total_count;  ///< Number of allocations from this site since profiling was enabled.
+} MemProfSite;
+
+/// Process-wide memory usage.
+typedef struct {
+    u64 total_memory;    ///< Total amount of memory available to the process (InfoType_TotalMemorySize).
+    u64 used_memory;     ///< Amount of memory used by the process (InfoType_UsedMemorySize).
+    u64 heap_size;       ///< Amount of memory mapped into the heap (see \ref heapGetCommittedSize).
+    u64 live_bytes;      ///< Bytes in live tracked allocations.
+    u64 live_count;      ///< Number of live tracked allocations.
+    u64 untracked_count; ///< Number of allocations which couldn't be tracked, because the allocation table was full around their address.
+} MemProfTotals;
+
+/// Runtime toggle, use \ref memprofSetEnabled and \ref memprofIsEnabled instead of accessing this directly.
+extern bool __nx_memprof_enabled;
+
+/**
+ * @brief Enables or disables allocation profiling.
+ * @param[in] enabled Whether to record allocations.
+ * @return Result code.
+ * @note The tables are allocated when profiling is first enabled. Allocations made while profiling is disabled aren't
+ *       tracked, and frees made while it is disabled aren't accounted for.
+ */
+Result memprofSetEnabled(bool enabled);
+
+/// Returns whether allocation profiling is enabled.
+NX_INLINE bool memprofIsEnabled(void) {
+    return __atomic_load_n(&__nx_memprof_enabled, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Records an allocation. A pointer which is already tracked is attributed to the new call site.
+ * @param[in] p Allocated memory.
+ * @param[in] size Size of the allocation.
+ * @param[in] site Call site to attribute the allocation to.
+ */
+void memprofRecordAlloc(void* p, size_t size, const void* site);
+
+/**
+ * @brief Records a free. Pointers which aren't tracked are ignored.
+ * @param[in] p Freed memory.
+ * @note This must be called before the memory is actually freed.
+ */
+void memprofRecordFree(void* p);
+
+/**
+ * @brief Retrieves the per call site statistics.
+ * @param[out] out Output array of \ref MemProfSite.
+ * @param[in] max_sites Maximum number of entries to write.
+ * @return Number of entries written.
+ */
+size_t memprofGetSites(MemProfSite* out, size_t max_sites);
+
+/**
+ * @brief Retrieves the process-wide memory usage.
+ * @param[out] out Output \ref MemProfTotals.
+ */
+void memprofGetTotals(MemProfTotals* out);
+
+/**
+ * @brief Writes a report of the memory usage and of the call sites with the most live memory to a stream.
+ * @param[in] f Output stream (for instance a file on the SD card, or stdout after \ref nxlinkStdio).
+ */
+void memprofDump(FILE* f);
@@ -0,0 +1,135 @@
+/**
+ * @file threadpool.h
+ * @brief Work-stealing thread pool.
+ * @copyright libnx Authors
+ *
+ * Each worker thread owns a Chase-Lev deque: tasks submitted from a worker go to its own deque, from which
+ * idle workers steal. Tasks submitted from other threads go through a shared injection queue. Idle workers
+ * sleep on a \ref LEvent until new tasks are submitted.
+ *
+ * Tasks are allocated by the caller and must stay valid until they have completed. A task can have a
+ * continuation, which is run once all the tasks it is a continuation of have completed.
+ */
+#pragma once
+#include "../types.h"
+#include "../kernel/thread.h"
+#include "../kernel/levent.h"
+#include "../kernel/queue.h"
+
+#define THREADPOOL_MAX_WORKERS    4   ///< Maximum number of worker threads in a pool.
+#define THREADPOOL_DEQUE_SIZE     256 ///< Capacity of each worker's deque (must be a power of two).
+#define THREADPOOL_INJECTION_SIZE 256 ///< Capacity of the shared queue for tasks submitted from outside the pool (must be a power of two).
+
+typedef struct ThreadPool ThreadPool;
+typedef struct ThreadPoolTask ThreadPoolTask;
+
+/// Task function.
+typedef void (*ThreadPoolTaskFunc)(ThreadPoolTask* task, void* arg);
+
+/// Range function used by \ref threadpoolParallelFor, processing indices [begin, end).
+typedef void (*ThreadPoolRangeFunc)(void* userdata, s64 begin, s64 end);
+
+/// Task structure.
+struct ThreadPoolTask {
+    ThreadPoolTaskFunc func;       ///< Task function.
+    void* arg;                     ///< Argument passed to the task function.
+    ThreadPoolTask* continuation;  ///< Task to release once this one has completed (optional).
+    u32 pending;                   ///< Number of uncompleted dependencies, plus one until the task is submitted.
+    LEvent done;                   ///< Signaled once the task has completed.
+};
+
+/// Chase-Lev work-stealing deque.
+typedef struct ThreadPoolDeque {
+    s64 top __attribute__((aligned(64)));    ///< Next task to be stolen.
+    s64 bottom __attribute__((aligned(64))); ///< Next free slot, only written by the owner.
+    ThreadPoolTask* tasks[THREADPOOL_DEQUE_SIZE];
+} ThreadPoolDeque;
+
+/// Worker thread.
+typedef struct ThreadPoolWorker {
+    ThreadPool* pool;
+    Thread thread;
+    u32 index;
+    u32 steal_seed;
+    ThreadPoolDeque deque;
+} ThreadPoolWorker;
+
+/// Thread pool structure.
+struct ThreadPool {
+    u32 num_workers;
+    bool exiting;
+    u32 num_sleeping;              ///< Number of workers about to sleep or sleeping on wakeup.
+    LEvent wakeup;
+    MpmcQueue injection;
+    u64 injection_storage[MPMCQUEUE_STORAGE_SIZE(THREADPOOL_INJECTION_SIZE, sizeof(ThreadPoolTask*)) / sizeof(u64)];
+    ThreadPoolWorker workers[THREADPOOL_MAX_WORKERS];
+};
+
+/**
+ * @brief Creates a thread pool and starts its worker threads.
+ * @param[out] pool Thread pool (must stay at the same address until closed).
+ * @param[in] num_workers Number of worker threads, or 0 for one per core available to the process.
+ * @param[in] prio Priority of the worker threads.
+ * @param[in] stack_sz Stack size of the worker threads.
+ * @return Result code.
+ * @note Worker threads are spread over the cores available to the process (see InfoType_CoreMask).
+ */
+Result threadpoolCreate(ThreadPool* pool, u32 num_workers, int prio, size_t stack_sz);
+
+/**
+ * @brief Stops the worker threads of a thread pool and frees its resources.
+ * @param[in] pool Thread pool.
+ * @note Tasks which haven't been started yet are not run.
+ */
+void threadpoolClose(ThreadPool* pool);
+
+/**
+ * @brief Initializes a task.
+ * @param[out] task Task.
+ * @param[in] func Task function.
+ * @param[in] arg Argument passed to the task function.
+ */
+void threadpoolTaskInit(ThreadPoolTask* task, ThreadPoolTaskFunc func, void* arg);
+
+/**
+ * @brief Makes a task a continuation of another task: it will only be run after that task has completed.
+ * @param[in] task Task, not submitted yet.
+ * @param[in] continuation Continuation task, not submitted yet. A continuation can follow several tasks.
+ * @note Both tasks still need to be submitted with \ref threadpoolSubmit.
+ */
+void threadpoolTaskAddContinuation(ThreadPoolTask* task, ThreadPoolTask* continuation);
+
+/**
+ * @brief Submits a task to a thread pool. The task is run as soon as all of its dependencies have completed.
+ * @param[in] pool Thread pool.
+ * @param[in] task Task.
+ */
+void threadpoolSubmit(ThreadPool* pool, ThreadPoolTask* task);
+
+/**
+ * @brief Returns whether a task has completed.
+ * @param[in] task Task.
+ */
+NX_INLINE bool threadpoolTaskIsDone(ThreadPoolTask* task)
+{
+    return leventTryWait(&task->done);
+}
+
+/**
+ * @brief Waits for a task to complete, running other tasks of the pool in the meantime.
+ * @param[in] pool Thread pool.
+ * @param[in] task Task.
+ */
+void threadpoolWait(ThreadPool* pool, ThreadPoolTask* task);
+
+/**
+ * @brief Runs a function over a range of indices, split in chunks processed in parallel.
+ * @param[in] pool Thread pool.
+ * @param[in] begin First index.
+ * @param[in] end Index past the last one.
+ * @param[in] grain Number of indices per chunk, or 0 to pick one from the number of workers.
+ * @param[in] func Function called for each chunk.
+ * @param[in] userdata User data passed to the function.
+ * @note The calling thread takes part in the work, and this function returns once the whole range has been processed.
+ */
+void threadpoolParallelFor(ThreadPool* pool, s64 begin, s64 end, s64 grain, ThreadPoolRangeFunc func, void* userdata);
@@ -13,6 +13,7 @@
 #include "../types.h"
 #include "../kernel/tmem.h"
 #include "../sf/service.h"
+#include "../sf/sessionmgr.h"
 
 /// Configuration structure for bsdInitalize
 typedef struct  {
@@ -32,6 +33,17 @@ typedef struct  {
     u32 sb_efficiency;          ///< Number of buffers for each socket (standard values range from 1 to 8).
 } BsdInitConfig;
 
+/// Batch entry for \ref bsdSendBatch and \ref bsdRecvBatch.
+typedef struct {
+    int sockfd;                 ///< Socket descriptor.
+    void *buf;                  ///< Data buffer.
+    size_t len;                 ///< Size of the data buffer.
+    int flags;                  ///< Send/receive flags.
+    ssize_t ret;                ///< [out] Return value, as returned by @ref bsdSend / @ref bsdRecv.
+    int bsd_errno;              ///< [out] errno value for this entry.
+    Result result;              ///< [out] Switch "result" for this entry.
+} BsdBatchEntry;
+
 extern __thread Result g_bsdResult;    ///< Last Switch "result", per-thread
 extern __thread int g_bsdErrno;        ///< Last errno, per-thread
 
@@ -47,6 +59,12 @@ void bsdExit(void);
 /// Gets the Service object for the actual BSD service session.
 Service* bsdGetServiceSession(void);
 
+/// Lets the BSD session pool grow up to max_sessions sessions under contention, closing the extra sessions again once idle. See \ref sessionmgrSetAutoScale.
+Result bsdSetSessionAutoScale(u32 max_sessions);
+
+/// Retrieves the statistics of the BSD session pool.
+void bsdGetSessionStats(SessionMgrStats *out);
+
 /// Creates a socket.
 int bsdSocket(int domain, int type, int protocol);
 /// Like @ref bsdSocket but the newly created socket is immediately shut down.
@@ -81,4 +99,9 @@ int bsdDuplicateSocket(int sockfd);
 int bsdRecvMMsg(int sockfd, void *buf, size_t size, unsigned int vlen, int flags, struct timespec *timeout);
 int bsdSendMMsg(int sockfd, void *buf, size_t size, unsigned int vlen, int flags);
 
+/// Runs @ref bsdSend for each entry, dispatching them in parallel across the bsd session pool. Returns the number of entries that failed, or -1 (EINVAL) if count is larger than INT32_MAX.
+int bsdSendBatch(BsdBatchEntry *entries, size_t count);
+/// Runs @ref bsdRecv for each entry, dispatching them in parallel across the bsd session pool. Returns the number of entries that failed, or -1 (EINVAL) if count is larger than INT32_MAX.
+int bsdRecvBatch(BsdBatchEntry *entries, size_t count);
+
 // TODO: Reverse-engineer GetResourceStatistics.
@@ -12,6 +12,7 @@
 #include "../services/ncm_types.h"
 #include "../services/acc.h"
 #include "../sf/service.h"
+#include "../sf/sessionmgr.h"
 
 // We use wrapped handles for type safety.
 
@@ -183,6 +184,25 @@ typedef enum {
     FsWriteOption_Flush = BIT(0), ///< Forces a flush after write.
 } FsWriteOption;
 
+/// Batch entry for \ref fsFsGetEntryTypeBatch.
+typedef struct {
+    FsFileSystem* fs;     ///< Filesystem object.
+    const char* path;     ///< Path (buffer of at least FS_MAX_PATH bytes, as with \ref fsFsGetEntryType).
+    FsDirEntryType type;  ///< [out] Entry type.
+    Result result;        ///< [out] Result code.
+} FsFsGetEntryTypeBatchEntry;
+
+/// Batch entry for \ref fsFileReadBatch.
+typedef struct {
+    FsFile* f;            ///< File object.
+    s64 offset;           ///< Offset to read from.
+    void* buf;            ///< Output buffer.
+    u64 read_size;        ///< Size to read.
+    u32 option;           ///< \ref FsReadOption
+    u64 bytes_read;       ///< [out] Number of bytes read.
+    Result result;        ///< [out] Result code.
+} FsFileReadBatchEntry;
+
 typedef enum {
     FsContentStorageId_System  = 0, ///< System
     FsContentStorageId_User    = 1, ///< User
@@ -489,6 +509,9 @@ void fsExit(void);
 /// Gets the Service object for the actual fsp-srv service session.
 Service* fsGetServiceSession(void);
 
+/// Retrieves the statistics of the fs session pool. The pool grows under contention up to __nx_fs_max_sessions sessions (0 by default, which keeps it at __nx_fs_num_sessions).
+void fsGetSessionStats(SessionMgrStats* out);
+
 /// [5.0.0+] Configures the \ref FsPriority of all filesystem commands issued within the current thread.
 void fsSetPriority(FsPriority prio);
 
@@ -628,6 +651,10 @@ Result fsFsQueryEntry(FsFileSystem* fs, void *out, size_t out_size, const void *
 Result fsFsGetFileSystemAttribute(FsFileSystem* fs, FsFileSystemAttribute *out); ///< [15.0.0+]
 void fsFsClose(FsFileSystem* fs);
 
+/// Runs \ref fsFsGetEntryType for each entry, dispatching them in parallel across the fs session pool (see __nx_fs_num_sessions).
+/// Returns the result of the first failed entry, or 0 if every entry succeeded.
+Result fsFsGetEntryTypeBatch(FsFsGetEntryTypeBatchEntry* entries, s32 count);
+
 /// Uses \ref fsFsQueryEntry to set the archive bit on the specified absolute directory path.
 /// This will cause HOS to treat the directory as if it were a file containing the directory's concatenated contents.
 Result fsFsSetConcatenationFileAttribute(FsFileSystem* fs, const char *path);
@@ -645,6 +672,17 @@ Result fsFileGetSize(FsFile* f, s64* out);
 Result fsFileOperateRange(FsFile* f, FsOperationId op_id, s64 off, s64 len, FsRangeInfo* out); ///< [4.0.0+]
 void fsFileClose(FsFile* f);
 
+/// Runs \ref fsFileRead for each entry, dispatching them in parallel across the fs session pool (see __nx_fs_num_sessions).
+/// Returns the result of the first failed entry, or 0 if every entry succeeded.
+Result fsFileReadBatch(FsFileReadBatchEntry* entries, s32 count);
+
+/// Starts an asynchronous \ref fsFileRead. The request is built in msg_buf, which must be page-aligned with a size multiple of the page size.
+/// out_event is signaled once the read has completed, msg_buf and buf must stay valid until then. Complete the request with \ref fsFileReadAsyncGetResult.
+Result fsFileReadAsync(FsFile* f, s64 off, void* buf, u64 read_size, u32 option, void* msg_buf, size_t msg_buf_size, Handle* out_event);
+
+/// Retrieves the result of a read started with \ref fsFileReadAsync, after its event has been signaled. The event handle must then be closed by the caller.
+Result fsFileReadAsyncGetResult(FsFile* f, void* msg_buf, u64* bytes_read);
+
 // IDirectory
 Result fsDirRead(FsDir* d, s64* total_entries, size_t max_entries, FsDirectoryEntry *buf);
 Result fsDirGetEntryCount(FsDir* d, s64* count);
@@ -0,0 +1,331 @@
+/**
+ * @file server.h
+ * @brief Server-side CMIF framework (ports, sessions, domains and worker wait loop).
+ * @copyright libnx Authors
+ *
+ * Objects implement an \ref SfServerInterface, a table mapping command IDs to handlers. Sessions are
+ * accepted from ports (for instance a service registered with sm), each session being bound to a root
+ * object. Sessions can be converted to domains and can be cloned by clients, and handlers can return
+ * new objects, either as domain objects or as new sessions.
+ *
+ * Any number of threads may run \ref sfServerProcess (or \ref sfServerLoop) on the same server: one of
+ * them waits on the shared wait list at a time, and handles the request it received after handing the
+ * wait list over to the next thread.
+ */
+#pragma once
+#include "../types.h"
+#include "../kernel/svc.h"
+#include "../kernel/mutex.h"
+#include "../kernel/uevent.h"
+#include "../services/sm.h"
+#include "hipc.h"
+#include "cmif.h"
+
+#define SF_SERVER_MAX_PORTS          8    ///< Maximum number of ports per server.
+#define SF_SERVER_MAX_SESSIONS       0x30 ///< Maximum number of sessions per server (ports and sessions share the kernel wait limit of 0x40 handles).
+#define SF_SERVER_MAX_DOMAIN_OBJECTS 0x40 ///< Maximum number of objects per domain.
+#define SF_SERVER_MAX_OUT_DATA_SIZE  0xC0 ///< Maximum size of the output raw data of a command.
+
+typedef struct SfServer SfServer;
+typedef struct SfServerDomain SfServerDomain;
+typedef struct SfServerSession SfServerSession;
+typedef struct SfServerObject SfServerObject;
+typedef struct SfServerRequest SfServerRequest;
+
+/// Command handler. Returning a failure result discards any output set in the request.
+typedef Result (*SfServerCommandHandler)(SfServerObject* obj, SfServerRequest* req);
+
+/// Dispatch table entry.
+typedef struct SfServerCommand {
+    u32 command_id;                 ///< Command ID.
+    SfServerCommandHandler handler; ///< Handler.
+} SfServerCommand;
+
+/// Interface implemented by server objects.
+typedef struct SfServerInterface {
+    const SfServerCommand* commands; ///< Dispatch table.
+    u32 num_commands;                ///< Number of entries in the dispatch table.
+} SfServerInterface;
+
+/// Server object (reference counted).
+struct SfServerObject {
+    const SfServerInterface* iface;        ///< Interface implemented by the object.
+    void* userdata;                        ///< User data.
+    void (*destroy)(SfServerObject* obj);  ///< Called once the last reference is released (optional).
+    u32 refcount;                          ///< Reference count, use \ref sfServerObjectRetain / \ref sfServerObjectRelease.
+};
+
+/**
+ * @brief Callback invoked when a client connects to a port.
+ * @param[in] userdata User data passed when the port was added.
+ * @return Root object for the new session, with one reference transferred to the server. NULL rejects the session.
+ */
+typedef SfServerObject* (*SfServerConnectFunc)(void* userdata);
+
+/// Request being processed, passed to command handlers.
+struct SfServerRequest {
+    SfServerSession* session;     ///< Session the request was received on.
+    HipcParsedRequest hipc;       ///< Parsed HIPC request (buffers, handles, pid).
+    u32 command_id;               ///< Command ID.
+    u32 token;                    ///< Context token.
+    const void* in_data;          ///< Input raw data.
+    u32 in_data_size;             ///< Size available at in_data (may include trailing padding for non-domain requests).
+    u32 num_in_objects;           ///< Number of input domain objects.
+    SfServerObject* in_objects[8];///< Input domain objects (borrowed references).
+
+    u32 out_data_size;            ///< Output raw data size, set with \ref sfServerRequestSetOutData.
+    bool out_overflow;            ///< Set when an output didn't fit in the request, which fails it.
+    u32 num_out_objects;          ///< Number of output objects.
+    SfServerObject* out_objects[8];///< Output objects (references owned by the request).
+    u32 num_out_copy_handles;     ///< Number of output copy handles.
+    Handle out_copy_handles[8];   ///< Output copy handles.
+    u32 num_out_move_handles;     ///< Number of output move handles.
+    Handle out_move_handles[8];   ///< Output move handles (closed on failure).
+    u64 out_data[SF_SERVER_MAX_OUT_DATA_SIZE/sizeof(u64)]; ///< Output raw data.
+};
+
+/// Server port.
+typedef struct SfServerPort {
+    Handle handle;                ///< Port handle.
+    SfServerConnectFunc connect;  ///< Connection callback.
+    void* userdata;               ///< User data for the callback.
+    SmServiceName name;           ///< Service name, if the port was registered through sm.
+} SfServerPort;
+
+/// Server session.
+struct SfServerSession {
+    SfServer* server;             ///< Owning server.
+    Handle handle;                ///< Server session handle.
+    bool busy;                    ///< Whether a worker is currently processing this session.
+    SfServerObject* object;       ///< Root object (non-domain sessions).
+    SfServerDomain* domain;       ///< Domain (domain sessions), shared with clones of the session.
+    void* pointer_buffer;         ///< Receive buffer for pointer (static) descriptors.
+};
+
+/// Server object.
+struct SfServer {
+    Mutex mutex;                  ///< Protects the port and session lists.
+    Mutex wait_mutex;             ///< Held by the worker currently waiting on the wait list.
+    UEvent wakeup;                ///< Signaled to make the waiting worker rebuild the wait list.
+    bool exiting;
+    u16 pointer_buffer_size;
+    u32 num_ports;
+    u32 num_sessions;
+    SfServerPort ports[SF_SERVER_MAX_PORTS];
+    SfServerSession* sessions[SF_SERVER_MAX_SESSIONS];
+};
+
+/**
+ * @brief Initializes a server object.
+ * @param[in] obj Object.
+ * @param[in] iface Interface implemented by the object.
+ * @param[in] userdata User data.
+ * @param[in] destroy Callback invoked once the last reference is released (optional).
+ * @note The object starts with a single reference, owned by the caller.
+ */
+NX_INLINE void sfServerObjectInit(SfServerObject* obj, const SfServerInterface* iface, void* userdata, void (*destroy)(SfServerObject*))
+{
+    obj->iface = iface;
+    obj->userdata = userdata;
+    obj->destroy = destroy;
+    obj->refcount = 1;
+}
+
+/// Adds a reference to a server object.
+NX_INLINE SfServerObject* sfServerObjectRetain(SfServerObject* obj)
+{
+    __atomic_add_fetch(&obj->refcount, 1, __ATOMIC_RELAXED);
+    return obj;
+}
+
+/// Releases a reference to a server object, destroying it if it was the last one.
+NX_INLINE void sfServerObjectRelease(SfServerObject* obj)
+{
+    if (__atomic_sub_fetch(&obj->refcount, 1, __ATOMIC_ACQ_REL) == 0 && obj->destroy)
+        obj->destroy(obj);
+}
+
+/**
+ * @brief Gets the input raw data of a request.
+ * @param[in] req Request.
+ * @param[in] size Expected size.
+ * @return Pointer to the input raw data, or NULL if the request is too short.
+ */
+NX_CONSTEXPR const void* sfServerRequestGetInData(const SfServerRequest* req, u32 size)
+{
+    return req->in_data_size >= size ? req->in_data : NULL;
+}
+
+/**
+ * @brief Takes ownership of a copy handle sent with a request.
+ * @param[in] req Request.
+ * @param[in] index Index of the copy handle.
+ * @return Handle, or INVALID_HANDLE if there is no such handle or it was already taken.
+ * @note Handles sent with a request which aren't taken are closed once the request has been handled.
+ */
+NX_INLINE Handle sfServerRequestTakeInCopyHandle(SfServerRequest* req, u32 index)
+{
+    if (index >= req->hipc.meta.num_copy_handles)
+        return INVALID_HANDLE;
+    Handle h = req->hipc.data.copy_handles[index];
+    req->hipc.data.copy_handles[index] = INVALID_HANDLE;
+    return h;
+}
+
+/**
+ * @brief Takes ownership of a move handle sent with a request.
+ * @param[in] req Request.
+ * @param[in] index Index of the move handle.
+ * @return Handle, or INVALID_HANDLE if there is no such handle or it was already taken.
+ * @note Handles sent with a request which aren't taken are closed once the request has been handled.
+ */
+NX_INLINE Handle sfServerRequestTakeInMoveHandle(SfServerRequest* req, u32 index)
+{
+    if (index >= req->hipc.meta.num_move_handles)
+        return INVALID_HANDLE;
+    Handle h = req->hipc.data.move_handles[index];
+    req->hipc.data.move_handles[index] = INVALID_HANDLE;
+    return h;
+}
+
+/**
+ * @brief Sets the size of the output raw data of a request.
+ * @param[in] req Request.
+ * @param[in] size Size, must not exceed \ref SF_SERVER_MAX_OUT_DATA_SIZE.
+ * @return Pointer to the (zero-initialized) output raw data, or NULL if size is too large (the request then fails).
+ * @note The whole response must fit in the 0x100-byte message buffer, along with the output objects and handles.
+ *       Otherwise the request fails with LibnxError_ServerResponseTooLarge.
+ */
+NX_INLINE void* sfServerRequestSetOutData(SfServerRequest* req, u32 size)
+{
+    if (size > SF_SERVER_MAX_OUT_DATA_SIZE) {
+        req->out_overflow = true;
+        return NULL;
+    }
+    req->out_data_size = size;
+    return req->out_data;
+}
+
+/// Adds an output object to a request, transferring one reference to the server. The reference is released if the request already has 8 output objects.
+NX_INLINE void sfServerRequestAddOutObject(SfServerRequest* req, SfServerObject* obj)
+{
+    if (req->num_out_objects < 8)
+        req->out_objects[req->num_out_objects++] = obj;
+    else {
+        req->out_overflow = true;
+        sfServerObjectRelease(obj);
+    }
+}
+
+/// Adds an output copy handle to a request. The request fails if it already has 8 output copy handles.
+NX_INLINE void sfServerRequestAddOutCopyHandle(SfServerRequest* req, Handle h)
+{
+    if (req->num_out_copy_handles < 8)
+        req->out_copy_handles[req->num_out_copy_handles++] = h;
+    else
+        req->out_overflow = true;
+}
+
+/// Adds an output move handle to a request. The handle is closed if the request already has 8 output move handles.
+NX_INLINE void sfServerRequestAddOutMoveHandle(SfServerRequest* req, Handle h)
+{
+    if (req->num_out_move_handles < 8)
+        req->out_move_handles[req->num_out_move_handles++] = h;
+    else {
+        req->out_overflow = true;
+        svcCloseHandle(h);
+    }
+}
+
+/**
+ * @brief Gets a mapped buffer (HipcMapAlias) sent with a request.
+ * @param[in] req Request.
+ * @param[in] type Buffer direction: SfBufferAttr_In, SfBufferAttr_Out or both.
+ * @param[in] index Index of the buffer among those of the same direction.
+ * @param[out] out_size Size of the buffer.
+ * @return Address of the buffer, or NULL if there is no such buffer.
+ */
+void* sfServerRequestGetBuffer(const SfServerRequest* req, u32 type, u32 index, size_t* out_size);
+
+/**
+ * @brief Gets an input pointer buffer (HipcPointer) sent with a request.
+ * @param[in] req Request.
+ * @param[in] index Index of the pointer buffer.
+ * @param[out] out_size Size of the buffer.
+ * @return Address of the buffer (within the session's pointer buffer), or NULL if there is no such buffer.
+ */
+const void* sfServerRequestGetInPointer(const SfServerRequest* req, u32 index, size_t* out_size);
+
+/**
+ * @brief Creates a server.
+ * @param[out] srv Server.
+ * @param[in] pointer_buffer_size Size of the per-session receive buffer for pointer descriptors (0 to disable them).
+ */
+void sfServerCreate(SfServer* srv, u16 pointer_buffer_size);
+
+/**
+ * @brief Closes a server, closing all of its sessions and ports.
+ * @param[in] srv Server.
+ * @note No worker may be running on the server anymore.
+ */
+void sfServerClose(SfServer* srv);
+
+/**
+ * @brief Adds a port to a server. The server takes ownership of the port handle.
+ * @param[in] srv Server.
+ * @param[in] port Port handle.
+ * @param[in] connect Callback providing the root object for new sessions.
+ * @param[in] userdata User data for the callback.
+ * @return Result code.
+ */
+Result sfServerAddPort(SfServer* srv, Handle port, SfServerConnectFunc connect, void* userdata);
+
+/**
+ * @brief Registers a service with sm and adds its port to a server. The service is unregistered when the server is closed.
+ * @param[in] srv Server.
+ * @param[in] name Service name.
+ * @param[in] max_sessions Maximum number of sessions of the service.
+ * @param[in] connect Callback providing the root object for new sessions.
+ * @param[in] userdata User data for the callback.
+ * @return Result code.
+ */
+Result sfServerRegisterService(SfServer* srv, SmServiceName name, s32 max_sessions, SfServerConnectFunc connect, void* userdata);
+
+/**
+ * @brief Adds a session to a server. The server takes ownership of the session handle and of one reference to obj.
+ * @param[in] srv Server.
+ * @param[in] session Server session handle.
+ * @param[in] obj Root object of the session.
+ * @return Result code.
+ */
+Result sfServerAddSession(SfServer* srv, Handle session, SfServerObject* obj);
+
+/**
+ * @brief Processes a CMIF message received on a session, and writes the reply to the same buffer.
+ * @param[in] session Session.
+ * @param[in,out] base Message buffer (0x100 bytes, TLS format).
+ * @param[out] out_close Set to true if the client requested the session to be closed (no reply must be sent then).
+ * @note This is the transport-independent part of the server, used by \ref sfServerProcess.
+ */
+void sfServerHandleMessage(SfServerSession* session, void* base, bool* out_close);
+
+/**
+ * @brief Waits for a single event on the server (new connection or request) and handles it.
+ * @param[in] srv Server.
+ * @param[in] timeout Timeout in nanoseconds.
+ * @return Result code. KERNELRESULT(Cancelled) is returned once \ref sfServerRequestExit has been called.
+ */
+Result sfServerProcess(SfServer* srv, u64 timeout);
+
+/**
+ * @brief Processes events on the server until \ref sfServerRequestExit is called.
+ * @param[in] srv Server.
+ * @note Can be run from several threads simultaneously.
+ */
+void sfServerLoop(SfServer* srv);
+
+/**
+ * @brief Makes all workers return from \ref sfServerProcess and \ref sfServerLoop.
+ * @param[in] srv Server.
+ */
+void sfServerRequestExit(SfServer* srv);
@@ -10,6 +10,10 @@
 #include "hipc.h"
 #include "cmif.h"
 
+#if defined(NX_SERVICE_TRACE)
+#include "trace.h"
+#endif
+
 /// Service object structure
 typedef struct Service {
     Handle session;
@@ -27,6 +31,7 @@ enum {
     SfBufferAttr_HipcAutoSelect                 = BIT(5),
     SfBufferAttr_HipcMapTransferAllowsNonSecure = BIT(6),
     SfBufferAttr_HipcMapTransferAllowsNonDevice = BIT(7),
+    SfBufferAttr_HipcAutoSelectPreferMap        = BIT(8), ///< With HipcAutoSelect: always map page-aligned output buffers.
 };
 
 typedef struct SfBufferAttrs {
@@ -202,8 +207,12 @@ NX_INLINE void serviceClose(Service* s)
     if (s->own_handle || s->object_id) {
         cmifMakeCloseRequest(armGetTls(), s->own_handle ? 0 : s->object_id);
         svcSendSyncRequest(s->session);
-        if (s->own_handle)
+        if (s->own_handle) {
+#if defined(NX_SERVICE_TRACE)
+            sftraceUnregisterName(s->session);
+#endif
             svcCloseHandle(s->session);
+        }
     }
     *s = (Service){};
 }
@@ -224,7 +233,12 @@ NX_INLINE Result serviceClone(Service* s, Service* out_s)
     out_s->own_handle = 1;
     out_s->object_id = s->object_id;
     out_s->pointer_buffer_size = s->pointer_buffer_size;
-    return cmifCloneCurrentObject(s->session, &out_s->session);
+    Result rc = cmifCloneCurrentObject(s->session, &out_s->session);
+#if defined(NX_SERVICE_TRACE)
+    if (R_SUCCEEDED(rc))
+        sftraceCopyName(s->session, out_s->session);
+#endif
+    return rc;
 }
 
 /**
@@ -244,7 +258,12 @@ NX_INLINE Result serviceCloneEx(Service* s, u32 tag, Service* out_s)
     out_s->own_handle = 1;
     out_s->object_id = s->object_id;
     out_s->pointer_buffer_size = s->pointer_buffer_size;
-    return cmifCloneCurrentObjectEx(s->session, tag, &out_s->session);
+    Result rc = cmifCloneCurrentObjectEx(s->session, tag, &out_s->session);
+#if defined(NX_SERVICE_TRACE)
+    if (R_SUCCEEDED(rc))
+        sftraceCopyName(s->session, out_s->session);
+#endif
+    return rc;
 }
 
 /**
@@ -256,10 +275,14 @@ NX_INLINE Result serviceConvertToDomain(Service* s)
 {
     if (!s->own_handle) {
         // For overridden services, create a clone first.
-        Result rc = cmifCloneCurrentObjectEx(s->session, 0, &s->session);
+        Handle session = s->session;
+        Result rc = cmifCloneCurrentObjectEx(session, 0, &s->session);
         if (R_FAILED(rc))
             return rc;
         s->own_handle = 1;
+#if defined(NX_SERVICE_TRACE)
+        sftraceCopyName(session, s->session);
+#endif
     }
 
     return cmifConvertCurrentObjectToDomain(s->session, &s->object_id);
@@ -295,6 +318,11 @@ NX_CONSTEXPR void _serviceRequestFormatProcessBuffer(CmifRequestFormat* fmt, u32
     }
 }
 
+NX_INLINE bool _serviceBufferIsPageAligned(const SfBuffer* buf)
+{
+    return buf->size && !(((uintptr_t)buf->ptr | buf->size) & 0xFFF);
+}
+
 NX_CONSTEXPR void _serviceRequestProcessBuffer(CmifRequest* req, const SfBuffer* buf, u32 attr)
 {
     if (!attr) return;
@@ -309,8 +337,15 @@ NX_CONSTEXPR void _serviceRequestProcessBuffer(CmifRequest* req, const SfBuffer*
             mode = HipcBufferMode_NonDevice;
         if (is_in)
             cmifRequestInAutoBuffer(req, buf->ptr, buf->size, mode);
-        if (is_out)
-            cmifRequestOutAutoBuffer(req, (void*)buf->ptr, buf->size, mode);
+        if (is_out) {
+            // Opt-in: page-aligned outputs are mapped instead of going through the server's pointer buffer and being
+            // copied back by the kernel. Not the default, since mapping costs more for small buffers, and some memory can't be mapped.
+            if ((attr & SfBufferAttr_HipcAutoSelectPreferMap) && _serviceBufferIsPageAligned(buf)) {
+                cmifRequestOutPointer(req, NULL, 0);
+                cmifRequestOutBuffer(req, (void*)buf->ptr, buf->size, mode);
+            } else
+                cmifRequestOutAutoBuffer(req, (void*)buf->ptr, buf->size, mode);
+        }
     } else if (attr & SfBufferAttr_HipcPointer) {
         if (is_in)
             cmifRequestInPointer(req, buf->ptr, buf->size);
@@ -336,8 +371,8 @@ NX_CONSTEXPR void _serviceRequestProcessBuffer(CmifRequest* req, const SfBuffer*
     }
 }
 
-NX_INLINE void* serviceMakeRequest(
-    Service* s, u32 request_id, u32 context, u32 data_size, bool send_pid,
+NX_INLINE void* _serviceMakeRequestImpl(
+    void* base, Service* s, u32 request_id, u32 context, u32 data_size, bool send_pid,
     const SfBufferAttrs buffer_attrs, const SfBuffer* buffers,
     u32 num_objects, const Service* const* objects,
     u32 num_handles, const Handle* handles
@@ -366,7 +401,7 @@ NX_INLINE void* serviceMakeRequest(
     _serviceRequestFormatProcessBuffer(&fmt, buffer_attrs.attr6);
     _serviceRequestFormatProcessBuffer(&fmt, buffer_attrs.attr7);
 
-    CmifRequest req = cmifMakeRequest(armGetTls(), fmt);
+    CmifRequest req = cmifMakeRequest(base, fmt);
 
     if (s->object_id) // TODO: Check behavior of input objects in non-domain sessions
         for (u32 i = 0; i < num_objects; i ++)
@@ -387,6 +422,16 @@ NX_INLINE void* serviceMakeRequest(
     return req.data;
 }
 
+NX_INLINE void* serviceMakeRequest(
+    Service* s, u32 request_id, u32 context, u32 data_size, bool send_pid,
+    const SfBufferAttrs buffer_attrs, const SfBuffer* buffers,
+    u32 num_objects, const Service* const* objects,
+    u32 num_handles, const Handle* handles
+) {
+    return _serviceMakeRequestImpl(armGetTls(), s, request_id, context, data_size, send_pid,
+        buffer_attrs, buffers, num_objects, objects, num_handles, handles);
+}
+
 NX_CONSTEXPR void _serviceResponseGetHandle(CmifResponse* res, SfOutHandleAttr type, Handle* out)
 {
     switch (type) {
@@ -402,8 +447,8 @@ NX_CONSTEXPR void _serviceResponseGetHandle(CmifResponse* res, SfOutHandleAttr t
     }
 }
 
-NX_INLINE Result serviceParseResponse(
-    Service* s, u32 out_size, void** out_data,
+NX_INLINE Result _serviceParseResponseImpl(
+    void* base, Service* s, u32 out_size, void** out_data,
     u32 num_out_objects, Service* out_objects,
     const SfOutHandleAttrs out_handle_attrs, Handle* out_handles
 ) {
@@ -414,7 +459,7 @@ NX_INLINE Result serviceParseResponse(
 
     CmifResponse res = {};
     bool is_domain = s->object_id != 0;
-    Result rc = cmifParseResponse(&res, armGetTls(), is_domain, out_size);
+    Result rc = cmifParseResponse(&res, base, is_domain, out_size);
     if (R_FAILED(rc))
         return rc;
 
@@ -440,6 +485,54 @@ NX_INLINE Result serviceParseResponse(
     return 0;
 }
 
+NX_INLINE Result serviceParseResponse(
+    Service* s, u32 out_size, void** out_data,
+    u32 num_out_objects, Service* out_objects,
+    const SfOutHandleAttrs out_handle_attrs, Handle* out_handles
+) {
+    return _serviceParseResponseImpl(armGetTls(), s, out_size, out_data,
+        num_out_objects, out_objects, out_handle_attrs, out_handles);
+}
+
+#if defined(NX_SERVICE_TRACE)
+
+NX_CONSTEXPR u32 _serviceTraceBufferSize(const SfBuffer* buf, u32 attr, u32 dir)
+{
+    return (attr & dir) ? (u32)buf->size : 0;
+}
+
+NX_INLINE u32 _serviceTraceBufferSizes(const SfDispatchParams* disp, u32 dir)
+{
+    return _serviceTraceBufferSize(&disp->buffers[0], disp->buffer_attrs.attr0, dir)
+         + _serviceTraceBufferSize(&disp->buffers[1], disp->buffer_attrs.attr1, dir)
+         + _serviceTraceBufferSize(&disp->buffers[2], disp->buffer_attrs.attr2, dir)
+         + _serviceTraceBufferSize(&disp->buffers[3], disp->buffer_attrs.attr3, dir)
+         + _serviceTraceBufferSize(&disp->buffers[4], disp->buffer_attrs.attr4, dir)
+         + _serviceTraceBufferSize(&disp->buffers[5], disp->buffer_attrs.attr5, dir)
+         + _serviceTraceBufferSize(&disp->buffers[6], disp->buffer_attrs.attr6, dir)
+         + _serviceTraceBufferSize(&disp->buffers[7], disp->buffer_attrs.attr7, dir);
+}
+
+NX_INLINE void _serviceTraceDispatch(
+    Handle session, u32 object_id, u32 request_id,
+    u32 in_data_size, u32 out_data_size,
+    const SfDispatchParams* disp, u64 start_tick, Result rc
+) {
+    SfTraceRecord rec = {
+        .start_tick = start_tick,
+        .duration = armGetSystemTick() - start_tick,
+        .session = session,
+        .object_id = object_id,
+        .request_id = request_id,
+        .result = rc,
+        .in_size = in_data_size + _serviceTraceBufferSizes(disp, SfBufferAttr_In),
+        .out_size = out_data_size + _serviceTraceBufferSizes(disp, SfBufferAttr_Out),
+    };
+    sftraceRecord(&rec);
+}
+
+#endif
+
 NX_INLINE Result serviceDispatchImpl(
     Service* s, u32 request_id,
     const void* in_data, u32 in_data_size,
@@ -459,6 +552,10 @@ NX_INLINE Result serviceDispatchImpl(
     if (in_data_size)
         __builtin_memcpy(in, in_data, in_data_size);
 
+#if defined(NX_SERVICE_TRACE)
+    const u64 trace_start = sftraceBegin();
+#endif
+
     Result rc = svcSendSyncRequest(disp.target_session == INVALID_HANDLE ? s->session : disp.target_session);
     if (R_SUCCEEDED(rc)) {
         void* out = NULL;
@@ -471,6 +568,80 @@ NX_INLINE Result serviceDispatchImpl(
             __builtin_memcpy(out_data, out, out_data_size);
     }
 
+#if defined(NX_SERVICE_TRACE)
+    if (trace_start)
+        _serviceTraceDispatch(disp.target_session == INVALID_HANDLE ? s->session : disp.target_session,
+            srv.object_id, request_id, in_data_size, out_data_size, &disp, trace_start, rc);
+#endif
+
+    return rc;
+}
+
+/**
+ * @brief Sends a request asynchronously, building it in a caller-provided message buffer instead of TLS.
+ * @param[in] s Service object.
+ * @param[in] request_id Command ID.
+ * @param[in] in_data Input raw data.
+ * @param[in] in_data_size Input raw data size.
+ * @param[in] buffer Message buffer, must be page-aligned.
+ * @param[in] buffer_size Message buffer size, must be a nonzero multiple of the page size.
+ * @param[in] disp Dispatch parameters.
+ * @param[out] out_event Event handle signaled once the reply has been written to the message buffer, usable with \ref waitSingleHandle or \ref waiterForHandle.
+ * @return Result code.
+ * @note The message buffer, the buffers in disp and the event handle belong to the request until \ref serviceParseAsyncResponseImpl is called.
+ *       The event handle must then be closed with \ref svcCloseHandle.
+ */
+NX_INLINE Result serviceDispatchAsyncImpl(
+    Service* s, u32 request_id,
+    const void* in_data, u32 in_data_size,
+    void* buffer, size_t buffer_size,
+    SfDispatchParams disp, Handle* out_event
+)
+{
+    if (((uintptr_t)buffer & 0xFFF) || !buffer_size || (buffer_size & 0xFFF))
+        return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+
+    Service srv = *s;
+
+    void* in = _serviceMakeRequestImpl(buffer, &srv, request_id, disp.context,
+        in_data_size, disp.in_send_pid,
+        disp.buffer_attrs, disp.buffers,
+        disp.in_num_objects, disp.in_objects,
+        disp.in_num_handles, disp.in_handles);
+
+    if (in_data_size)
+        __builtin_memcpy(in, in_data, in_data_size);
+
+    return svcSendAsyncRequestWithUserBuffer(out_event, buffer, buffer_size,
+        disp.target_session == INVALID_HANDLE ? s->session : disp.target_session);
+}
+
+/**
+ * @brief Parses the reply to a request sent with \ref serviceDispatchAsyncImpl, once its event has been signaled.
+ * @param[in] s Service object the request was sent to.
+ * @param[in] buffer Message buffer the request was built in.
+ * @param[out] out_data Output raw data.
+ * @param[in] out_data_size Output raw data size.
+ * @param[in] disp Dispatch parameters (only the output objects and handles are used).
+ * @return Result code.
+ */
+NX_INLINE Result serviceParseAsyncResponseImpl(
+    Service* s, void* buffer,
+    void* out_data, u32 out_data_size,
+    SfDispatchParams disp
+)
+{
+    Service srv = *s;
+
+    void* out = NULL;
+    Result rc = _serviceParseResponseImpl(buffer, &srv,
+        out_data_size, &out,
+        disp.out_num_objects, disp.out_objects,
+        disp.out_handle_attrs, disp.out_handles);
+
+    if (R_SUCCEEDED(rc) && out_data && out_data_size)
+        __builtin_memcpy(out_data, out, out_data_size);
+
     return rc;
 }
 
@@ -516,3 +687,17 @@ namespace libnx::impl {
     ({ static_assert(!(serviceMacroDetectIsPointer(_in))); \
     static_assert(!(serviceMacroDetectIsPointer(_out))); \
     serviceDispatchImpl((_s),(_rid),&(_in),sizeof(_in),&(_out),sizeof(_out),(SfDispatchParams){ __VA_ARGS__ }); })
+
+#define serviceDispatchAsync(_s,_rid,_buf,_buf_size,_event,...) \
+    serviceDispatchAsyncImpl((_s),(_rid),NULL,0,(_buf),(_buf_size),(SfDispatchParams){ __VA_ARGS__ },(_event))
+
+#define serviceDispatchAsyncIn(_s,_rid,_in,_buf,_buf_size,_event,...) \
+    ({ static_assert(!(serviceMacroDetectIsPointer(_in))); \
+    serviceDispatchAsyncImpl((_s),(_rid),&(_in),sizeof(_in),(_buf),(_buf_size),(SfDispatchParams){ __VA_ARGS__ },(_event)); })
+
+#define serviceParseAsyncResponse(_s,_buf,...) \
+    serviceParseAsyncResponseImpl((_s),(_buf),NULL,0,(SfDispatchParams){ __VA_ARGS__ })
+
+#define serviceParseAsyncResponseOut(_s,_buf,_out,...) \
+    ({ static_assert(!(serviceMacroDetectIsPointer(_out))); \
+    serviceParseAsyncResponseImpl((_s),(_buf),&(_out),sizeof(_out),(SfDispatchParams){ __VA_ARGS__ }); })
@@ -5,6 +5,24 @@
 
 #define NX_SESSION_MGR_MAX_SESSIONS 16
 
+/// Default time a client needs to have been waiting for a session before an auto-scaling manager clones a new one (see \ref sessionmgrSetAutoScale).
+#define NX_SESSION_MGR_DEFAULT_GROW_DELAY_NS   1000000ULL
+/// Default time without contention after which an auto-scaling manager closes one of its extra sessions (see \ref sessionmgrSetAutoScale).
+#define NX_SESSION_MGR_DEFAULT_IDLE_TIMEOUT_NS 5000000000ULL
+
+/// Session manager statistics (see \ref sessionmgrGetStats).
+typedef struct SessionMgrStats {
+    u32 num_sessions;      ///< Current number of sessions.
+    u32 peak_sessions;     ///< Highest number of sessions.
+    u32 num_grows;         ///< Number of sessions cloned due to contention.
+    u32 num_shrinks;       ///< Number of sessions closed due to inactivity.
+    u32 peak_waiters;      ///< Highest number of simultaneously waiting clients.
+    u32 num_grow_failures; ///< Number of times the server refused to give another session.
+    u64 num_waits;         ///< Number of attaches that had to wait for a free session.
+    u64 total_wait_ticks;  ///< Total time spent waiting for a free session, in system ticks.
+    u64 max_wait_ticks;    ///< Longest single wait for a free session, in system ticks.
+} SessionMgrStats;
+
 typedef struct SessionMgr
 {
     Handle sessions[NX_SESSION_MGR_MAX_SESSIONS];
@@ -13,13 +31,58 @@ typedef struct SessionMgr
     Mutex mutex;
     CondVar condvar;
     u32 num_waiters;
+    u32 min_sessions;
+    u32 max_sessions;
+    u64 grow_delay_ticks;
+    u64 idle_ticks;
+    u64 last_scale_tick;
+    u64 grow_retry_tick;
+    u64 grow_backoff_ticks;
+    SessionMgrStats stats;
+    struct ThreadPool* batch_pool;
 } SessionMgr;
 
+/// Batch work callback, invoked once per item index (see \ref sessionmgrRunBatch).
+typedef void (*SessionMgrBatchFunc)(void* userdata, u32 index);
+
 Result sessionmgrCreate(SessionMgr* mgr, Handle root_session, u32 num_sessions);
 void sessionmgrClose(SessionMgr* mgr);
 int sessionmgrAttachClient(SessionMgr* mgr);
 void sessionmgrDetachClient(SessionMgr* mgr, int slot);
 
+/**
+ * @brief Enables automatic sizing of the session pool.
+ * @param mgr Session manager.
+ * @param max_sessions Maximum number of sessions (between the number of sessions passed to \ref sessionmgrCreate and \ref NX_SESSION_MGR_MAX_SESSIONS). Passing the initial number of sessions disables auto-scaling.
+ * @param grow_delay_ns Time a client needs to have been waiting for a free session before a new session is cloned.
+ *        If the server refuses to give another session, growing is retried later, with an exponential backoff.
+ * @param idle_timeout_ns Time without contention after which an extra session is closed (one session per timeout period).
+ * @return Result code.
+ * @note When auto-scaling is enabled, \ref sessionmgrAttachClient may itself perform IPC using the calling thread's TLS,
+ *       so clients must attach before building their request.
+ */
+Result sessionmgrSetAutoScale(SessionMgr* mgr, u32 max_sessions, u64 grow_delay_ns, u64 idle_timeout_ns);
+
+/**
+ * @brief Retrieves the statistics of a session manager.
+ * @param mgr Session manager.
+ * @param[out] out Output \ref SessionMgrStats.
+ */
+void sessionmgrGetStats(SessionMgr* mgr, SessionMgrStats* out);
+
+/**
+ * @brief Runs a set of independent IPC work items in parallel across the sessions of a manager.
+ * @param mgr Session manager.
+ * @param num_items Number of work items.
+ * @param func Callback invoked once for each item index, from the calling thread or from a helper thread.
+ * @param userdata User data passed to the callback.
+ * @note The items are processed by the calling thread and by a pool of helper threads, created on the first batch and kept
+ *       until \ref sessionmgrClose. The pool has one thread less than the maximum number of sessions at that point (capped
+ *       at \ref THREADPOOL_MAX_WORKERS). If it cannot be created, every item is processed by the calling thread.
+ * @note Thread-local state of the calling thread (such as the fs priority) is not visible from helper threads.
+ */
+void sessionmgrRunBatch(SessionMgr* mgr, u32 num_items, SessionMgrBatchFunc func, void* userdata);
+
 NX_CONSTEXPR Handle sessionmgrGetClientSession(SessionMgr* mgr, int slot)
 {
     return mgr->sessions[slot];
@@ -0,0 +1,76 @@
+/**
+ * @file stub.h
+ * @brief Typed IPC command stubs generated from command tables
+ * @copyright libnx Authors
+ *
+ * A command table is an X-macro listing the commands of an interface, one row per command:
+ * @code
+ * #define FOO_CMDS(X) \
+ *     X(None,  Flush,   2) \
+ *     X(In,    SetSize, 3, s64) \
+ *     X(Out,   GetSize, 4, s64) \
+ *     X(InOut, Read,    0, FooReadIn, u64)
+ * @endcode
+ * The first column is the kind of command (None, In, Out or InOut), followed by the command name,
+ * the command ID, and the raw input and/or output data types. Feeding the table to \ref SF_STUB_DEFINE
+ * through a small wrapper macro emits one inline function per command, which takes typed pointers to the
+ * input/output data. The data sizes are thus compile-time constants and the request is built inline.
+ *
+ * Raw data types used in command tables should be declared with their wire layout checked through
+ * \ref SF_STUB_CHECK_SIZE and \ref SF_STUB_CHECK_OFFSET.
+ */
+#pragma once
+#include <stddef.h>
+#include "service.h"
+
+/// Maximum size of the raw data of a command (the message buffer is 0x100 bytes, including headers).
+#define SF_STUB_MAX_DATA_SIZE 0xC0
+
+/// Checks at compile time that a raw data type has the expected wire size.
+#define SF_STUB_CHECK_SIZE(_type, _size) \
+    static_assert(sizeof(_type) == (_size), "Unexpected size for " #_type)
+
+/// Checks at compile time that a field of a raw data type is at the expected wire offset.
+#define SF_STUB_CHECK_OFFSET(_type, _field, _offset) \
+    static_assert(offsetof(_type, _field) == (_offset), "Unexpected offset for " #_type "." #_field)
+
+/// Checks at compile time that a type can be used as raw data for a command.
+#define SF_STUB_CHECK_DATA(_type) \
+    static_assert(sizeof(_type) <= SF_STUB_MAX_DATA_SIZE, #_type " is too large to be used as raw data")
+
+/**
+ * @brief Emits the stub for a command table row.
+ * @param _dispatch Dispatch function with the same signature as \ref serviceDispatchImpl.
+ * @param _prefix Prefix for the generated function names.
+ * @param _kind Kind of command: None, In, Out or InOut.
+ * @param _name Command name, appended to the prefix.
+ * @param _id Command ID.
+ * @note The generated functions take the service, then a pointer to the input data (In/InOut), then a pointer to
+ *       the output data (Out/InOut), and finally the \ref SfDispatchParams describing buffers, handles and objects.
+ */
+#define SF_STUB_DEFINE(_dispatch, _prefix, _kind, _name, _id, ...) \
+    SF_STUB_DEFINE_##_kind(_dispatch, _prefix##_name, (_id), ##__VA_ARGS__)
+
+#define SF_STUB_DEFINE_None(_dispatch, _func, _id) \
+    NX_INLINE Result _func(Service* s, SfDispatchParams disp) { \
+        return _dispatch(s, _id, NULL, 0, NULL, 0, disp); \
+    }
+
+#define SF_STUB_DEFINE_In(_dispatch, _func, _id, _in_type) \
+    SF_STUB_CHECK_DATA(_in_type); \
+    NX_INLINE Result _func(Service* s, const _in_type* in, SfDispatchParams disp) { \
+        return _dispatch(s, _id, in, sizeof(_in_type), NULL, 0, disp); \
+    }
+
+#define SF_STUB_DEFINE_Out(_dispatch, _func, _id, _out_type) \
+    SF_STUB_CHECK_DATA(_out_type); \
+    NX_INLINE Result _func(Service* s, _out_type* out, SfDispatchParams disp) { \
+        return _dispatch(s, _id, NULL, 0, out, sizeof(_out_type), disp); \
+    }
+
+#define SF_STUB_DEFINE_InOut(_dispatch, _func, _id, _in_type, _out_type) \
+    SF_STUB_CHECK_DATA(_in_type); \
+    SF_STUB_CHECK_DATA(_out_type); \
+    NX_INLINE Result _func(Service* s, const _in_type* in, _out_type* out, SfDispatchParams disp) { \
+        return _dispatch(s, _id, in, sizeof(_in_type), out, sizeof(_out_type), disp); \
+    }
@@ -0,0 +1,120 @@
+/**
+ * @file trace.h
+ * @brief IPC tracing and latency histograms for service dispatch.
+ * @copyright libnx Authors
+ *
+ * Tracing is compiled into \ref serviceDispatchImpl only when NX_SERVICE_TRACE is defined
+ * (for both libnx and the application, as the dispatch code is inlined), and must then
+ * additionally be enabled at runtime with \ref sftraceSetEnabled. When NX_SERVICE_TRACE is
+ * not defined, no tracing code is emitted at all.
+ */
+#pragma once
+#include <stdio.h>
+#include "../types.h"
+#include "../arm/counter.h"
+
+/// Number of records kept in each per-thread trace ring buffer.
+#define SFTRACE_RING_SIZE   256
+/// Number of distinct commands tracked by the aggregated statistics.
+#define SFTRACE_MAX_STATS   256
+/// Number of latency histogram buckets. Bucket i counts calls taking [2^i, 2^(i+1)) system ticks.
+#define SFTRACE_NUM_BUCKETS 24
+
+/// Raw trace record for a single dispatched request.
+typedef struct SfTraceRecord {
+    u64 start_tick;     ///< System tick at which the request was sent.
+    u64 duration;       ///< Duration of the request, in system ticks.
+    Handle session;     ///< Session handle of the service object.
+    u32 object_id;      ///< Domain object ID (0 for non-domain services).
+    u32 request_id;     ///< Command ID.
+    Result result;      ///< Result of the request.
+    u32 in_size;        ///< Size of the input raw data plus input buffers.
+    u32 out_size;       ///< Size of the output raw data plus output buffers.
+} SfTraceRecord;
+
+/// Aggregated statistics for a single command.
+typedef struct SfTraceStats {
+    Handle session;     ///< Session handle of the service object.
+    u32 object_id;      ///< Domain object ID (0 for non-domain services).
+    u32 request_id;     ///< Command ID.
+    u32 padding;
+    u64 count;          ///< Number of calls.
+    u64 total_ticks;    ///< Total time spent in calls, in system ticks.
+    u64 min_ticks;      ///< Shortest call, in system ticks.
+    u64 max_ticks;      ///< Longest call, in system ticks.
+    u64 buckets[SFTRACE_NUM_BUCKETS]; ///< Latency histogram (see \ref SFTRACE_NUM_BUCKETS).
+} SfTraceStats;
+
+/// Runtime toggle, use \ref sftraceSetEnabled and \ref sftraceIsEnabled instead of accessing this directly.
+extern bool __nx_sftrace_enabled;
+
+/**
+ * @brief Enables or disables recording of IPC traces at runtime.
+ * @param[in] enabled Whether to record traces.
+ * @note This has no effect on code built without NX_SERVICE_TRACE.
+ */
+void sftraceSetEnabled(bool enabled);
+
+/// Returns whether recording of IPC traces is enabled.
+NX_INLINE bool sftraceIsEnabled(void) {
+    return __atomic_load_n(&__nx_sftrace_enabled, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Associates a name with a session handle, used when printing traces.
+ * @param[in] session Session handle.
+ * @param[in] name Service name (up to 8 characters, need not be NUL-terminated).
+ * @note Services obtained through \ref smGetServiceWrapper are registered automatically in NX_SERVICE_TRACE builds.
+ */
+void sftraceRegisterName(Handle session, const char* name);
+
+/**
+ * @brief Removes the name associated with a session handle.
+ * @param[in] session Session handle.
+ */
+void sftraceUnregisterName(Handle session);
+
+/**
+ * @brief Copies the name associated with a session handle to another session handle (e.g. for cloned sessions).
+ * @param[in] from Session handle with a registered name.
+ * @param[in] to Session handle to register.
+ */
+void sftraceCopyName(Handle from, Handle to);
+
+/**
+ * @brief Records a dispatched request. Called by \ref serviceDispatchImpl in NX_SERVICE_TRACE builds.
+ * @param[in] rec Trace record.
+ */
+void sftraceRecord(const SfTraceRecord* rec);
+
+/**
+ * @brief Retrieves the aggregated statistics.
+ * @param[out] out Output array of \ref SfTraceStats.
+ * @param[in] max_stats Maximum number of entries to write.
+ * @return Number of entries written.
+ */
+size_t sftraceGetStats(SfTraceStats* out, size_t max_stats);
+
+/**
+ * @brief Writes the aggregated per-command latency histograms to a stream.
+ * @param[in] f Output stream (for instance a file on the SD card, or stdout after \ref nxlinkStdio).
+ */
+void sftraceDumpStats(FILE* f);
+
+/**
+ * @brief Writes the raw trace records of all threads to a stream, oldest first for each thread.
+ * @param[in] f Output stream (for instance a file on the SD card, or stdout after \ref nxlinkStdio).
+ * @note Records being written by other threads during the dump may be torn.
+ */
+void sftraceDumpRecords(FILE* f);
+
+/**
+ * @brief Clears the aggregated statistics and all trace ring buffers.
+ * @note Tracing should be disabled while calling this function.
+ */
+void sftraceReset(void);
+
+/// Starts timing a request. Returns 0 if tracing is disabled.
+NX_INLINE u64 sftraceBegin(void) {
+    return sftraceIsEnabled() ? armGetSystemTick() : 0;
+}
@@ -0,0 +1,51 @@
+.macro CODE_BEGIN name
+	.section .text.\name, "ax", %progbits
+	.global \name
+	.type \name, %function
+	.align 2
+	.cfi_startproc
+\name:
+.endm
+
+.macro CODE_END
+	.cfi_endproc
+.endm
+
+// void __nx_fiber_switch(FiberContext* from, const FiberContext* to)
+// Saves the callee-saved registers to from, and restores them from to. Returns to the lr stored in to.
+CODE_BEGIN __nx_fiber_switch
+	stp x19, x20, [x0, #0x00]
+	stp x21, x22, [x0, #0x10]
+	stp x23, x24, [x0, #0x20]
+	stp x25, x26, [x0, #0x30]
+	stp x27, x28, [x0, #0x40]
+	stp x29, x30, [x0, #0x50]
+	mov x2, sp
+	str x2,       [x0, #0x60]
+	stp d8,  d9,  [x0, #0x70]
+	stp d10, d11, [x0, #0x80]
+	stp d12, d13, [x0, #0x90]
+	stp d14, d15, [x0, #0xA0]
+
+	ldp x19, x20, [x1, #0x00]
+	ldp x21, x22, [x1, #0x10]
+	ldp x23, x24, [x1, #0x20]
+	ldp x25, x26, [x1, #0x30]
+	ldp x27, x28, [x1, #0x40]
+	ldp x29, x30, [x1, #0x50]
+	ldr x2,       [x1, #0x60]
+	ldp d8,  d9,  [x1, #0x70]
+	ldp d10, d11, [x1, #0x80]
+	ldp d12, d13, [x1, #0x90]
+	ldp d14, d15, [x1, #0xA0]
+	mov sp, x2
+	ret
+CODE_END
+
+// First code run by a new fiber: x19 holds the Fiber pointer.
+CODE_BEGIN __nx_fiber_entry
+	mov x0, x19
+	mov x29, xzr
+	mov x30, xzr
+	b   __nx_fiber_main
+CODE_END
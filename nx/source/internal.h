@@ -41,3 +41,8 @@ NX_INLINE size_t getTlsStartOffset(void)
     size_t tcb_sz = 2*sizeof(void*);
     return __tls_align > tcb_sz ? __tls_align : tcb_sz;
 }
+
+// Called for the helper threads started by libnx (before starting them) and stopped by it (before closing their
+// handle), so that they join the group selected with schedSetHelperGroup.
+void schedAddHelperThread(Handle thread);
+void schedRemoveHelperThread(Handle thread);
@@ -0,0 +1,229 @@
+#include <string.h>
+#include <stddef.h>
+#include "result.h"
+#include "kernel/svc.h"
+#include "kernel/mutex.h"
+#include "kernel/virtmem.h"
+#include "kernel/fiber.h"
+#include "runtime/diag.h"
+#include "../runtime/alloc.h"
+
+void __nx_fiber_switch(FiberContext* from, const FiberContext* to);
+void __nx_fiber_entry(void);
+void NX_NORETURN __nx_fiber_main(Fiber* f);
+
+// Offsets used by __nx_fiber_switch (arm/fiber.s).
+_Static_assert(offsetof(FiberContext, x) == 0x00, "FiberContext.x must match fiber.s");
+_Static_assert(offsetof(FiberContext, sp) == 0x60, "FiberContext.sp must match fiber.s");
+_Static_assert(offsetof(FiberContext, d) == 0x70, "FiberContext.d must match fiber.s");
+_Static_assert(sizeof(FiberContext) == 0xB0, "FiberContext size must match fiber.s");
+
+typedef struct {
+    void* mem;
+    void* mirror;
+    size_t size;
+} FiberStack;
+
+static Mutex g_fiberPoolMutex;
+static FiberStack g_fiberPool[FIBER_STACK_POOL_SIZE];
+static u32 g_fiberPoolCount;
+
+static __thread Fiber g_fiberThread;
+static __thread Fiber* g_fiberCurrent;
+static __thread const FiberScheduler* g_fiberScheduler;
+
+static Fiber* _fiberGetCurrent(void)
+{
+    Fiber* cur = g_fiberCurrent;
+    if (!cur) {
+        cur = &g_fiberThread;
+        cur->state = FiberState_Running;
+        g_fiberCurrent = cur;
+    }
+    return cur;
+}
+
+static Result _fiberStackMap(FiberStack* stack, size_t size)
+{
+    void* mem = __libnx_aligned_alloc(0x1000, size);
+    if (!mem)
+        return MAKERESULT(Module_Libnx, LibnxError_OutOfMemory);
+
+    // The guard region left around the mirror by virtmemFindStack stays unmapped, catching stack overflows.
+    virtmemLock();
+    void* mirror = virtmemFindStack(size, 0x4000);
+    Result rc = svcMapMemory(mirror, mem, size);
+    virtmemUnlock();
+
+    if (R_FAILED(rc)) {
+        __libnx_free(mem);
+        return rc;
+    }
+
+    stack->mem = mem;
+    stack->mirror = mirror;
+    stack->size = size;
+    return 0;
+}
+
+static void _fiberStackUnmap(FiberStack* stack)
+{
+    svcUnmapMemory(stack->mirror, stack->mem, stack->size);
+    __libnx_free(stack->mem);
+}
+
+static Result _fiberStackAlloc(FiberStack* stack, size_t size)
+{
+    mutexLock(&g_fiberPoolMutex);
+    for (u32 i = 0; i < g_fiberPoolCount; i ++) {
+        if (g_fiberPool[i].size == size) {
+            *stack = g_fiberPool[i];
+            g_fiberPool[i] = g_fiberPool[--g_fiberPoolCount];
+            mutexUnlock(&g_fiberPoolMutex);
+            return 0;
+        }
+    }
+    mutexUnlock(&g_fiberPoolMutex);
+
+    return _fiberStackMap(stack, size);
+}
+
+static void _fiberStackFree(FiberStack* stack)
+{
+    mutexLock(&g_fiberPoolMutex);
+    if (g_fiberPoolCount < FIBER_STACK_POOL_SIZE) {
+        g_fiberPool[g_fiberPoolCount++] = *stack;
+        stack = NULL;
+    }
+    mutexUnlock(&g_fiberPoolMutex);
+
+    if (stack)
+        _fiberStackUnmap(stack);
+}
+
+void fiberStackPoolClear(void)
+{
+    mutexLock(&g_fiberPoolMutex);
+    while (g_fiberPoolCount)
+        _fiberStackUnmap(&g_fiberPool[--g_fiberPoolCount]);
+    mutexUnlock(&g_fiberPoolMutex);
+}
+
+Result fiberCreate(Fiber* f, FiberFunc entry, void* arg, size_t stack_sz)
+{
+    // Verify stack size alignment
+    if (!stack_sz || (stack_sz & 0xFFF))
+        return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+
+    FiberStack stack;
+    Result rc = _fiberStackAlloc(&stack, stack_sz);
+    if (R_FAILED(rc))
+        return rc;
+
+    memset(f, 0, sizeof(*f));
+    f->entry = entry;
+    f->arg = arg;
+    f->stack_mem = stack.mem;
+    f->stack_mirror = stack.mirror;
+    f->stack_sz = stack.size;
+    f->state = FiberState_Suspended;
+
+    // The first switch to the fiber "returns" to the entry trampoline, with the fiber in x19.
+    f->ctx.x[0] = (u64)f;
+    f->ctx.x[11] = (u64)&__nx_fiber_entry;
+    f->ctx.sp = (u64)stack.mirror + stack.size;
+    return 0;
+}
+
+void fiberClose(Fiber* f)
+{
+    if (f->state == FiberState_Running)
+        diagAbortWithResult(MAKERESULT(Module_Libnx, LibnxError_BadInput));
+
+    if (f->stack_mem) {
+        FiberStack stack = { f->stack_mem, f->stack_mirror, f->stack_sz };
+        _fiberStackFree(&stack);
+        f->stack_mem = NULL;
+        f->stack_mirror = NULL;
+    }
+}
+
+static void _fiberSwitch(Fiber* cur, Fiber* f)
+{
+    cur->state = FiberState_Suspended;
+    f->state = FiberState_Running;
+    g_fiberCurrent = f;
+    __nx_fiber_switch(&cur->ctx, &f->ctx);
+}
+
+void fiberSwitch(Fiber* f)
+{
+    Fiber* cur = _fiberGetCurrent();
+    if (f == cur)
+        return;
+
+    if (f->state != FiberState_Suspended)
+        diagAbortWithResult(MAKERESULT(Module_Libnx, LibnxError_BadInput));
+
+    f->caller = cur;
+    _fiberSwitch(cur, f);
+}
+
+void fiberYield(void)
+{
+    Fiber* cur = _fiberGetCurrent();
+    if (cur == &g_fiberThread || !cur->caller)
+        return;
+
+    _fiberSwitch(cur, cur->caller);
+}
+
+void __nx_fiber_main(Fiber* f)
+{
+    f->entry(f->arg);
+
+    // Go back to the caller for good; the stack is freed by fiberClose.
+    Fiber* caller = f->caller;
+    f->state = FiberState_Finished;
+    caller->state = FiberState_Running;
+    g_fiberCurrent = caller;
+    __nx_fiber_switch(&f->ctx, &caller->ctx);
+    __builtin_unreachable();
+}
+
+Fiber* fiberGetCurrent(void)
+{
+    return _fiberGetCurrent();
+}
+
+bool fiberIsThreadFiber(void)
+{
+    return _fiberGetCurrent() == &g_fiberThread;
+}
+
+void fiberSetScheduler(const FiberScheduler* sched)
+{
+    g_fiberScheduler = sched;
+}
+
+Result fiberWait(Waiter waiter, u64 timeout)
+{
+    const FiberScheduler* sched = g_fiberScheduler;
+    Fiber* cur = _fiberGetCurrent();
+
+    if (sched && sched->wait && cur != &g_fiberThread)
+        return sched->wait(sched->userdata, cur, waiter, timeout);
+
+    return waitSingle(waiter, timeout);
+}
+
+Result fiberWaitSocket(int fd, s16 events, u64 timeout)
+{
+    const FiberScheduler* sched = g_fiberScheduler;
+    Fiber* cur = _fiberGetCurrent();
+
+    if (sched && sched->waitSocket && cur != &g_fiberThread)
+        return sched->waitSocket(sched->userdata, cur, fd, events, timeout);
+
+    return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
+}
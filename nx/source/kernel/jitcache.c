@@ -0,0 +1,315 @@
+#include <string.h>
+#include "result.h"
+#include "arm/cache.h"
+#include "kernel/jit.h"
+#include "kernel/jitcache.h"
+#include "../runtime/alloc.h"
+
+static u32 _jitcacheGetClass(size_t size)
+{
+    // Class k holds free blocks of [2^k, 2^(k+1)) granules.
+    const size_t granules = size / JITCACHE_ALIGN;
+    const u32 cls = 63 - __builtin_clzll(granules);
+    return cls < JITCACHE_NUM_CLASSES ? cls : JITCACHE_NUM_CLASSES-1;
+}
+
+static void _jitcacheListRemove(JitCodeBlock** head, JitCodeBlock** tail, JitCodeBlock* b)
+{
+    if (b->list_prev)
+        b->list_prev->list_next = b->list_next;
+    else
+        *head = b->list_next;
+    if (b->list_next)
+        b->list_next->list_prev = b->list_prev;
+    else if (tail)
+        *tail = b->list_prev;
+}
+
+static void _jitcacheFreeListAdd(JitCodeCache* c, JitCodeBlock* b)
+{
+    JitCodeBlock** head = &c->free_lists[_jitcacheGetClass(b->size)];
+    b->is_free = true;
+    b->list_prev = NULL;
+    b->list_next = *head;
+    if (*head)
+        (*head)->list_prev = b;
+    *head = b;
+}
+
+static void _jitcacheFreeListRemove(JitCodeCache* c, JitCodeBlock* b)
+{
+    _jitcacheListRemove(&c->free_lists[_jitcacheGetClass(b->size)], NULL, b);
+}
+
+static void _jitcacheAgeListAdd(JitCodeCache* c, JitCodeBlock* b)
+{
+    b->is_free = false;
+    b->list_next = NULL;
+    b->list_prev = c->newest;
+    if (c->newest)
+        c->newest->list_next = b;
+    else
+        c->oldest = b;
+    c->newest = b;
+}
+
+// Removes a block from the address order list.
+static void _jitcacheUnlink(JitCodeCache* c, JitCodeBlock* b)
+{
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        c->first = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    else
+        c->last = b->prev;
+}
+
+// Inserts a block after another one (or at the start) in the address order list.
+static void _jitcacheLinkAfter(JitCodeCache* c, JitCodeBlock* after, JitCodeBlock* b)
+{
+    b->prev = after;
+    b->next = after ? after->next : c->first;
+    if (b->next)
+        b->next->prev = b;
+    else
+        c->last = b;
+    if (after)
+        after->next = b;
+    else
+        c->first = b;
+}
+
+static JitCodeBlock* _jitcacheAllocFromFreeLists(JitCodeCache* c, size_t size)
+{
+    for (u32 cls = _jitcacheGetClass(size); cls < JITCACHE_NUM_CLASSES; cls ++) {
+        for (JitCodeBlock* b = c->free_lists[cls]; b; b = b->list_next) {
+            if (b->size < size)
+                continue;
+
+            _jitcacheFreeListRemove(c, b);
+
+            // Split off the remainder, if possible.
+            if (b->size > size) {
+                JitCodeBlock* rest = (JitCodeBlock*)__libnx_alloc(sizeof(JitCodeBlock));
+                if (rest) {
+                    rest->offset = b->offset + size;
+                    rest->size = b->size - size;
+                    rest->userdata = NULL;
+                    b->size = size;
+                    _jitcacheLinkAfter(c, b, rest);
+                    _jitcacheFreeListAdd(c, rest);
+                }
+            }
+
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+static JitCodeBlock* _jitcacheAllocFromBump(JitCodeCache* c, size_t size)
+{
+    if (c->jit.size - c->bump < size)
+        return NULL;
+
+    JitCodeBlock* b = (JitCodeBlock*)__libnx_alloc(sizeof(JitCodeBlock));
+    if (!b)
+        return NULL;
+
+    b->offset = c->bump;
+    b->size = size;
+    c->bump += size;
+    _jitcacheLinkAfter(c, c->last, b);
+    return b;
+}
+
+Result jitcacheCreate(JitCodeCache* c, size_t size)
+{
+    memset(c, 0, sizeof(*c));
+    return jitCreate(&c->jit, size);
+}
+
+Result jitcacheClose(JitCodeCache* c)
+{
+    Result rc = jitClose(&c->jit);
+    if (R_SUCCEEDED(rc)) {
+        while (c->first) {
+            JitCodeBlock* b = c->first;
+            c->first = b->next;
+            __libnx_free(b);
+        }
+        c->last = NULL;
+        c->oldest = NULL;
+        c->newest = NULL;
+        memset(c->free_lists, 0, sizeof(c->free_lists));
+        c->bump = 0;
+    }
+    return rc;
+}
+
+void jitcacheSetEvictCallback(JitCodeCache* c, JitCodeCacheEvictFunc evict, void* userdata)
+{
+    c->evict = evict;
+    c->evict_userdata = userdata;
+}
+
+JitCodeBlock* jitcacheAlloc(JitCodeCache* c, size_t size)
+{
+    size = (size + JITCACHE_ALIGN - 1) &~ (JITCACHE_ALIGN - 1);
+    if (!size)
+        size = JITCACHE_ALIGN;
+
+    for (;;) {
+        JitCodeBlock* b = _jitcacheAllocFromFreeLists(c, size);
+        if (!b)
+            b = _jitcacheAllocFromBump(c, size);
+
+        if (b) {
+            b->userdata = NULL;
+            _jitcacheAgeListAdd(c, b);
+            return b;
+        }
+
+        // Evict the oldest block; freeing it coalesces it with its free neighbours.
+        if (!c->evict || !c->oldest)
+            return NULL;
+
+        JitCodeBlock* victim = c->oldest;
+        c->evict(c, victim, c->evict_userdata);
+        jitcacheFree(c, victim);
+    }
+}
+
+void jitcacheFree(JitCodeCache* c, JitCodeBlock* b)
+{
+    _jitcacheListRemove(&c->oldest, &c->newest, b);
+
+    // Coalesce with the neighbouring free blocks.
+    JitCodeBlock* prev = b->prev;
+    if (prev && prev->is_free) {
+        _jitcacheFreeListRemove(c, prev);
+        prev->size += b->size;
+        _jitcacheUnlink(c, b);
+        __libnx_free(b);
+        b = prev;
+    }
+
+    JitCodeBlock* next = b->next;
+    if (next && next->is_free) {
+        _jitcacheFreeListRemove(c, next);
+        b->size += next->size;
+        _jitcacheUnlink(c, next);
+        __libnx_free(next);
+    }
+
+    // Give the space back to the bump allocator if this is the last block.
+    if (b == c->last) {
+        c->bump = b->offset;
+        _jitcacheUnlink(c, b);
+        __libnx_free(b);
+        return;
+    }
+
+    _jitcacheFreeListAdd(c, b);
+}
+
+Result jitcacheBeginWrite(JitCodeCache* c)
+{
+    return jitTransitionToWritable(&c->jit);
+}
+
+static void _jitcacheAddDirty(JitCodeCache* c, size_t start, size_t end)
+{
+    start &= ~(size_t)(JITCACHE_ALIGN - 1);
+    end = (end + JITCACHE_ALIGN - 1) &~ (JITCACHE_ALIGN - 1);
+
+    // Merge with the ranges it overlaps or touches.
+    for (u32 i = 0; i < c->num_dirty;) {
+        JitCodeRange* r = &c->dirty[i];
+        if (r->start <= end && start <= r->end) {
+            if (r->start < start)
+                start = r->start;
+            if (r->end > end)
+                end = r->end;
+            *r = c->dirty[--c->num_dirty];
+        } else
+            i ++;
+    }
+
+    if (c->num_dirty < JITCACHE_MAX_DIRTY_RANGES) {
+        c->dirty[c->num_dirty].start = start;
+        c->dirty[c->num_dirty].end = end;
+        c->num_dirty ++;
+        return;
+    }
+
+    // Out of ranges: grow the one which needs the least extension to cover the new range.
+    u32 best = 0;
+    size_t best_cost = SIZE_MAX;
+    for (u32 i = 0; i < c->num_dirty; i ++) {
+        const JitCodeRange* r = &c->dirty[i];
+        const size_t cost = (r->start > start ? r->start - start : 0) + (end > r->end ? end - r->end : 0);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = i;
+        }
+    }
+
+    if (c->dirty[best].start > start)
+        c->dirty[best].start = start;
+    if (c->dirty[best].end < end)
+        c->dirty[best].end = end;
+}
+
+void jitcacheMarkDirty(JitCodeCache* c, void* rw, size_t size)
+{
+    const size_t start = (uintptr_t)rw - (uintptr_t)c->jit.rw_addr;
+    if (size)
+        _jitcacheAddDirty(c, start, start + size);
+}
+
+void jitcacheWrite(JitCodeCache* c, JitCodeBlock* block, size_t offset, const void* data, size_t size)
+{
+    memcpy((u8*)jitcacheGetRwAddr(c, block) + offset, data, size);
+    if (size)
+        _jitcacheAddDirty(c, block->offset + offset, block->offset + offset + size);
+}
+
+Result jitcachePatchBranch(JitCodeCache* c, void* rx_site, const void* rx_target, bool link)
+{
+    const s64 delta = (s64)((uintptr_t)rx_target - (uintptr_t)rx_site);
+    if (((uintptr_t)rx_site & 3) || (delta & 3) || delta < -(1LL << 27) || delta >= (1LL << 27))
+        return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+
+    const u32 insn = (link ? 0x94000000 : 0x14000000) | ((u32)(delta >> 2) & 0x3FFFFFF);
+    u32* rw = (u32*)jitcacheRxToRw(c, rx_site);
+
+    // A single aligned store, so that threads running the code see either the old or the new instruction.
+    __atomic_store_n(rw, insn, __ATOMIC_RELAXED);
+    jitcacheMarkDirty(c, rw, sizeof(u32));
+    return 0;
+}
+
+Result jitcacheCommit(JitCodeCache* c)
+{
+    // Write back the modified code while the writable alias is still mapped.
+    for (u32 i = 0; i < c->num_dirty; i ++)
+        armDCacheFlush((u8*)c->jit.rw_addr + c->dirty[i].start, c->dirty[i].end - c->dirty[i].start);
+
+    Result rc = 0;
+    if (c->jit.type == JitType_SetProcessMemoryPermission)
+        rc = jitTransitionToExecutable(&c->jit);
+    else
+        c->jit.is_executable = 1;
+
+    if (R_SUCCEEDED(rc)) {
+        for (u32 i = 0; i < c->num_dirty; i ++)
+            armICacheInvalidate((u8*)c->jit.rx_addr + c->dirty[i].start, c->dirty[i].end - c->dirty[i].start);
+        c->num_dirty = 0;
+    }
+
+    return rc;
+}
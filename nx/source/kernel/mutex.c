@@ -6,6 +6,10 @@
 
 #define HANDLE_WAIT_MASK 0x40000000u
 
+// Number of polls done on a contended mutex before asking the kernel to arbitrate.
+// The owner's core can't be queried from user mode, so this is a fixed budget.
+#define MUTEX_SPIN_COUNT 100
+
 #define LIKELY(expr)   (__builtin_expect_with_probability(!!(expr), 1, 1.0))
 #define UNLIKELY(expr) (__builtin_expect_with_probability(!!(expr), 0, 1.0))
 
@@ -29,9 +33,39 @@ NX_INLINE void _ClearExclusive(void) {
     __asm__ __volatile__("clrex" ::: "memory");
 }
 
+NX_INLINE void _Yield(void) {
+    __asm__ __volatile__("yield" ::: "memory");
+}
+
+static bool _mutexSpin(Mutex* m, u32 cur_handle) {
+    for (u32 i = 0; i < MUTEX_SPIN_COUNT; i ++) {
+        _Yield();
+
+        u32 value = __atomic_load_n(m, __ATOMIC_RELAXED);
+
+        // If other threads are already sleeping on the mutex, don't try to take it over from them.
+        if (value & HANDLE_WAIT_MASK)
+            break;
+
+        if (value == INVALID_HANDLE) {
+            // Try to take the mutex.
+            value = _LoadExclusive(m);
+            if (value == INVALID_HANDLE) {
+                if (LIKELY(_StoreExclusive(m, cur_handle) == 0))
+                    return true;
+            } else {
+                _ClearExclusive();
+            }
+        }
+    }
+
+    return false;
+}
+
 void mutexLock(Mutex* m) {
     // Get the current thread handle.
     const u32 cur_handle = _GetTag();
+    bool spun = false;
 
     u32 value = _LoadExclusive(m);
     while (true) {
@@ -45,6 +79,16 @@ void mutexLock(Mutex* m) {
             break;
         }
 
+        // If the mutex doesn't have any waiters, the owner may be about to release it: spin for a while first.
+        if (!spun && LIKELY((value & HANDLE_WAIT_MASK) == 0)) {
+            spun = true;
+            _ClearExclusive();
+            if (_mutexSpin(m, cur_handle))
+                break;
+            value = _LoadExclusive(m);
+            continue;
+        }
+
         // If the mutex doesn't have any waiters, try to register ourselves as the first waiter.
         if (LIKELY((value & HANDLE_WAIT_MASK) == 0)) {
             // If we fail, try again.
@@ -0,0 +1,344 @@
+#include <string.h>
+#include "result.h"
+#include "arm/counter.h"
+#include "kernel/svc.h"
+#include "kernel/levent.h"
+#include "kernel/queue.h"
+#include "wait.h"
+
+static bool _spscqueueBeginWait(Waitable* ww, WaiterNode* w, u64 cur_tick, u64* next_tick);
+static bool _mpmcqueueBeginWait(Waitable* ww, WaiterNode* w, u64 cur_tick, u64* next_tick);
+static Result _queueOnTimeout(Waitable* ww, u64 old_tick);
+static Result _queueOnSignal(Waitable* ww);
+
+static const WaitableMethods g_spscqueueVt = {
+    .beginWait = _spscqueueBeginWait,
+    .onTimeout = _queueOnTimeout,
+    .onSignal = _queueOnSignal,
+};
+
+static const WaitableMethods g_mpmcqueueVt = {
+    .beginWait = _mpmcqueueBeginWait,
+    .onTimeout = _queueOnTimeout,
+    .onSignal = _queueOnSignal,
+};
+
+static void _queueNotify(LEvent* le, Waitable* ww)
+{
+    // Pairs with the fences in the blocking functions and in _queueBeginWait: either the waiter
+    // sees the element we just pushed/popped, or we see that it is waiting.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    leventSignal(le);
+
+    // Only take the waitable's mutex if there actually are listeners.
+    if (ww && __atomic_load_n(&ww->list.next, __ATOMIC_RELAXED) != &ww->list) {
+        mutexLock(&ww->mutex);
+        _waitableSignalAllListeners(ww);
+        mutexUnlock(&ww->mutex);
+    }
+}
+
+static bool _queueBeginWait(Waitable* ww, WaiterNode* w, bool not_empty)
+{
+    if (not_empty)
+        return false;
+
+    mutexLock(&ww->mutex);
+    _waiterNodeAdd(w);
+    mutexUnlock(&ww->mutex);
+    return true;
+}
+
+static bool _queueRecheck(Waitable* ww, bool not_empty)
+{
+    // An element may have been pushed before the producer could see our listener, so signal it ourselves.
+    if (not_empty) {
+        mutexLock(&ww->mutex);
+        _waitableSignalAllListeners(ww);
+        mutexUnlock(&ww->mutex);
+    }
+    return true;
+}
+
+Result _queueOnSignal(Waitable* ww)
+{
+    // Queues are level-triggered: the element may already have been taken by another consumer,
+    // so users are expected to use the Try functions after the wait.
+    return 0;
+}
+
+Result _queueOnTimeout(Waitable* ww, u64 old_tick)
+{
+    // This is not supposed to happen.
+    return KERNELRESULT(Cancelled);
+}
+
+static u64 _queueGetDeadline(u64 timeout_ns)
+{
+    return timeout_ns != UINT64_MAX ? armGetSystemTick() + armNsToTicks(timeout_ns) : UINT64_MAX;
+}
+
+static bool _queueWait(LEvent* le, u64 deadline)
+{
+    u64 timeout_ns = UINT64_MAX;
+    if (deadline != UINT64_MAX) {
+        s64 remaining = deadline - armGetSystemTick();
+        if (remaining <= 0)
+            return false;
+        timeout_ns = armTicksToNs(remaining);
+    }
+
+    return leventWait(le, timeout_ns);
+}
+
+static bool _queueCheckInit(void* storage, u32 elem_size, u32 capacity)
+{
+    return storage && elem_size && capacity && (capacity & (capacity - 1)) == 0;
+}
+
+Result spscqueueInit(SpscQueue* q, void* storage, u32 elem_size, u32 capacity)
+{
+    if (!_queueCheckInit(storage, elem_size, capacity))
+        return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+
+    _waitableInitialize(&q->waitable, &g_spscqueueVt);
+    leventInit(&q->not_empty, false, false);
+    leventInit(&q->not_full, false, false);
+    q->storage = (u8*)storage;
+    q->elem_size = elem_size;
+    q->mask = capacity - 1;
+    q->head = 0;
+    q->cached_tail = 0;
+    q->tail = 0;
+    q->cached_head = 0;
+    return 0;
+}
+
+bool spscqueueTryPush(SpscQueue* q, const void* elem)
+{
+    const u32 tail = q->tail;
+
+    // Only look at the consumer's index when the queue looks full from our last copy of it.
+    if (tail - q->cached_head > q->mask) {
+        q->cached_head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (tail - q->cached_head > q->mask)
+            return false;
+    }
+
+    memcpy(q->storage + (tail & q->mask) * q->elem_size, elem, q->elem_size);
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    _queueNotify(&q->not_empty, &q->waitable);
+    return true;
+}
+
+bool spscqueueTryPop(SpscQueue* q, void* elem)
+{
+    const u32 head = q->head;
+
+    // Only look at the producer's index when the queue looks empty from our last copy of it.
+    if (head == q->cached_tail) {
+        q->cached_tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (head == q->cached_tail)
+            return false;
+    }
+
+    memcpy(elem, q->storage + (head & q->mask) * q->elem_size, q->elem_size);
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+    _queueNotify(&q->not_full, NULL);
+    return true;
+}
+
+bool spscqueuePush(SpscQueue* q, const void* elem, u64 timeout_ns)
+{
+    if (spscqueueTryPush(q, elem))
+        return true;
+
+    const u64 deadline = _queueGetDeadline(timeout_ns);
+    while (true) {
+        leventClear(&q->not_full);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (spscqueueTryPush(q, elem))
+            return true;
+        if (!_queueWait(&q->not_full, deadline))
+            return false;
+        if (spscqueueTryPush(q, elem))
+            return true;
+    }
+}
+
+bool spscqueuePop(SpscQueue* q, void* elem, u64 timeout_ns)
+{
+    if (spscqueueTryPop(q, elem))
+        return true;
+
+    const u64 deadline = _queueGetDeadline(timeout_ns);
+    while (true) {
+        leventClear(&q->not_empty);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (spscqueueTryPop(q, elem))
+            return true;
+        if (!_queueWait(&q->not_empty, deadline))
+            return false;
+        if (spscqueueTryPop(q, elem))
+            return true;
+    }
+}
+
+bool _spscqueueBeginWait(Waitable* ww, WaiterNode* w, u64 cur_tick, u64* next_tick)
+{
+    SpscQueue* q = (SpscQueue*)ww;
+    if (!_queueBeginWait(ww, w, spscqueueGetCount(q) != 0))
+        return false;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return _queueRecheck(ww, spscqueueGetCount(q) != 0);
+}
+
+/*
+    Multi-producer multi-consumer queue, based on Dmitry Vyukov's bounded MPMC queue.
+
+    Each cell holds a sequence number followed by the element. A cell at position pos is free
+    for the producer reserving pos when its sequence number is pos, and holds an element for
+    the consumer reserving pos when its sequence number is pos+1.
+*/
+
+NX_INLINE u32* _mpmcqueueGetSequence(MpmcQueue* q, u32 pos)
+{
+    return (u32*)(q->storage + (pos & q->mask) * q->stride);
+}
+
+NX_INLINE u8* _mpmcqueueGetData(MpmcQueue* q, u32 pos)
+{
+    return q->storage + (pos & q->mask) * q->stride + 8;
+}
+
+Result mpmcqueueInit(MpmcQueue* q, void* storage, u32 elem_size, u32 capacity)
+{
+    if (!_queueCheckInit(storage, elem_size, capacity) || ((uintptr_t)storage & 7))
+        return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+
+    _waitableInitialize(&q->waitable, &g_mpmcqueueVt);
+    leventInit(&q->not_empty, false, false);
+    leventInit(&q->not_full, false, false);
+    q->storage = (u8*)storage;
+    q->elem_size = elem_size;
+    q->stride = 8 + ((elem_size + 7) &~ 7);
+    q->mask = capacity - 1;
+    q->enqueue_pos = 0;
+    q->dequeue_pos = 0;
+
+    for (u32 i = 0; i < capacity; i ++)
+        *_mpmcqueueGetSequence(q, i) = i;
+
+    return 0;
+}
+
+bool mpmcqueueTryPush(MpmcQueue* q, const void* elem)
+{
+    u32 pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    while (true) {
+        const u32 seq = __atomic_load_n(_mpmcqueueGetSequence(q, pos), __ATOMIC_ACQUIRE);
+        const s32 diff = (s32)(seq - pos);
+        if (diff == 0) {
+            // The cell is free, try to reserve it.
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // The cell still holds the element from the previous lap: the queue is full.
+            return false;
+        } else {
+            // Another producer took the cell, start over.
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(_mpmcqueueGetData(q, pos), elem, q->elem_size);
+    __atomic_store_n(_mpmcqueueGetSequence(q, pos), pos + 1, __ATOMIC_RELEASE);
+
+    _queueNotify(&q->not_empty, &q->waitable);
+    return true;
+}
+
+bool mpmcqueueTryPop(MpmcQueue* q, void* elem)
+{
+    u32 pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    while (true) {
+        const u32 seq = __atomic_load_n(_mpmcqueueGetSequence(q, pos), __ATOMIC_ACQUIRE);
+        const s32 diff = (s32)(seq - (pos + 1));
+        if (diff == 0) {
+            // The cell holds an element, try to reserve it.
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // The cell hasn't been filled yet: the queue is empty.
+            return false;
+        } else {
+            // Another consumer took the cell, start over.
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(elem, _mpmcqueueGetData(q, pos), q->elem_size);
+    __atomic_store_n(_mpmcqueueGetSequence(q, pos), pos + q->mask + 1, __ATOMIC_RELEASE);
+
+    _queueNotify(&q->not_full, NULL);
+    return true;
+}
+
+bool mpmcqueuePush(MpmcQueue* q, const void* elem, u64 timeout_ns)
+{
+    if (mpmcqueueTryPush(q, elem))
+        return true;
+
+    const u64 deadline = _queueGetDeadline(timeout_ns);
+    while (true) {
+        leventClear(&q->not_full);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (mpmcqueueTryPush(q, elem))
+            break;
+        if (!_queueWait(&q->not_full, deadline))
+            return false;
+        if (mpmcqueueTryPush(q, elem))
+            break;
+    }
+
+    // We may have cleared a signal meant for another producer, so pass it on if there is still room.
+    if (mpmcqueueGetCount(q) <= q->mask)
+        leventSignal(&q->not_full);
+    return true;
+}
+
+bool mpmcqueuePop(MpmcQueue* q, void* elem, u64 timeout_ns)
+{
+    if (mpmcqueueTryPop(q, elem))
+        return true;
+
+    const u64 deadline = _queueGetDeadline(timeout_ns);
+    while (true) {
+        leventClear(&q->not_empty);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (mpmcqueueTryPop(q, elem))
+            break;
+        if (!_queueWait(&q->not_empty, deadline))
+            return false;
+        if (mpmcqueueTryPop(q, elem))
+            break;
+    }
+
+    // We may have cleared a signal meant for another consumer, so pass it on if elements are left.
+    if (mpmcqueueGetCount(q) != 0)
+        leventSignal(&q->not_empty);
+    return true;
+}
+
+bool _mpmcqueueBeginWait(Waitable* ww, WaiterNode* w, u64 cur_tick, u64* next_tick)
+{
+    MpmcQueue* q = (MpmcQueue*)ww;
+    if (!_queueBeginWait(ww, w, mpmcqueueGetCount(q) != 0))
+        return false;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return _queueRecheck(ww, mpmcqueueGetCount(q) != 0);
+}
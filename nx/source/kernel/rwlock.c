@@ -1,170 +1,298 @@
 // Copyright 2018 plutoo
 #include "kernel/mutex.h"
+#include "kernel/condvar.h"
+#include "kernel/futex.h"
 #include "kernel/rwlock.h"
+#include "runtime/hosversion.h"
 #include "../internal.h"
 
+/*
+    Layout of the state word of a RwLock:
+
+    bit 31     - A writer holds write_mutex and is waiting for (or holds) the lock; new readers block
+    bit 30     - Readers are sleeping on the state word, waiting for the writer to be done
+    bits 0-29  - Number of readers holding the lock (excluding the write owner's own read locks)
+*/
+
+#define RWLOCK_WRITE_PENDING   BIT(31)
+#define RWLOCK_READERS_WAITING BIT(30)
+#define RWLOCK_READER_MASK     (BIT(30)-1)
+
+/*
+    Address arbitration (and thus futexWait/futexWake) is only available on [4.0.0+]. On earlier versions,
+    waiters sleep on a process-wide condition variable instead: the value is rechecked under its mutex, and
+    wakers always update the value before taking the mutex, so wakeups can't be lost. Waking up every waiter
+    of every lock is only ever done on contention, and threads recheck their own lock when woken up.
+*/
+
+static Mutex g_rwlockFallbackMutex;
+static CondVar g_rwlockFallbackCondVar;
+
+static void _rwlockWait(u32* addr, u32 expected) {
+    if (hosversionAtLeast(4,0,0)) {
+        futexWait(addr, expected, UINT64_MAX);
+        return;
+    }
+
+    mutexLock(&g_rwlockFallbackMutex);
+    if (__atomic_load_n(addr, __ATOMIC_RELAXED) == expected)
+        condvarWait(&g_rwlockFallbackCondVar, &g_rwlockFallbackMutex);
+    mutexUnlock(&g_rwlockFallbackMutex);
+}
+
+static void _rwlockWakeAll(u32* addr) {
+    if (hosversionAtLeast(4,0,0)) {
+        futexWakeAll(addr);
+        return;
+    }
+
+    mutexLock(&g_rwlockFallbackMutex);
+    condvarWakeAll(&g_rwlockFallbackCondVar);
+    mutexUnlock(&g_rwlockFallbackMutex);
+}
+
 NX_INLINE u32 _GetCurrentThreadTag(void) {
     return getThreadVars()->handle;
 }
 
+NX_INLINE bool _rwlockIsOwner(RwLock* r, u32 cur_tag) {
+    return __atomic_load_n(&r->write_owner_tag, __ATOMIC_RELAXED) == cur_tag;
+}
+
 void rwlockInit(RwLock* r) {
-    mutexInit(&r->mutex);
-    condvarInit(&r->condvar_reader_wait);
-    condvarInit(&r->condvar_writer_wait);
+    mutexInit(&r->write_mutex);
 
-    r->read_lock_count = 0;
-    r->read_waiter_count = 0;
+    r->state = 0;
     r->write_lock_count = 0;
-    r->write_waiter_count = 0;
+    r->read_lock_count = 0;
     r->write_owner_tag = 0;
 }
 
 void rwlockReadLock(RwLock* r) {
     const u32 cur_tag = _GetCurrentThreadTag();
 
-    if (r->write_owner_tag == cur_tag) {
+    if (_rwlockIsOwner(r, cur_tag)) {
         r->read_lock_count++;
         return;
     }
 
-    mutexLock(&r->mutex);
-
-    while (r->write_waiter_count > 0) {
-        r->read_waiter_count++;
-        condvarWait(&r->condvar_reader_wait, &r->mutex);
-        r->read_waiter_count--;
-    }
+    u32 value = __atomic_load_n(&r->state, __ATOMIC_RELAXED);
+    while (true) {
+        // Fast path: no writer around, just count ourselves in.
+        if (!(value & RWLOCK_WRITE_PENDING)) {
+            if (__atomic_compare_exchange_n(&r->state, &value, value + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return;
+            continue;
+        }
 
-    r->read_lock_count++;
+        // A writer is waiting or holds the lock: flag ourselves as waiting, and sleep until it's done.
+        if (!(value & RWLOCK_READERS_WAITING)) {
+            if (!__atomic_compare_exchange_n(&r->state, &value, value | RWLOCK_READERS_WAITING, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                continue;
+            value |= RWLOCK_READERS_WAITING;
+        }
 
-    mutexUnlock(&r->mutex);
+        _rwlockWait(&r->state, value);
+        value = __atomic_load_n(&r->state, __ATOMIC_RELAXED);
+    }
 }
 
 bool rwlockTryReadLock(RwLock* r) {
     const u32 cur_tag = _GetCurrentThreadTag();
 
-    if (r->write_owner_tag == cur_tag) {
+    if (_rwlockIsOwner(r, cur_tag)) {
         r->read_lock_count++;
         return true;
     }
 
-    if (!mutexTryLock(&r->mutex)) {
-        return false;
+    u32 value = __atomic_load_n(&r->state, __ATOMIC_RELAXED);
+    while (!(value & RWLOCK_WRITE_PENDING)) {
+        if (__atomic_compare_exchange_n(&r->state, &value, value + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return true;
     }
 
-    const bool got_lock = r->write_waiter_count == 0;
-    if (got_lock) {
-        r->read_lock_count++;
-    }
+    return false;
+}
+
+static void _rwlockRelease(RwLock* r) {
+    // Relinquish control of the lock.
+    r->write_owner_tag = 0;
 
-    mutexUnlock(&r->mutex);
-    return got_lock;
+    const u32 value = __atomic_fetch_and(&r->state, ~(RWLOCK_WRITE_PENDING | RWLOCK_READERS_WAITING), __ATOMIC_RELEASE);
+    if (value & RWLOCK_READERS_WAITING)
+        _rwlockWakeAll(&r->state);
+
+    // Corresponding mutexLock was called in WriteLock/WriteTryLock.
+    mutexUnlock(&r->write_mutex);
 }
 
 void rwlockReadUnlock(RwLock* r) {
     const u32 cur_tag = _GetCurrentThreadTag();
 
-    if (r->write_owner_tag == cur_tag) {
+    if (_rwlockIsOwner(r, cur_tag)) {
         // Write lock is owned by this thread.
         r->read_lock_count--;
-        if (r->read_lock_count == 0 && r->write_lock_count == 0) {
-            // Relinquish control of the lock.
-            r->write_owner_tag = 0;
-
-            if (r->write_waiter_count > 0) {
-                condvarWakeOne(&r->condvar_writer_wait);
-            } else if (r->read_waiter_count > 0) {
-                condvarWakeAll(&r->condvar_reader_wait);
-            }
-
-            // Corresponding mutexLock was called in WriteLock/WriteTryLock.
-            mutexUnlock(&r->mutex);
-        }
+        if (r->read_lock_count == 0 && r->write_lock_count == 0)
+            _rwlockRelease(r);
     } else {
         // Write lock isn't owned by this thread.
-        mutexLock(&r->mutex);
-        r->read_lock_count--;
-        if (r->read_lock_count == 0 && r->write_waiter_count > 0) {
-            condvarWakeOne(&r->condvar_writer_wait);
-        }
-        mutexUnlock(&r->mutex);
+        const u32 value = __atomic_sub_fetch(&r->state, 1, __ATOMIC_RELEASE);
+
+        // The last reader out wakes up the pending writer (readers sleeping on the same word will go back to sleep).
+        if ((value & RWLOCK_READER_MASK) == 0 && (value & RWLOCK_WRITE_PENDING))
+            _rwlockWakeAll(&r->state);
     }
 }
 
 void rwlockWriteLock(RwLock* r) {
     const u32 cur_tag = _GetCurrentThreadTag();
 
-    if (r->write_owner_tag == cur_tag) {
+    if (_rwlockIsOwner(r, cur_tag)) {
         r->write_lock_count++;
         return;
     }
 
-    mutexLock(&r->mutex);
+    mutexLock(&r->write_mutex);
 
-    while (r->read_lock_count > 0) {
-        r->write_waiter_count++;
-        condvarWait(&r->condvar_writer_wait, &r->mutex);
-        r->write_waiter_count--;
+    // Block new readers, then wait for the current ones to leave.
+    u32 value = __atomic_or_fetch(&r->state, RWLOCK_WRITE_PENDING, __ATOMIC_ACQUIRE);
+    while (value & RWLOCK_READER_MASK) {
+        _rwlockWait(&r->state, value);
+        value = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
     }
 
     r->write_lock_count = 1;
-    r->write_owner_tag = cur_tag;
+    __atomic_store_n(&r->write_owner_tag, cur_tag, __ATOMIC_RELAXED);
 
-    // mutexUnlock(&r->mutex) is intentionally not called here.
+    // mutexUnlock(&r->write_mutex) is intentionally not called here.
     // The mutex will be unlocked by a call to ReadUnlock or WriteUnlock.
 }
 
 bool rwlockTryWriteLock(RwLock* r) {
     const u32 cur_tag = _GetCurrentThreadTag();
 
-    if (r->write_owner_tag == cur_tag) {
+    if (_rwlockIsOwner(r, cur_tag)) {
         r->write_lock_count++;
         return true;
     }
 
-    if (!mutexTryLock(&r->mutex)) {
+    if (!mutexTryLock(&r->write_mutex)) {
         return false;
     }
 
-    if (r->read_lock_count > 0) {
-        mutexUnlock(&r->mutex);
+    // Writers always clear the wait flags before releasing write_mutex, so the lock is free only if the state is zero.
+    u32 value = 0;
+    if (!__atomic_compare_exchange_n(&r->state, &value, RWLOCK_WRITE_PENDING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        mutexUnlock(&r->write_mutex);
         return false;
     }
 
     r->write_lock_count = 1;
-    r->write_owner_tag = cur_tag;
+    __atomic_store_n(&r->write_owner_tag, cur_tag, __ATOMIC_RELAXED);
 
-    // mutexUnlock(&r->mutex) is intentionally not called here.
+    // mutexUnlock(&r->write_mutex) is intentionally not called here.
     // The mutex will be unlocked by a call to ReadUnlock or WriteUnlock.
     return true;
 }
 
 void rwlockWriteUnlock(RwLock* r) {
     // This function assumes the write lock is held.
-    // This means that r->mutex is locked, and r->write_owner_tag == cur_tag.
-    // if (r->write_owner_tag == cur_tag)
-    {
-        r->write_lock_count--;
-        if (r->write_lock_count == 0 && r->read_lock_count == 0) {
-            // Relinquish control of the lock.
-            r->write_owner_tag = 0;
-
-            if (r->write_waiter_count > 0) {
-                condvarWakeOne(&r->condvar_writer_wait);
-            } else if (r->read_waiter_count > 0) {
-                condvarWakeAll(&r->condvar_reader_wait);
-            }
-
-            // Corresponding mutexLock was called in WriteLock/WriteTryLock.
-            mutexUnlock(&r->mutex);
-        }
-    }
+    // This means that r->write_mutex is locked, and r->write_owner_tag == cur_tag.
+    r->write_lock_count--;
+    if (r->write_lock_count == 0 && r->read_lock_count == 0)
+        _rwlockRelease(r);
 }
 
 bool rwlockIsWriteLockHeldByCurrentThread(RwLock* r) {
-    return r->write_owner_tag == _GetCurrentThreadTag() && r->write_lock_count > 0;
+    return _rwlockIsOwner(r, _GetCurrentThreadTag()) && r->write_lock_count > 0;
 }
 
 bool rwlockIsOwnedByCurrentThread(RwLock* r) {
-    return r->write_owner_tag == _GetCurrentThreadTag();
+    return _rwlockIsOwner(r, _GetCurrentThreadTag());
+}
+
+NX_INLINE u32* _drwlockGetCount(DistRwLock* r) {
+    // Spread threads over the counters based on their handle, so that a thread always uses the same counter.
+    const u32 tag = _GetCurrentThreadTag();
+    return &r->stripes[(tag ^ (tag >> 15)) % DRWLOCK_NUM_STRIPES].count;
+}
+
+static void _drwlockReadRelease(DistRwLock* r, u32* count) {
+    // Pairs with the store/load sequence in WriteLock: either we see the pending writer, or it sees our decrement.
+    if (__atomic_sub_fetch(count, 1, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&r->write_pending, __ATOMIC_SEQ_CST))
+        _rwlockWakeAll(count);
+}
+
+void drwlockInit(DistRwLock* r) {
+    for (u32 i = 0; i < DRWLOCK_NUM_STRIPES; i ++)
+        r->stripes[i].count = 0;
+    r->write_pending = 0;
+    mutexInit(&r->write_mutex);
+}
+
+void drwlockReadLock(DistRwLock* r) {
+    u32* count = _drwlockGetCount(r);
+
+    while (true) {
+        __atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&r->write_pending, __ATOMIC_SEQ_CST))
+            return;
+
+        // A writer is pending: back off and wait for it to be done.
+        _drwlockReadRelease(r, count);
+        while (__atomic_load_n(&r->write_pending, __ATOMIC_ACQUIRE))
+            _rwlockWait(&r->write_pending, 1);
+    }
+}
+
+bool drwlockTryReadLock(DistRwLock* r) {
+    u32* count = _drwlockGetCount(r);
+
+    __atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&r->write_pending, __ATOMIC_SEQ_CST))
+        return true;
+
+    _drwlockReadRelease(r, count);
+    return false;
+}
+
+void drwlockReadUnlock(DistRwLock* r) {
+    _drwlockReadRelease(r, _drwlockGetCount(r));
+}
+
+static void _drwlockClearPending(DistRwLock* r) {
+    __atomic_store_n(&r->write_pending, 0, __ATOMIC_RELEASE);
+    _rwlockWakeAll(&r->write_pending);
+    mutexUnlock(&r->write_mutex);
+}
+
+void drwlockWriteLock(DistRwLock* r) {
+    mutexLock(&r->write_mutex);
+    __atomic_store_n(&r->write_pending, 1, __ATOMIC_SEQ_CST);
+
+    // Wait for all the readers to leave. Readers arriving from now on back off.
+    for (u32 i = 0; i < DRWLOCK_NUM_STRIPES; i ++) {
+        u32 value;
+        while ((value = __atomic_load_n(&r->stripes[i].count, __ATOMIC_SEQ_CST)) != 0)
+            _rwlockWait(&r->stripes[i].count, value);
+    }
+}
+
+bool drwlockTryWriteLock(DistRwLock* r) {
+    if (!mutexTryLock(&r->write_mutex))
+        return false;
+
+    __atomic_store_n(&r->write_pending, 1, __ATOMIC_SEQ_CST);
+    for (u32 i = 0; i < DRWLOCK_NUM_STRIPES; i ++) {
+        if (__atomic_load_n(&r->stripes[i].count, __ATOMIC_SEQ_CST) != 0) {
+            _drwlockClearPending(r);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void drwlockWriteUnlock(DistRwLock* r) {
+    _drwlockClearPending(r);
 }
@@ -0,0 +1,298 @@
+#include <string.h>
+#include "types.h"
+#include "result.h"
+#include "arm/counter.h"
+#include "kernel/svc.h"
+#include "kernel/mutex.h"
+#include "kernel/sched.h"
+#include "../internal.h"
+
+#define SAMPLE_MAX_YIELDS 16 // How many times schedSampleCores yields while waiting for the thread to reach a core.
+
+static Mutex g_schedMutex;
+static SchedGroup* g_schedGroups;
+static SchedGroup* g_schedHelperGroup;
+
+static u64 _schedGetProcessCoreMask(void)
+{
+    u64 mask = 0;
+    if (R_FAILED(svcGetInfo(&mask, InfoType_CoreMask, CUR_PROCESS_HANDLE, 0)))
+        mask = 0x7;
+    return mask & ((1UL << SCHED_NUM_CORES) - 1);
+}
+
+// Picks the core to pin a thread to, or -1 if the thread isn't pinned.
+static s32 _schedGroupPickCore(SchedGroup* g)
+{
+    if (g->policy == SchedAffinity_Any || !g->core_mask)
+        return -1;
+
+    if (g->policy == SchedAffinity_Pinned) {
+        for (u32 i = 0; i < SCHED_NUM_CORES; i ++) {
+            u32 core = (g->next_core + i) % SCHED_NUM_CORES;
+            if (g->core_mask & BIT(core)) {
+                g->next_core = core + 1;
+                return core;
+            }
+        }
+        return -1;
+    }
+
+    u32 counts[SCHED_NUM_CORES] = {0};
+    for (u32 i = 0; i < g->num_threads; i ++)
+        if (g->thread_cores[i] >= 0)
+            counts[g->thread_cores[i]] ++;
+
+    s32 best = -1;
+    for (u32 core = 0; core < SCHED_NUM_CORES; core ++)
+        if ((g->core_mask & BIT(core)) && (best < 0 || counts[core] < counts[best]))
+            best = core;
+    return best;
+}
+
+static Result _schedGroupApply(SchedGroup* g, u32 idx)
+{
+    Result rc = 0;
+    const Handle thread = g->threads[idx];
+    const s32 core = g->thread_cores[idx];
+
+    if (g->core_mask) {
+        if (core >= 0)
+            rc = svcSetThreadCoreMask(thread, core, BIT(core));
+        else {
+            // Keep the preferred core if it is allowed, otherwise move the thread to the first allowed core.
+            s32 preferred = 0;
+            u64 affinity = 0;
+            rc = svcGetThreadCoreMask(&preferred, &affinity, thread);
+            if (R_SUCCEEDED(rc)) {
+                if (preferred < 0 || !(g->core_mask & BIT(preferred)))
+                    preferred = __builtin_ctzll(g->core_mask);
+                rc = svcSetThreadCoreMask(thread, preferred, g->core_mask);
+            }
+        }
+    }
+
+    if (R_SUCCEEDED(rc) && g->priority >= 0)
+        rc = svcSetThreadPriority(thread, g->priority);
+
+    return rc;
+}
+
+Result schedGroupCreate(SchedGroup* g, const char* name, u64 core_mask, s32 priority, SchedAffinityPolicy policy)
+{
+    memset(g, 0, sizeof(*g));
+    mutexInit(&g->mutex);
+    strncpy(g->name, name, sizeof(g->name) - 1);
+    g->core_mask = core_mask & _schedGetProcessCoreMask();
+    g->priority = priority;
+    g->policy = policy;
+
+    Result rc = 0;
+    mutexLock(&g_schedMutex);
+    for (SchedGroup* cur = g_schedGroups; cur; cur = cur->next) {
+        if (strcmp(cur->name, g->name) == 0) {
+            rc = MAKERESULT(Module_Libnx, LibnxError_AlreadyInitialized);
+            break;
+        }
+    }
+    if (R_SUCCEEDED(rc)) {
+        g->next = g_schedGroups;
+        g_schedGroups = g;
+    }
+    mutexUnlock(&g_schedMutex);
+
+    return rc;
+}
+
+void schedGroupClose(SchedGroup* g)
+{
+    mutexLock(&g_schedMutex);
+    for (SchedGroup** cur = &g_schedGroups; *cur; cur = &(*cur)->next) {
+        if (*cur == g) {
+            *cur = g->next;
+            break;
+        }
+    }
+    if (g_schedHelperGroup == g)
+        g_schedHelperGroup = NULL;
+    mutexUnlock(&g_schedMutex);
+
+    g->next = NULL;
+    g->num_threads = 0;
+}
+
+SchedGroup* schedGroupFind(const char* name)
+{
+    SchedGroup* g;
+
+    mutexLock(&g_schedMutex);
+    for (g = g_schedGroups; g; g = g->next)
+        if (strncmp(g->name, name, sizeof(g->name) - 1) == 0)
+            break;
+    mutexUnlock(&g_schedMutex);
+
+    return g;
+}
+
+Result schedGroupSetPolicy(SchedGroup* g, u64 core_mask, s32 priority, SchedAffinityPolicy policy)
+{
+    Result rc = 0;
+
+    mutexLock(&g->mutex);
+    g->core_mask = core_mask & _schedGetProcessCoreMask();
+    g->priority = priority;
+    g->policy = policy;
+    g->next_core = 0;
+
+    // Pick the cores again from scratch, so that balancing only sees the threads already placed.
+    const u32 num_threads = g->num_threads;
+    for (u32 i = 0; i < num_threads; i ++)
+        g->thread_cores[i] = -1;
+
+    for (u32 i = 0; i < num_threads; i ++) {
+        g->num_threads = i;
+        g->thread_cores[i] = _schedGroupPickCore(g);
+        Result rc2 = _schedGroupApply(g, i);
+        if (R_SUCCEEDED(rc))
+            rc = rc2;
+    }
+    g->num_threads = num_threads;
+    mutexUnlock(&g->mutex);
+
+    return rc;
+}
+
+Result schedGroupAddThread(SchedGroup* g, Handle thread)
+{
+    Result rc = 0;
+
+    mutexLock(&g->mutex);
+    if (g->num_threads < SCHED_GROUP_MAX_THREADS) {
+        const u32 idx = g->num_threads;
+        g->threads[idx] = thread;
+        g->thread_cores[idx] = _schedGroupPickCore(g);
+
+        rc = _schedGroupApply(g, idx);
+        if (R_SUCCEEDED(rc))
+            g->num_threads ++;
+    }
+    else
+        rc = MAKERESULT(Module_Libnx, LibnxError_OutOfMemory);
+    mutexUnlock(&g->mutex);
+
+    return rc;
+}
+
+void schedGroupRemoveThread(SchedGroup* g, Handle thread)
+{
+    mutexLock(&g->mutex);
+    for (u32 i = 0; i < g->num_threads; i ++) {
+        if (g->threads[i] == thread) {
+            g->num_threads --;
+            g->threads[i] = g->threads[g->num_threads];
+            g->thread_cores[i] = g->thread_cores[g->num_threads];
+            break;
+        }
+    }
+    mutexUnlock(&g->mutex);
+}
+
+Result schedGroupGetTicks(SchedGroup* g, u64* out_ticks)
+{
+    Result rc = 0;
+    u64 total = 0;
+
+    mutexLock(&g->mutex);
+    for (u32 i = 0; i < g->num_threads && R_SUCCEEDED(rc); i ++) {
+        u64 ticks = 0;
+        rc = schedGetThreadTicks(g->threads[i], -1, &ticks);
+        total += ticks;
+    }
+    mutexUnlock(&g->mutex);
+
+    *out_ticks = total;
+    return rc;
+}
+
+void schedSetHelperGroup(SchedGroup* g)
+{
+    mutexLock(&g_schedMutex);
+    g_schedHelperGroup = g;
+    mutexUnlock(&g_schedMutex);
+}
+
+void schedAddHelperThread(Handle thread)
+{
+    mutexLock(&g_schedMutex);
+    if (g_schedHelperGroup)
+        schedGroupAddThread(g_schedHelperGroup, thread);
+    mutexUnlock(&g_schedMutex);
+}
+
+void schedRemoveHelperThread(Handle thread)
+{
+    mutexLock(&g_schedMutex);
+    for (SchedGroup* g = g_schedGroups; g; g = g->next)
+        schedGroupRemoveThread(g, thread);
+    mutexUnlock(&g_schedMutex);
+}
+
+Result schedGetThreadTicks(Handle thread, s32 core, u64* out_ticks)
+{
+    const u64 sub_id = core < 0 ? TickCountInfo_Total : (u64)core;
+
+    Result rc = svcGetInfo(out_ticks, InfoType_ThreadTickCount, thread, sub_id);
+    if (R_FAILED(rc)) // [1.0.0-12.1.0]
+        rc = svcGetInfo(out_ticks, InfoType_ThreadTickCountDeprecated, thread, sub_id);
+
+    return rc;
+}
+
+Result schedSampleCores(SchedCoreSample* out)
+{
+    s32 preferred = 0;
+    u64 affinity = 0;
+    Result rc = svcGetThreadCoreMask(&preferred, &affinity, CUR_THREAD_HANDLE);
+    if (R_FAILED(rc))
+        return rc;
+
+    memset(out, 0, sizeof(*out));
+    const u64 core_mask = _schedGetProcessCoreMask();
+
+    for (u32 core = 0; core < SCHED_NUM_CORES; core ++) {
+        if (!(core_mask & BIT(core)))
+            continue;
+
+        rc = svcSetThreadCoreMask(CUR_THREAD_HANDLE, core, BIT(core));
+        if (R_FAILED(rc))
+            break;
+
+        // The thread is migrated the next time it gets scheduled, which can take a few yields.
+        for (u32 i = 0; i < SAMPLE_MAX_YIELDS && svcGetCurrentProcessorNumber() != core; i ++)
+            svcSleepThread(YieldType_WithoutCoreMigration);
+
+        // Cores which can't be sampled are left out of the sample.
+        if (svcGetCurrentProcessorNumber() == core &&
+            R_SUCCEEDED(svcGetInfo(&out->idle_ticks[core], InfoType_IdleTickCount, INVALID_HANDLE, core)))
+            out->core_mask |= BIT(core);
+    }
+
+    out->tick = armGetSystemTick();
+
+    Result rc2 = svcSetThreadCoreMask(CUR_THREAD_HANDLE, preferred, (u32)affinity);
+    return R_SUCCEEDED(rc) ? rc2 : rc;
+}
+
+void schedGetCoreLoad(const SchedCoreSample* prev, const SchedCoreSample* cur, float out_load[SCHED_NUM_CORES])
+{
+    const u64 elapsed = cur->tick - prev->tick;
+
+    for (u32 core = 0; core < SCHED_NUM_CORES; core ++) {
+        out_load[core] = 0.0f;
+        if (!elapsed || !(prev->core_mask & cur->core_mask & BIT(core)))
+            continue;
+
+        const u64 idle = cur->idle_ticks[core] - prev->idle_ticks[core];
+        out_load[core] = idle >= elapsed ? 0.0f : 1.0f - (float)idle / (float)elapsed;
+    }
+}
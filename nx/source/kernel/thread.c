@@ -12,17 +12,39 @@
 #include "../internal.h"
 #include "../runtime/alloc.h"
 
-#define USER_TLS_BEGIN 0x180
+#define USER_TLS_BEGIN THREAD_TLS_INLINE_OFFSET
 #define USER_TLS_END   (0x200 - sizeof(ThreadVars))
-#define NUM_TLS_SLOTS ((USER_TLS_END - USER_TLS_BEGIN) / sizeof(void*))
+#define TLS_MASK_WORDS (THREAD_TLS_MAX_SLOTS / 64)
+
+// The word following the inline slots points to the thread's array of extended slots.
+_Static_assert(USER_TLS_BEGIN + (THREAD_TLS_NUM_INLINE + 1) * sizeof(void*) <= USER_TLS_END, "Too many inline TLS slots");
+
+typedef struct {
+    u32 capacity;
+    u32 padding;
+    void* values[];
+} ThreadTlsExtArray;
 
 static Mutex g_threadMutex;
 static Thread* g_threadList;
 
 static Thread g_mainThread;
 
-static u64 g_tlsUsageMask;
-static void (* g_tlsDestructors[NUM_TLS_SLOTS])(void*);
+static u64 g_tlsUsageMask[TLS_MASK_WORDS];
+static void (* g_tlsDestructors[THREAD_TLS_MAX_SLOTS])(void*);
+
+// Stack pool: mapped stack mirrors kept around after threadClose, keyed by their (page-aligned) size.
+typedef struct {
+    void*  stack_mem;
+    void*  stack_mirror;
+    size_t size;
+} ThreadStackPoolEntry;
+
+static Mutex g_threadStackPoolMutex;
+static ThreadStackPoolEntry g_threadStackPool[THREAD_STACK_POOL_MAX_ENTRIES];
+static u32 g_threadStackPoolCount;
+static size_t g_threadStackPoolSize;
+static size_t g_threadStackPoolLimit;
 
 // Thread creation args; keep this struct's size 16-byte aligned
 typedef struct {
@@ -85,6 +107,73 @@ void __libnx_init_thread(void) {
     getThreadVars()->thread_ptr = &g_mainThread;
 }
 
+static bool _threadStackPoolTake(size_t size, void** out_mem, void** out_mirror)
+{
+    bool found = false;
+
+    mutexLock(&g_threadStackPoolMutex);
+    for (u32 i = 0; i < g_threadStackPoolCount; i ++) {
+        if (g_threadStackPool[i].size == size) {
+            *out_mem = g_threadStackPool[i].stack_mem;
+            *out_mirror = g_threadStackPool[i].stack_mirror;
+            g_threadStackPoolSize -= size;
+            g_threadStackPool[i] = g_threadStackPool[--g_threadStackPoolCount];
+            found = true;
+            break;
+        }
+    }
+    mutexUnlock(&g_threadStackPoolMutex);
+
+    return found;
+}
+
+// Releases an owned stack, keeping it mapped in the pool if there is room for it.
+static Result _threadStackRelease(void* stack_mem, void* stack_mirror, size_t size)
+{
+    bool pooled = false;
+
+    mutexLock(&g_threadStackPoolMutex);
+    if (g_threadStackPoolCount < THREAD_STACK_POOL_MAX_ENTRIES && g_threadStackPoolSize + size <= g_threadStackPoolLimit) {
+        g_threadStackPool[g_threadStackPoolCount].stack_mem = stack_mem;
+        g_threadStackPool[g_threadStackPoolCount].stack_mirror = stack_mirror;
+        g_threadStackPool[g_threadStackPoolCount].size = size;
+        g_threadStackPoolCount ++;
+        g_threadStackPoolSize += size;
+        pooled = true;
+    }
+    mutexUnlock(&g_threadStackPoolMutex);
+
+    if (pooled)
+        return 0;
+
+    Result rc = svcUnmapMemory(stack_mirror, stack_mem, size);
+    if (R_SUCCEEDED(rc))
+        __libnx_free(stack_mem);
+    return rc;
+}
+
+void threadStackPoolSetLimit(size_t max_size)
+{
+    mutexLock(&g_threadStackPoolMutex);
+    g_threadStackPoolLimit = max_size;
+    mutexUnlock(&g_threadStackPoolMutex);
+
+    // Release the stacks over the new limit.
+    threadStackPoolTrim(max_size);
+}
+
+void threadStackPoolTrim(size_t max_size)
+{
+    mutexLock(&g_threadStackPoolMutex);
+    while (g_threadStackPoolCount && g_threadStackPoolSize > max_size) {
+        ThreadStackPoolEntry* e = &g_threadStackPool[--g_threadStackPoolCount];
+        if (R_SUCCEEDED(svcUnmapMemory(e->stack_mirror, e->stack_mem, e->size)))
+            __libnx_free(e->stack_mem);
+        g_threadStackPoolSize -= e->size;
+    }
+    mutexUnlock(&g_threadStackPoolMutex);
+}
+
 Result threadCreate(
     Thread* t, ThreadFunc entry, void* arg, void* stack_mem, size_t stack_sz,
     int prio, int cpuid)
@@ -98,9 +187,11 @@ Result threadCreate(
     }
 
     bool owns_stack_mem;
+    void* stack_mirror = NULL;
     if (stack_mem == NULL) {
-        // Allocate new memory for the stack, tls and reent.
-        stack_mem = __libnx_aligned_alloc(0x1000, stack_sz + tls_sz + reent_sz);
+        // Reuse a pooled stack if possible, otherwise allocate new memory for the stack, tls and reent.
+        if (!_threadStackPoolTake((stack_sz + tls_sz + reent_sz + 0xFFF) & ~0xFFF, &stack_mem, &stack_mirror))
+            stack_mem = __libnx_aligned_alloc(0x1000, stack_sz + tls_sz + reent_sz);
 
         owns_stack_mem = true;
     } else {
@@ -126,11 +217,14 @@ Result threadCreate(
     }
 
     // Total allocation size may be unaligned in either case.
-    virtmemLock();
     const size_t aligned_stack_sz = (stack_sz + tls_sz + reent_sz + 0xFFF) & ~0xFFF;
-    void* stack_mirror = virtmemFindStack(aligned_stack_sz, 0x4000);
-    Result rc = svcMapMemory(stack_mirror, stack_mem, aligned_stack_sz);
-    virtmemUnlock();
+    Result rc = 0;
+    if (stack_mirror == NULL) {
+        virtmemLock();
+        stack_mirror = virtmemFindStack(aligned_stack_sz, 0x4000);
+        rc = svcMapMemory(stack_mirror, stack_mem, aligned_stack_sz);
+        virtmemUnlock();
+    }
 
     if (R_SUCCEEDED(rc))
     {
@@ -181,6 +275,10 @@ Result threadCreate(
         }
 
         if (R_FAILED(rc)) {
+            if (owns_stack_mem) {
+                _threadStackRelease(stack_mem, stack_mirror, aligned_stack_sz);
+                return rc;
+            }
             svcUnmapMemory(stack_mirror, stack_mem, aligned_stack_sz);
         }
     }
@@ -199,19 +297,25 @@ void threadExit(void) {
     if (!t)
         diagAbortWithResult(MAKERESULT(Module_Libnx, LibnxError_NotInitialized));
 
-    u64 tls_mask = __atomic_load_n(&g_tlsUsageMask, __ATOMIC_SEQ_CST);
-    for (s32 i = 0; i < NUM_TLS_SLOTS; i ++) {
-        if (!(tls_mask & ((UINT64_C(1) << i))))
-            continue;
-        if (t->tls_array[i]) {
-            void* old_value = t->tls_array[i];
-            t->tls_array[i] = NULL;
-            if (g_tlsDestructors[i])
-                g_tlsDestructors[i](old_value);
+    for (u32 w = 0; w < TLS_MASK_WORDS; w ++) {
+        u64 tls_mask = __atomic_load_n(&g_tlsUsageMask[w], __ATOMIC_SEQ_CST);
+        while (tls_mask) {
+            s32 slot_id = w*64 + __builtin_ctzll(tls_mask);
+            tls_mask &= tls_mask - 1;
+
+            void* old_value = threadTlsGet(slot_id);
+            if (old_value) {
+                threadTlsSet(slot_id, NULL);
+                void (* destructor)(void*) = __atomic_load_n(&g_tlsDestructors[slot_id], __ATOMIC_ACQUIRE);
+                if (destructor)
+                    destructor(old_value);
+            }
         }
     }
 
     mutexLock(&g_threadMutex);
+    ThreadTlsExtArray* ext = (ThreadTlsExtArray*)t->tls_array[THREAD_TLS_NUM_INLINE];
+    t->tls_array[THREAD_TLS_NUM_INLINE] = NULL;
     *t->prev_next = t->next;
     if (t->next)
         t->next->prev_next = t->prev_next;
@@ -220,6 +324,8 @@ void threadExit(void) {
     t->prev_next = NULL;
     mutexUnlock(&g_threadMutex);
 
+    __libnx_free(ext);
+
     svcExitThread();
 }
 
@@ -241,12 +347,13 @@ Result threadClose(Thread* t) {
     const size_t reent_sz = (sizeof(struct _reent)+0xF) &~ 0xF;
     const size_t aligned_stack_sz = (t->stack_sz + sizeof(ThreadEntryArgs) + tls_sz + reent_sz + 0xFFF) & ~0xFFF;
 
-    rc = svcUnmapMemory(t->stack_mirror, t->stack_mem, aligned_stack_sz);
+    if (t->owns_stack_mem) {
+        rc = _threadStackRelease(t->stack_mem, t->stack_mirror, aligned_stack_sz);
+    } else {
+        rc = svcUnmapMemory(t->stack_mirror, t->stack_mem, aligned_stack_sz);
+    }
 
     if (R_SUCCEEDED(rc)) {
-        if (t->owns_stack_mem) {
-            __libnx_free(t->stack_mem);
-        }
         svcCloseHandle(t->handle);
     }
 
@@ -274,41 +381,81 @@ Handle threadGetCurHandle(void) {
 }
 
 s32 threadTlsAlloc(void (* destructor)(void*)) {
-    s32 slot_id;
-    u64 new_mask;
-    u64 cur_mask = __atomic_load_n(&g_tlsUsageMask, __ATOMIC_SEQ_CST);
-    do {
-        slot_id = __builtin_ffs(~cur_mask)-1;
-        if (slot_id < 0 || slot_id >= NUM_TLS_SLOTS) return -1;
-        new_mask = cur_mask | (UINT64_C(1) << slot_id);
-    } while (!__atomic_compare_exchange_n(&g_tlsUsageMask, &cur_mask, new_mask, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
-
-    threadTlsSet(slot_id, NULL);
-    mutexLock(&g_threadMutex);
-    for (Thread *t = g_threadList; t; t = t->next)
-        t->tls_array[slot_id] = NULL;
-    mutexUnlock(&g_threadMutex);
+    // Values are cleared by threadTlsFree, so a newly allocated slot is NULL in all threads.
+    for (u32 w = 0; w < TLS_MASK_WORDS; w ++) {
+        u64 cur_mask = __atomic_load_n(&g_tlsUsageMask[w], __ATOMIC_SEQ_CST);
+        while (cur_mask != UINT64_MAX) {
+            s32 slot_id = w*64 + __builtin_ctzll(~cur_mask);
+            u64 new_mask = cur_mask | (UINT64_C(1) << (slot_id % 64));
+            if (__atomic_compare_exchange_n(&g_tlsUsageMask[w], &cur_mask, new_mask, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                __atomic_store_n(&g_tlsDestructors[slot_id], destructor, __ATOMIC_RELEASE);
+                return slot_id;
+            }
+        }
+    }
 
-    g_tlsDestructors[slot_id] = destructor;
-    return slot_id;
+    return -1;
 }
 
-void* threadTlsGet(s32 slot_id) {
+void* threadTlsGetExtended(s32 slot_id) {
     void** tls_array = (void**)((u8*)armGetTls() + USER_TLS_BEGIN);
-    return tls_array[slot_id];
+    ThreadTlsExtArray* ext = (ThreadTlsExtArray*)tls_array[THREAD_TLS_NUM_INLINE];
+    u32 idx = slot_id - THREAD_TLS_NUM_INLINE;
+    return ext && idx < ext->capacity ? ext->values[idx] : NULL;
 }
 
-void threadTlsSet(s32 slot_id, void* value) {
+void threadTlsSetExtended(s32 slot_id, void* value) {
     void** tls_array = (void**)((u8*)armGetTls() + USER_TLS_BEGIN);
-    tls_array[slot_id] = value;
+    ThreadTlsExtArray* ext = (ThreadTlsExtArray*)tls_array[THREAD_TLS_NUM_INLINE];
+    u32 idx = slot_id - THREAD_TLS_NUM_INLINE;
+
+    if (!ext || idx >= ext->capacity) {
+        // Slots which were never set are NULL.
+        if (!value)
+            return;
+
+        u32 capacity = ext ? ext->capacity : 8;
+        while (capacity <= idx)
+            capacity *= 2;
+
+        ThreadTlsExtArray* new_ext = (ThreadTlsExtArray*)__libnx_alloc(sizeof(ThreadTlsExtArray) + capacity * sizeof(void*));
+        if (!new_ext)
+            diagAbortWithResult(MAKERESULT(Module_Libnx, LibnxError_OutOfMemory));
+
+        new_ext->capacity = capacity;
+        memset(new_ext->values, 0, capacity * sizeof(void*));
+
+        // threadTlsFree clears slots in the arrays of all threads under the thread mutex, so the values are copied
+        // under it as well, otherwise a slot cleared in the old array in the meantime would come back.
+        mutexLock(&g_threadMutex);
+        if (ext)
+            memcpy(new_ext->values, ext->values, ext->capacity * sizeof(void*));
+        tls_array[THREAD_TLS_NUM_INLINE] = new_ext;
+        mutexUnlock(&g_threadMutex);
+
+        __libnx_free(ext);
+        ext = new_ext;
+    }
+
+    ext->values[idx] = value;
 }
 
 void threadTlsFree(s32 slot_id) {
-    g_tlsDestructors[slot_id] = NULL;
+    __atomic_store_n(&g_tlsDestructors[slot_id], NULL, __ATOMIC_RELEASE);
+
+    // Clear the value of the slot in all threads, so that it is NULL when it gets allocated again.
+    mutexLock(&g_threadMutex);
+    for (Thread *t = g_threadList; t; t = t->next) {
+        if (slot_id < THREAD_TLS_NUM_INLINE)
+            t->tls_array[slot_id] = NULL;
+        else {
+            ThreadTlsExtArray* ext = (ThreadTlsExtArray*)t->tls_array[THREAD_TLS_NUM_INLINE];
+            u32 idx = slot_id - THREAD_TLS_NUM_INLINE;
+            if (ext && idx < ext->capacity)
+                ext->values[idx] = NULL;
+        }
+    }
+    mutexUnlock(&g_threadMutex);
 
-    u64 new_mask;
-    u64 cur_mask = __atomic_load_n(&g_tlsUsageMask, __ATOMIC_SEQ_CST);
-    do
-        new_mask = cur_mask &~ (UINT64_C(1) << slot_id);
-    while (!__atomic_compare_exchange_n(&g_tlsUsageMask, &cur_mask, new_mask, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    __atomic_fetch_and(&g_tlsUsageMask[slot_id / 64], ~(UINT64_C(1) << (slot_id % 64)), __ATOMIC_SEQ_CST);
 }
@@ -0,0 +1,345 @@
+#include "result.h"
+#include "arm/counter.h"
+#include "kernel/svc.h"
+#include "kernel/timerwheel.h"
+#include "wait.h"
+
+/*
+    Level l of the wheel has slots of TIMERWHEEL_SLOTS^l wheel ticks. A timer expiring delta ticks from now
+    is placed in the first level whose range covers delta. When the wheel reaches the start of a slot of a
+    higher level, the timers in that slot are cascaded down to the lower levels. Level 0 slots hold timers
+    expiring on a single tick.
+
+    The occupied bitmaps allow finding the next tick at which something happens without scanning slots,
+    so the wheel can jump over idle periods.
+*/
+
+#define SLOT_BITS 6
+#define SLOT_MASK (TIMERWHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(_l) ((_l) * SLOT_BITS)
+#define EXPIRED_LEVEL TIMERWHEEL_LEVELS
+
+_Static_assert(TIMERWHEEL_SLOTS == 1 << SLOT_BITS, "TIMERWHEEL_SLOTS must match SLOT_BITS");
+
+enum {
+    TimerState_Idle,
+    TimerState_Active,  // In a slot of the wheel.
+    TimerState_Expired, // In the expired list.
+    TimerState_Firing,  // Taken by timerwheelProcess, callback not run yet.
+};
+
+static bool _timerwheelBeginWait(Waitable* ww, WaiterNode* w, u64 cur_tick, u64* next_tick);
+static Result _timerwheelOnTimeout(Waitable* ww, u64 old_tick);
+static Result _timerwheelOnSignal(Waitable* ww);
+
+static const WaitableMethods g_timerwheelVt = {
+    .beginWait = _timerwheelBeginWait,
+    .onTimeout = _timerwheelOnTimeout,
+    .onSignal = _timerwheelOnSignal,
+};
+
+NX_INLINE u64 _rotr(u64 x, u32 r)
+{
+    return r ? (x >> r) | (x << (64 - r)) : x;
+}
+
+static TimerWheelTimer** _timerwheelGetList(TimerWheel* tw, TimerWheelTimer* t)
+{
+    return t->level == EXPIRED_LEVEL ? &tw->expired : &tw->slots[t->level][t->slot];
+}
+
+static void _timerwheelLink(TimerWheel* tw, TimerWheelTimer* t)
+{
+    TimerWheelTimer** head = _timerwheelGetList(tw, t);
+    t->prev = NULL;
+    t->next = *head;
+    if (*head)
+        (*head)->prev = t;
+    *head = t;
+
+    if (t->level != EXPIRED_LEVEL)
+        tw->occupied[t->level] |= 1UL << t->slot;
+}
+
+static void _timerwheelUnlink(TimerWheel* tw, TimerWheelTimer* t)
+{
+    TimerWheelTimer** head = _timerwheelGetList(tw, t);
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        *head = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+
+    if (t->level != EXPIRED_LEVEL && !*head)
+        tw->occupied[t->level] &= ~(1UL << t->slot);
+}
+
+static void _timerwheelInsert(TimerWheel* tw, TimerWheelTimer* t)
+{
+    u64 expires = t->expires > tw->current ? t->expires : tw->current;
+    u64 delta = expires - tw->current;
+
+    u32 level = 0;
+    while (level < TIMERWHEEL_LEVELS-1 && delta >= 1UL << LEVEL_SHIFT(level+1))
+        level ++;
+
+    // Timers beyond the range of the wheel are parked in the farthest slot, and moved again when cascaded.
+    const u64 max_delta = (1UL << LEVEL_SHIFT(TIMERWHEEL_LEVELS)) - 1;
+    if (delta > max_delta)
+        expires = tw->current + max_delta;
+
+    t->state = TimerState_Active;
+    t->level = level;
+    t->slot = (expires >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    _timerwheelLink(tw, t);
+}
+
+static u64 _timerwheelGetNextTick(TimerWheel* tw)
+{
+    const u64 cur = tw->current;
+    u64 best = UINT64_MAX;
+
+    // Level 0 slots hold timers expiring within the next TIMERWHEEL_SLOTS ticks, one tick per slot.
+    if (tw->occupied[0])
+        best = cur + __builtin_ctzll(_rotr(tw->occupied[0], cur & SLOT_MASK));
+
+    // Higher level slots are cascaded when the wheel reaches their start. The current slot is the farthest one,
+    // unless the wheel is exactly at its start, which then hasn't been processed yet.
+    for (u32 l = 1; l < TIMERWHEEL_LEVELS; l ++) {
+        if (!tw->occupied[l])
+            continue;
+
+        const u64 block = cur >> LEVEL_SHIFT(l);
+        const bool at_start = !(cur & ((1UL << LEVEL_SHIFT(l)) - 1));
+        const u32 off = at_start && (tw->occupied[l] & (1UL << (block & SLOT_MASK))) ? 0 :
+            __builtin_ctzll(_rotr(tw->occupied[l], (block + 1) & SLOT_MASK)) + 1;
+        const u64 tick = (block + off) << LEVEL_SHIFT(l);
+        if (tick < best)
+            best = tick;
+    }
+
+    return best;
+}
+
+static u64 _timerwheelGetTick(TimerWheel* tw, u64 system_tick)
+{
+    return (system_tick - tw->base_tick) / tw->resolution;
+}
+
+static void _timerwheelAdvance(TimerWheel* tw, u64 system_tick)
+{
+    const u64 target = _timerwheelGetTick(tw, system_tick);
+    if (target < tw->current)
+        return;
+
+    u64 tick;
+    while ((tick = _timerwheelGetNextTick(tw)) <= target) {
+        tw->current = tick;
+
+        // Cascade the slots starting at this tick, from the top level down.
+        for (u32 l = TIMERWHEEL_LEVELS-1; l >= 1; l --) {
+            if (tick & ((1UL << LEVEL_SHIFT(l)) - 1))
+                continue;
+
+            const u32 slot = (tick >> LEVEL_SHIFT(l)) & SLOT_MASK;
+            TimerWheelTimer* t = tw->slots[l][slot];
+            tw->slots[l][slot] = NULL;
+            tw->occupied[l] &= ~(1UL << slot);
+
+            while (t) {
+                TimerWheelTimer* next = t->next;
+                _timerwheelInsert(tw, t);
+                t = next;
+            }
+        }
+
+        // Move the timers expiring on this tick to the expired list.
+        const u32 slot = tick & SLOT_MASK;
+        TimerWheelTimer* t = tw->slots[0][slot];
+        tw->slots[0][slot] = NULL;
+        tw->occupied[0] &= ~(1UL << slot);
+
+        while (t) {
+            TimerWheelTimer* next = t->next;
+            t->state = TimerState_Expired;
+            t->level = EXPIRED_LEVEL;
+            _timerwheelLink(tw, t);
+            t = next;
+        }
+
+        tw->current = tick + 1;
+    }
+
+    // Nothing happens until the next tick, so we can skip straight to the target.
+    tw->current = target + 1;
+}
+
+void timerwheelCreate(TimerWheel* tw, u64 resolution_ns)
+{
+    _waitableInitialize(&tw->waitable, &g_timerwheelVt);
+
+    tw->base_tick = armGetSystemTick();
+    tw->resolution = armNsToTicks(resolution_ns);
+    if (!tw->resolution)
+        tw->resolution = 1;
+    tw->current = 0;
+    tw->armed = UINT64_MAX;
+    tw->expired = NULL;
+
+    for (u32 l = 0; l < TIMERWHEEL_LEVELS; l ++) {
+        tw->occupied[l] = 0;
+        for (u32 s = 0; s < TIMERWHEEL_SLOTS; s ++)
+            tw->slots[l][s] = NULL;
+    }
+}
+
+void timerwheelTimerInit(TimerWheelTimer* t, TimerWheelCallback callback, void* userdata)
+{
+    t->prev = NULL;
+    t->next = NULL;
+    t->fire_next = NULL;
+    t->expires = 0;
+    t->interval = 0;
+    t->callback = callback;
+    t->userdata = userdata;
+    t->state = TimerState_Idle;
+    t->level = 0;
+    t->slot = 0;
+}
+
+static void _timerwheelRemove(TimerWheel* tw, TimerWheelTimer* t)
+{
+    // Firing timers are on the local list of timerwheelProcess, which skips them once their state changes.
+    if (t->state == TimerState_Active || t->state == TimerState_Expired)
+        _timerwheelUnlink(tw, t);
+    t->state = TimerState_Idle;
+}
+
+void timerwheelStart(TimerWheel* tw, TimerWheelTimer* t, u64 timeout_ns, u64 interval_ns)
+{
+    mutexLock(&tw->waitable.mutex);
+
+    _timerwheelRemove(tw, t);
+
+    // Round up, so that timers never expire early.
+    const u64 deadline = armGetSystemTick() + armNsToTicks(timeout_ns) - tw->base_tick;
+    t->expires = (deadline + tw->resolution - 1) / tw->resolution;
+    t->interval = interval_ns ? (armNsToTicks(interval_ns) + tw->resolution - 1) / tw->resolution : 0;
+    if (interval_ns && !t->interval)
+        t->interval = 1;
+    _timerwheelInsert(tw, t);
+
+    // Make waiters recompute their timeout if this timer expires before the one they are waiting for.
+    if (t->expires < tw->armed)
+        _waitableSignalAllListeners(&tw->waitable);
+
+    mutexUnlock(&tw->waitable.mutex);
+}
+
+void timerwheelCancel(TimerWheel* tw, TimerWheelTimer* t)
+{
+    mutexLock(&tw->waitable.mutex);
+    _timerwheelRemove(tw, t);
+    mutexUnlock(&tw->waitable.mutex);
+}
+
+bool timerwheelTimerIsActive(TimerWheelTimer* t)
+{
+    return __atomic_load_n(&t->state, __ATOMIC_RELAXED) != TimerState_Idle;
+}
+
+u32 timerwheelProcess(TimerWheel* tw)
+{
+    mutexLock(&tw->waitable.mutex);
+
+    _timerwheelAdvance(tw, armGetSystemTick());
+
+    // Take over the expired timers, so that callbacks run without the lock held.
+    TimerWheelTimer* list = NULL;
+    TimerWheelTimer** tail = &list;
+    for (TimerWheelTimer* t = tw->expired; t; t = t->next) {
+        t->state = TimerState_Firing;
+        t->fire_next = NULL;
+        *tail = t;
+        tail = &t->fire_next;
+    }
+    tw->expired = NULL;
+
+    u32 count = 0;
+    while (list) {
+        TimerWheelTimer* t = list;
+        list = t->fire_next;
+
+        // Skip timers cancelled or restarted by a previous callback.
+        if (t->state != TimerState_Firing)
+            continue;
+
+        mutexUnlock(&tw->waitable.mutex);
+        t->callback(t, t->userdata);
+        count ++;
+        mutexLock(&tw->waitable.mutex);
+
+        if (t->state != TimerState_Firing)
+            continue;
+
+        if (t->interval) {
+            // Restart repeating timers, skipping the periods which were missed entirely.
+            const u64 now = _timerwheelGetTick(tw, armGetSystemTick());
+            t->expires += t->interval;
+            if (t->expires <= now)
+                t->expires += ((now - t->expires) / t->interval + 1) * t->interval;
+            _timerwheelInsert(tw, t);
+        } else
+            t->state = TimerState_Idle;
+    }
+
+    mutexUnlock(&tw->waitable.mutex);
+    return count;
+}
+
+bool _timerwheelBeginWait(Waitable* ww, WaiterNode* w, u64 cur_tick, u64* next_tick)
+{
+    TimerWheel* tw = (TimerWheel*)ww;
+    mutexLock(&tw->waitable.mutex);
+
+    _timerwheelAdvance(tw, cur_tick);
+
+    // If timers have expired, we're done.
+    bool do_wait = !tw->expired;
+    if (do_wait) {
+        tw->armed = _timerwheelGetNextTick(tw);
+        if (tw->armed != UINT64_MAX) {
+            const u64 due = tw->base_tick + tw->armed * tw->resolution;
+            *next_tick = due > cur_tick ? due - cur_tick : 0;
+        }
+        _waiterNodeAdd(w);
+    }
+
+    mutexUnlock(&tw->waitable.mutex);
+    return do_wait;
+}
+
+Result _timerwheelOnTimeout(Waitable* ww, u64 old_tick)
+{
+    TimerWheel* tw = (TimerWheel*)ww;
+    mutexLock(&tw->waitable.mutex);
+
+    // The wheel may have woken up only to cascade timers, in which case we need to retry the wait.
+    _timerwheelAdvance(tw, armGetSystemTick());
+    Result rc = tw->expired ? 0 : KERNELRESULT(Cancelled);
+    tw->armed = UINT64_MAX;
+
+    mutexUnlock(&tw->waitable.mutex);
+    return rc;
+}
+
+Result _timerwheelOnSignal(Waitable* ww)
+{
+    // A timer was started, so we need to retry the wait.
+    TimerWheel* tw = (TimerWheel*)ww;
+    mutexLock(&tw->waitable.mutex);
+    tw->armed = UINT64_MAX;
+    mutexUnlock(&tw->waitable.mutex);
+    return KERNELRESULT(Cancelled);
+}
@@ -0,0 +1,241 @@
+#include <string.h>
+#include "types.h"
+#include "result.h"
+#include "kernel/svc.h"
+#include "kernel/mutex.h"
+#include "kernel/tmem.h"
+#include "kernel/tmemcache.h"
+
+#define GIVEN_BACK_POLL_NS  100000ULL
+#define ACQUIRE_MAX_POLLS   10 // How long to wait for a service to give back a cached buffer before allocating a new one.
+
+typedef struct {
+    TransferMemory tmem; // The handle is only open while the entry is in use.
+    void* mem;           // Memory the object is created over, NULL for an unused slot.
+    bool owned;          // Whether the memory is owned by the cache, or provided by the caller.
+    u32 refcount;
+    u64 last_use;        // For evicting the least recently released entry first.
+} TmemCacheEntry;
+
+static Mutex g_tmemCacheMutex;
+static TmemCacheEntry g_tmemCache[TMEMCACHE_MAX_ENTRIES];
+static u64 g_tmemCacheTick;
+static size_t g_tmemCacheLimit;    // Maximum amount of unused memory kept by the cache.
+static size_t g_tmemCacheRetained; // Amount of unused memory currently kept by the cache.
+
+// Once the transfer memory handle is closed, the memory is only given back when the service has unmapped it as well.
+static bool _tmemcacheIsGivenBack(void* mem, size_t size)
+{
+    MemoryInfo m = {0};
+    u32 p = 0;
+    if (R_FAILED(svcQueryMemory(&m, &p, (uintptr_t)mem)))
+        return false;
+
+    return !(m.attr & MemAttr_IsBorrowed) && (m.perm & Perm_Rw) == Perm_Rw && m.addr + m.size >= (uintptr_t)mem + size;
+}
+
+static bool _tmemcacheWaitGivenBack(void* mem, size_t size, u32 max_polls)
+{
+    for (u32 i = 0; !_tmemcacheIsGivenBack(mem, size); i ++) {
+        if (i >= max_polls)
+            return false;
+        svcSleepThread(GIVEN_BACK_POLL_NS);
+    }
+    return true;
+}
+
+static void _tmemcacheEntryFree(TmemCacheEntry* e)
+{
+    if (e->owned)
+        g_tmemCacheRetained -= e->tmem.size;
+    tmemClose(&e->tmem); // The handle is already closed, this frees the memory.
+    memset(e, 0, sizeof(*e));
+}
+
+// Frees unused entries, least recently released first, until at most max_size bytes are kept. Optionally waits for their memory to be given back.
+static void _tmemcacheTrim(size_t max_size, bool wait)
+{
+    while (g_tmemCacheRetained > max_size) {
+        TmemCacheEntry* victim = NULL;
+        for (u32 i = 0; i < TMEMCACHE_MAX_ENTRIES; i ++) {
+            TmemCacheEntry* e = &g_tmemCache[i];
+            if (e->mem && !e->refcount && (!victim || e->last_use < victim->last_use) &&
+                (wait || _tmemcacheIsGivenBack(e->mem, e->tmem.size)))
+                victim = e;
+        }
+
+        if (!victim)
+            break;
+
+        _tmemcacheWaitGivenBack(victim->mem, victim->tmem.size, UINT32_MAX);
+        _tmemcacheEntryFree(victim);
+    }
+}
+
+// Gets a free slot, evicting the least recently released unused entry whose memory was given back if needed.
+static TmemCacheEntry* _tmemcacheGetSlot(void)
+{
+    TmemCacheEntry* victim = NULL;
+    for (u32 i = 0; i < TMEMCACHE_MAX_ENTRIES; i ++) {
+        TmemCacheEntry* e = &g_tmemCache[i];
+        if (!e->mem)
+            return e;
+        if (!e->refcount && (!victim || e->last_use < victim->last_use) && _tmemcacheIsGivenBack(e->mem, e->tmem.size))
+            victim = e;
+    }
+
+    if (victim)
+        _tmemcacheEntryFree(victim);
+    return victim;
+}
+
+// Finds unused cached memory of the given size which was given back by its previous user, waiting a bit for it if needed.
+static TmemCacheEntry* _tmemcacheFindOwned(size_t size)
+{
+    TmemCacheEntry* oldest = NULL;
+    for (u32 i = 0; i < TMEMCACHE_MAX_ENTRIES; i ++) {
+        TmemCacheEntry* e = &g_tmemCache[i];
+        if (!e->mem || !e->owned || e->refcount || e->tmem.size != size)
+            continue;
+        if (_tmemcacheIsGivenBack(e->mem, size))
+            return e;
+        if (!oldest || e->last_use < oldest->last_use)
+            oldest = e;
+    }
+
+    // The service which used it last may still be tearing down its session.
+    if (oldest && _tmemcacheWaitGivenBack(oldest->mem, size, ACQUIRE_MAX_POLLS))
+        return oldest;
+
+    return NULL;
+}
+
+static Result _tmemcacheCreate(TransferMemory* t, void* buf, size_t size, Permission perm)
+{
+    if (buf)
+        return tmemCreateFromMemory(t, buf, size, perm);
+
+    Result rc = tmemCreate(t, size, perm);
+    if (rc == MAKERESULT(Module_Libnx, LibnxError_OutOfMemory)) {
+        _tmemcacheTrim(0, false);
+        rc = tmemCreate(t, size, perm);
+    }
+    return rc;
+}
+
+Result tmemcacheAcquire(TransferMemory* t, void* buf, size_t size, Permission perm)
+{
+    Result rc = 0;
+    TmemCacheEntry* e = NULL;
+
+    mutexLock(&g_tmemCacheMutex);
+
+    if (buf) {
+        // Objects over caller buffers are shared by everyone passing the same buffer while in use.
+        for (u32 i = 0; i < TMEMCACHE_MAX_ENTRIES && !e; i ++) {
+            TmemCacheEntry* cur = &g_tmemCache[i];
+            if (cur->mem == buf && cur->refcount && cur->tmem.size == size && cur->tmem.perm == perm)
+                e = cur;
+        }
+    }
+    else if ((e = _tmemcacheFindOwned(size))) {
+        // Reuse the memory with a new object, the previous one can still be around in the service.
+        // The memory is cleared again, as tmemCreate would.
+        Handle handle = INVALID_HANDLE;
+        memset(e->mem, 0, size);
+        rc = svcCreateTransferMemory(&handle, e->mem, size, perm);
+        if (R_SUCCEEDED(rc)) {
+            e->tmem.handle = handle;
+            e->tmem.perm = perm;
+            g_tmemCacheRetained -= size;
+        }
+        else
+            e = NULL;
+    }
+
+    if (!e) {
+        TransferMemory tmem;
+        rc = _tmemcacheCreate(&tmem, buf, size, perm);
+        if (R_SUCCEEDED(rc)) {
+            e = _tmemcacheGetSlot();
+            if (e) {
+                e->tmem = tmem;
+                e->mem = buf ? buf : tmem.src_addr;
+                e->owned = !buf;
+                e->refcount = 0;
+            }
+            else // Cache full of objects in use: hand out an uncached object, closed on release.
+                *t = tmem;
+        }
+    }
+
+    if (e) {
+        e->refcount ++;
+        *t = e->tmem;
+    }
+
+    mutexUnlock(&g_tmemCacheMutex);
+
+    return rc;
+}
+
+void tmemcacheRelease(TransferMemory* t)
+{
+    if (t->handle == INVALID_HANDLE)
+        return;
+
+    TransferMemory evicted = { .handle = INVALID_HANDLE };
+
+    mutexLock(&g_tmemCacheMutex);
+
+    TmemCacheEntry* e = NULL;
+    for (u32 i = 0; i < TMEMCACHE_MAX_ENTRIES; i ++) {
+        if (g_tmemCache[i].refcount && g_tmemCache[i].tmem.handle == t->handle) {
+            e = &g_tmemCache[i];
+            break;
+        }
+    }
+
+    if (e) {
+        if (!--e->refcount) {
+            // Closing the handle lets the kernel give the memory back once the service has unmapped it.
+            tmemCloseHandle(&e->tmem);
+            if (e->owned && g_tmemCacheRetained + e->tmem.size <= g_tmemCacheLimit) {
+                e->last_use = ++g_tmemCacheTick;
+                g_tmemCacheRetained += e->tmem.size;
+            }
+            else {
+                // Over the limit: the memory is freed right away, as tmemClose would.
+                if (e->owned)
+                    evicted = e->tmem;
+                memset(e, 0, sizeof(*e));
+            }
+        }
+    }
+    else
+        tmemClose(t);
+
+    mutexUnlock(&g_tmemCacheMutex);
+
+    if (evicted.src_addr)
+        tmemClose(&evicted);
+
+    t->handle = INVALID_HANDLE;
+    t->src_addr = NULL;
+    t->map_addr = NULL;
+}
+
+void tmemcacheSetLimit(size_t max_size)
+{
+    mutexLock(&g_tmemCacheMutex);
+    g_tmemCacheLimit = max_size;
+    _tmemcacheTrim(max_size, true);
+    mutexUnlock(&g_tmemCacheMutex);
+}
+
+void tmemcacheFlush(void)
+{
+    mutexLock(&g_tmemCacheMutex);
+    _tmemcacheTrim(0, true);
+    mutexUnlock(&g_tmemCacheMutex);
+}
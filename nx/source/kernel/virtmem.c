@@ -1,3 +1,4 @@
+#include <string.h>
 #include "types.h"
 #include "result.h"
 #include "kernel/mutex.h"
@@ -8,7 +9,8 @@
 #include "../runtime/alloc.h"
 
 #define SEQUENTIAL_GUARD_REGION_SIZE 0x1000
-#define RANDOM_MAX_ATTEMPTS 0x200
+#define RANDOM_MAX_ATTEMPTS 8
+#define MEMMAP_MAX_PENDING_SLICES 32
 
 typedef struct {
     uintptr_t start;
@@ -16,11 +18,16 @@ typedef struct {
 } MemRegion;
 
 struct VirtmemReservation {
-    VirtmemReservation *next;
-    VirtmemReservation *prev;
     MemRegion region;
 };
 
+// Sorted array of regions, grown on demand.
+typedef struct {
+    MemRegion* items;
+    size_t count;
+    size_t capacity;
+} MemRegionList;
+
 static Mutex g_VirtmemMutex;
 
 static MemRegion g_AliasRegion;
@@ -28,7 +35,16 @@ static MemRegion g_HeapRegion;
 static MemRegion g_AslrRegion;
 static MemRegion g_StackRegion;
 
-static VirtmemReservation *g_Reservations;
+// Reservations, sorted by start address.
+static VirtmemReservation **g_Reservations;
+static size_t g_NumReservations;
+static size_t g_ReservationsCapacity;
+
+// Cached snapshot of the mapped memory blocks, sorted by address. It can be stale: addresses picked from it are
+// confirmed with svcQueryMemory, and the snapshot is refreshed when they turn out to be mapped.
+static MemRegionList g_MemMap;
+static bool g_MemMapValid;
+static u32 g_MemMapNumPending; // Slices handed out since the last refresh, see _memregionFindRandom.
 
 static bool g_IsLegacyKernel;
 
@@ -62,10 +78,6 @@ NX_INLINE bool _memregionIsInside(MemRegion* r, uintptr_t start, uintptr_t end)
     return start >= r->start && end <= r->end;
 }
 
-NX_INLINE bool _memregionOverlaps(MemRegion* r, uintptr_t start, uintptr_t end) {
-    return start < r->end && r->start < end;
-}
-
 NX_INLINE bool _memregionIsMapped(uintptr_t start, uintptr_t end, uintptr_t guard, uintptr_t* out_end) {
     // Adjust start/end by the desired guard size.
     start -= guard;
@@ -88,20 +100,149 @@ NX_INLINE bool _memregionIsMapped(uintptr_t start, uintptr_t end, uintptr_t guar
     return false;
 }
 
-NX_INLINE bool _memregionIsReserved(uintptr_t start, uintptr_t end, uintptr_t guard, uintptr_t* out_end) {
-    // Adjust start/end by the desired guard size.
-    start -= guard;
-    end += guard;
+static bool _memregionListGrow(void** items, size_t* capacity, size_t item_size) {
+    size_t new_capacity = *capacity ? *capacity * 2 : 64;
+    void* new_items = __libnx_alloc(new_capacity * item_size);
+    if (!new_items)
+        return false;
+
+    if (*items) {
+        memcpy(new_items, *items, *capacity * item_size);
+        __libnx_free(*items);
+    }
+
+    *items = new_items;
+    *capacity = new_capacity;
+    return true;
+}
+
+static bool _memregionListInsert(MemRegionList* l, uintptr_t start, uintptr_t end) {
+    if (l->count == l->capacity && !_memregionListGrow((void**)&l->items, &l->capacity, sizeof(MemRegion)))
+        return false;
+
+    size_t i = l->count;
+    while (i && l->items[i-1].start > start) {
+        l->items[i] = l->items[i-1];
+        i --;
+    }
+
+    l->items[i].start = start;
+    l->items[i].end   = end;
+    l->count ++;
+    return true;
+}
+
+static void _memmapRefresh(void) {
+    uintptr_t lo = g_AslrRegion.start < g_StackRegion.start ? g_AslrRegion.start : g_StackRegion.start;
+    uintptr_t hi = g_AslrRegion.end > g_StackRegion.end ? g_AslrRegion.end : g_StackRegion.end;
 
-    // Go through each reservation and check if any of them overlap the desired address range.
-    for (VirtmemReservation *rv = g_Reservations; rv; rv = rv->next) {
-        if (_memregionOverlaps(&rv->region, start, end)) {
-            if (out_end) *out_end = rv->region.end + guard;
-            return true;
+    g_MemMap.count = 0;
+    g_MemMapValid = true;
+    g_MemMapNumPending = 0;
+
+    for (uintptr_t addr = lo; addr < hi;) {
+        MemoryInfo meminfo;
+        u32 pageinfo;
+        Result rc = svcQueryMemory(&meminfo, &pageinfo, addr);
+        if (R_FAILED(rc))
+            diagAbortWithResult(MAKERESULT(Module_Libnx, LibnxError_BadQueryMemory));
+
+        uintptr_t memend = meminfo.addr + meminfo.size;
+        if (meminfo.type != MemType_Unmapped) {
+            // Merge contiguous mapped blocks.
+            MemRegion* last = g_MemMap.count ? &g_MemMap.items[g_MemMap.count-1] : NULL;
+            if (last && last->end == meminfo.addr)
+                last->end = memend;
+            else if (!_memregionListInsert(&g_MemMap, meminfo.addr, memend)) {
+                // Out of memory: leave the snapshot incomplete, addresses are confirmed anyway.
+                g_MemMapValid = false;
+                break;
+            }
         }
+
+        if (memend <= addr)
+            break;
+        addr = memend;
     }
+}
 
-    return false;
+// Iterates over the busy intervals (mapped memory, reservations, alias and heap regions) in start order.
+typedef struct {
+    size_t map_idx;
+    size_t rv_idx;
+    u32 fixed_idx;
+    MemRegion fixed[2];
+} BusyCursor;
+
+static void _busycursorInit(BusyCursor* c) {
+    c->map_idx = 0;
+    c->rv_idx = 0;
+    c->fixed_idx = 0;
+
+    // Avoid mapping within the alias and heap regions (without guard, those don't contain our mappings).
+    bool alias_first = g_AliasRegion.start <= g_HeapRegion.start;
+    c->fixed[0] = alias_first ? g_AliasRegion : g_HeapRegion;
+    c->fixed[1] = alias_first ? g_HeapRegion : g_AliasRegion;
+}
+
+static bool _busycursorNext(BusyCursor* c, uintptr_t guard, MemRegion* out) {
+    const MemRegion* map = c->map_idx < g_MemMap.count ? &g_MemMap.items[c->map_idx] : NULL;
+    const MemRegion* rv = c->rv_idx < g_NumReservations ? &g_Reservations[c->rv_idx]->region : NULL;
+    const MemRegion* fixed = c->fixed_idx < 2 ? &c->fixed[c->fixed_idx] : NULL;
+
+    const MemRegion* best = map;
+    if (rv && (!best || rv->start < best->start))
+        best = rv;
+    if (fixed && (!best || fixed->start < best->start))
+        best = fixed;
+    if (!best)
+        return false;
+
+    if (best == map)
+        c->map_idx ++;
+    else if (best == rv)
+        c->rv_idx ++;
+    else
+        c->fixed_idx ++;
+
+    if (best == fixed)
+        guard = 0;
+
+    uintptr_t start = best->start &~ 0xFFF;
+    uintptr_t end = (best->end + 0xFFF) &~ 0xFFF;
+    out->start = start > guard ? start - guard : 0;
+    out->end = end + guard;
+    return true;
+}
+
+// Counts the page-aligned addresses of the region where a slice of the given size fits, or returns the target-th one.
+static uintptr_t _memregionWalkGaps(MemRegion* r, size_t size, size_t guard_size, u64 target, u64* out_count) {
+    BusyCursor c;
+    _busycursorInit(&c);
+
+    uintptr_t pos = r->start;
+    u64 count = 0;
+    MemRegion busy;
+
+    while (pos < r->end) {
+        bool more = _busycursorNext(&c, guard_size, &busy);
+        uintptr_t gap_end = more && busy.start < r->end ? busy.start : r->end;
+
+        if (gap_end > pos && gap_end - pos >= size) {
+            u64 num = ((gap_end - pos - size) >> 12) + 1;
+            if (target < count + num)
+                return pos + ((target - count) << 12);
+            count += num;
+        }
+
+        if (!more)
+            break;
+        if (busy.end > pos)
+            pos = busy.end;
+    }
+
+    if (out_count) *out_count = count;
+    return 0;
 }
 
 static void* _memregionFindRandom(MemRegion* r, size_t size, size_t guard_size) {
@@ -114,34 +255,41 @@ static void* _memregionFindRandom(MemRegion* r, size_t size, size_t guard_size)
     if (size > region_size)
         return NULL;
 
-    // Main allocation loop.
-    uintptr_t aslr_max_page_offset = (region_size - size) >> 12;
-    for (unsigned i = 0; i < RANDOM_MAX_ATTEMPTS; i ++) {
-        // Calculate a random memory range outside reserved areas.
-        uintptr_t cur_addr;
-        for (;;) {
-            uintptr_t page_offset = __libnx_virtmem_rng() % (aslr_max_page_offset + 1);
-            cur_addr = (uintptr_t)r->start + (page_offset << 12);
-
-            // Avoid mapping within the alias region.
-            if (_memregionOverlaps(&g_AliasRegion, cur_addr, cur_addr + size))
-                continue;
-
-            // Avoid mapping within the heap region.
-            if (_memregionOverlaps(&g_HeapRegion, cur_addr, cur_addr + size))
-                continue;
+    // Slices handed out earlier are recorded in the snapshot, but may have been unmapped since (or never mapped).
+    // Refresh it every so often, so that it doesn't keep growing with them.
+    bool refreshed = false;
+    if (!g_MemMapValid || g_MemMapNumPending >= MEMMAP_MAX_PENDING_SLICES) {
+        _memmapRefresh();
+        refreshed = true;
+    }
 
-            // Found it.
-            break;
+    for (unsigned i = 0; i < RANDOM_MAX_ATTEMPTS; i ++) {
+        // Pick a random address among all the free slices of the region.
+        u64 count = 0;
+        _memregionWalkGaps(r, size, guard_size, UINT64_MAX, &count);
+
+        if (count == 0) {
+            // The snapshot may still list memory which has since been unmapped.
+            if (refreshed)
+                return NULL;
+            _memmapRefresh();
+            refreshed = true;
+            continue;
         }
 
-        // Check that there isn't anything mapped at the desired memory range.
-        if (_memregionIsMapped(cur_addr, cur_addr + size, guard_size, NULL))
-            continue;
+        uintptr_t cur_addr = _memregionWalkGaps(r, size, guard_size, __libnx_virtmem_rng() % count, NULL);
 
-        // Check that the desired memory range doesn't overlap any reservations.
-        if (_memregionIsReserved(cur_addr, cur_addr + size, guard_size, NULL))
+        // Confirm that there isn't anything mapped at the desired memory range, in case the snapshot is stale.
+        if (_memregionIsMapped(cur_addr, cur_addr + size, guard_size, NULL)) {
+            _memmapRefresh();
+            refreshed = true;
             continue;
+        }
+
+        // The caller is about to map this range, so consider it busy until the next refresh.
+        if (!_memregionListInsert(&g_MemMap, cur_addr, cur_addr + size))
+            g_MemMapValid = false;
+        g_MemMapNumPending ++;
 
         // We found a suitable address!
         return (void*)cur_addr;
@@ -231,26 +379,52 @@ void* virtmemFindCodeMemory(size_t size, size_t guard_size) {
 
 VirtmemReservation* virtmemAddReservation(void* mem, size_t size) {
     if (!mutexIsLockedByCurrentThread(&g_VirtmemMutex)) return NULL;
+    if (g_NumReservations == g_ReservationsCapacity &&
+        !_memregionListGrow((void**)&g_Reservations, &g_ReservationsCapacity, sizeof(VirtmemReservation*)))
+        return NULL;
+
     VirtmemReservation* rv = (VirtmemReservation*)__libnx_alloc(sizeof(VirtmemReservation));
     if (rv) {
         rv->region.start = (uintptr_t)mem;
         rv->region.end   = rv->region.start + size;
-        rv->next         = g_Reservations;
-        rv->prev         = NULL;
-        g_Reservations   = rv;
-        if (rv->next)
-            rv->next->prev = rv;
+
+        // Binary search for the insertion point.
+        size_t lo = 0, hi = g_NumReservations;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (g_Reservations[mid]->region.start <= rv->region.start)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        memmove(&g_Reservations[lo+1], &g_Reservations[lo], (g_NumReservations - lo) * sizeof(VirtmemReservation*));
+        g_Reservations[lo] = rv;
+        g_NumReservations ++;
     }
     return rv;
 }
 
 void virtmemRemoveReservation(VirtmemReservation* rv) {
     if (!mutexIsLockedByCurrentThread(&g_VirtmemMutex)) return;
-    if (rv->next)
-        rv->next->prev = rv->prev;
-    if (rv->prev)
-        rv->prev->next = rv->next;
-    else
-        g_Reservations = rv->next;
+
+    // Binary search for the first reservation with the same start, then look for this one.
+    size_t lo = 0, hi = g_NumReservations;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (g_Reservations[mid]->region.start < rv->region.start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (size_t i = lo; i < g_NumReservations; i ++) {
+        if (g_Reservations[i] == rv) {
+            memmove(&g_Reservations[i], &g_Reservations[i+1], (g_NumReservations - i - 1) * sizeof(VirtmemReservation*));
+            g_NumReservations --;
+            break;
+        }
+    }
+
     __libnx_free(rv);
 }
@@ -1,15 +1,64 @@
 #include "alloc.h"
+#include "slab.h"
+#include "runtime/memprof.h"
 #include <stdlib.h>
 
-void* __attribute__((weak)) __libnx_alloc(size_t size) {
+/*
+  By default, libnx allocations go through newlib's malloc. A program can select
+  the slab allocator instead by defining the flag symbol:
+
+    u32 __nx_alloc_slab = 1;
+
+  Small allocations are then served from per-thread caches of size-class slabs,
+  without taking newlib's global malloc lock. Larger allocations still use malloc.
+
+  Allocations are recorded by the memory profiler while it is enabled, see
+  memprofSetEnabled.
+
+  A program can also override the weak __libnx_alloc/__libnx_aligned_alloc/__libnx_free
+  functions altogether.
+ */
+
+__attribute__((weak)) u32 __nx_alloc_slab = 0;
+
+static inline void* _libnxAlloc(size_t size) {
+    if (__nx_alloc_slab && size <= SLAB_MAX_SIZE) {
+        void* p = slabAlloc(size);
+        if (p) return p;
+    }
     return malloc(size);
 }
 
-void* __attribute__((weak)) __libnx_aligned_alloc(size_t alignment, size_t size) {
+static inline void* _libnxAlignedAlloc(size_t alignment, size_t size) {
     size = (size + alignment - 1) &~ (alignment - 1);
+    // Slab objects are only guaranteed to be 16-byte aligned.
+    if (__nx_alloc_slab && alignment <= 16 && size <= SLAB_MAX_SIZE) {
+        void* p = slabAlloc(size);
+        if (p) return p;
+    }
     return aligned_alloc(alignment, size);
 }
 
+void* __attribute__((weak)) __libnx_alloc(size_t size) {
+    void* p = _libnxAlloc(size);
+    if (memprofIsEnabled())
+        memprofRecordAlloc(p, size, __builtin_return_address(0));
+    return p;
+}
+
+void* __attribute__((weak)) __libnx_aligned_alloc(size_t alignment, size_t size) {
+    void* p = _libnxAlignedAlloc(alignment, size);
+    if (memprofIsEnabled())
+        memprofRecordAlloc(p, size, __builtin_return_address(0));
+    return p;
+}
+
 void __attribute__((weak)) __libnx_free(void* p) {
+    if (memprofIsEnabled())
+        memprofRecordFree(p);
+    if (__nx_alloc_slab && slabOwns(p)) {
+        slabFree(p);
+        return;
+    }
     free(p);
 }
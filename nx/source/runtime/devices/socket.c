@@ -134,6 +134,8 @@ Result socketInitialize(const SocketInitConfig *config) {
         return MAKERESULT(Module_Libnx, LibnxError_AlreadyInitialized);
 
     ret = bsdInitialize(&bcfg, num_bsd_sessions, bsd_service_type);
+    if(R_SUCCEEDED(ret) && config->max_bsd_sessions > num_bsd_sessions)
+        ret = bsdSetSessionAutoScale(config->max_bsd_sessions);
     if(R_SUCCEEDED(ret))
         dev = AddDevice(&g_socketDevoptab);
     else {
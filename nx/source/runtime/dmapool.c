@@ -0,0 +1,169 @@
+#include <string.h>
+#include "result.h"
+#include "kernel/tmem.h"
+#include "nvidia/map.h"
+#include "runtime/dmapool.h"
+#include "alloc.h"
+
+#define PAGE_FREE 0x80
+#define PAGE_NONE 0xFF // Page inside a block, not the first one.
+#define LIST_END  UINT32_MAX
+
+static void _dmapoolPush(DmaPool* p, u32 page, u32 order)
+{
+    p->page_order[page] = order | PAGE_FREE;
+    p->prev[page] = LIST_END;
+    p->next[page] = p->free_heads[order];
+    if (p->next[page] != LIST_END)
+        p->prev[p->next[page]] = page;
+    p->free_heads[order] = page;
+}
+
+static void _dmapoolUnlink(DmaPool* p, u32 page, u32 order)
+{
+    if (p->prev[page] != LIST_END)
+        p->next[p->prev[page]] = p->next[page];
+    else
+        p->free_heads[order] = p->next[page];
+    if (p->next[page] != LIST_END)
+        p->prev[p->next[page]] = p->prev[page];
+    p->page_order[page] = PAGE_NONE;
+}
+
+Result dmapoolCreate(DmaPool* p, size_t size, u32 flags, Permission tmem_perm)
+{
+    Result rc = 0;
+
+    memset(p, 0, sizeof(*p));
+    mutexInit(&p->mutex);
+
+    size = (size + DMAPOOL_PAGE_SIZE - 1) &~ (DMAPOOL_PAGE_SIZE - 1);
+    if (!size || size / DMAPOOL_PAGE_SIZE >= LIST_END)
+        return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+
+    p->size = size;
+    p->num_pages = size / DMAPOOL_PAGE_SIZE;
+    p->flags = flags;
+
+    // Bookkeeping, kept outside of the pool memory.
+    p->page_order = (u8*)__libnx_alloc(p->num_pages * (sizeof(u8) + 2*sizeof(u32)));
+    p->addr = __libnx_aligned_alloc(DMAPOOL_PAGE_SIZE, size);
+    if (!p->page_order || !p->addr)
+        rc = MAKERESULT(Module_Libnx, LibnxError_OutOfMemory);
+
+    if (R_SUCCEEDED(rc) && (flags & DmaPoolFlags_NvMap))
+        rc = nvMapCreate(&p->nvmap, p->addr, size, DMAPOOL_PAGE_SIZE, NvKind_Pitch, true);
+
+    if (R_SUCCEEDED(rc) && (flags & DmaPoolFlags_TransferMemory)) {
+        rc = tmemCreateFromMemory(&p->tmem, p->addr, size, tmem_perm);
+        if (R_FAILED(rc) && (flags & DmaPoolFlags_NvMap))
+            nvMapClose(&p->nvmap);
+    }
+
+    if (R_FAILED(rc)) {
+        __libnx_free(p->page_order);
+        __libnx_free(p->addr);
+        p->page_order = NULL;
+        p->addr = NULL;
+        return rc;
+    }
+
+    p->next = (u32*)(p->page_order + p->num_pages);
+    p->prev = p->next + p->num_pages;
+    memset(p->page_order, PAGE_NONE, p->num_pages);
+    for (u32 i = 0; i < DMAPOOL_NUM_ORDERS; i ++)
+        p->free_heads[i] = LIST_END;
+
+    // Seed the free lists with the largest blocks aligned to their size.
+    for (u32 page = 0; page < p->num_pages;) {
+        u32 order = DMAPOOL_NUM_ORDERS - 1;
+        while ((page & ((1U << order) - 1)) || page + (1U << order) > p->num_pages)
+            order --;
+        _dmapoolPush(p, page, order);
+        page += 1U << order;
+    }
+
+    p->free_size = size;
+    return 0;
+}
+
+void dmapoolClose(DmaPool* p)
+{
+    if (!p->addr)
+        return;
+
+    // The memory is only given back to the process once the transfer memory handle is closed.
+    if (p->flags & DmaPoolFlags_TransferMemory)
+        tmemClose(&p->tmem);
+    if (p->flags & DmaPoolFlags_NvMap)
+        nvMapClose(&p->nvmap);
+
+    __libnx_free(p->addr);
+    __libnx_free(p->page_order);
+    p->addr = NULL;
+    p->page_order = NULL;
+}
+
+void* dmapoolAlloc(DmaPool* p, size_t size)
+{
+    const size_t pages = size ? (size + DMAPOOL_PAGE_SIZE - 1) / DMAPOOL_PAGE_SIZE : 1;
+    u32 order = 0;
+    while ((1UL << order) < pages)
+        order ++;
+    if (order >= DMAPOOL_NUM_ORDERS)
+        return NULL;
+
+    mutexLock(&p->mutex);
+
+    u32 cur = order;
+    while (cur < DMAPOOL_NUM_ORDERS && p->free_heads[cur] == LIST_END)
+        cur ++;
+
+    void* buf = NULL;
+    if (cur < DMAPOOL_NUM_ORDERS) {
+        const u32 page = p->free_heads[cur];
+        _dmapoolUnlink(p, page, cur);
+
+        // Split the block, giving back the upper halves.
+        while (cur > order) {
+            cur --;
+            _dmapoolPush(p, page + (1U << cur), cur);
+        }
+
+        p->page_order[page] = order;
+        p->free_size -= (size_t)DMAPOOL_PAGE_SIZE << order;
+        buf = (u8*)p->addr + (size_t)page * DMAPOOL_PAGE_SIZE;
+    }
+
+    mutexUnlock(&p->mutex);
+    return buf;
+}
+
+void dmapoolFree(DmaPool* p, void* buf)
+{
+    if (!buf)
+        return;
+
+    u32 page = dmapoolGetOffset(p, buf) / DMAPOOL_PAGE_SIZE;
+
+    mutexLock(&p->mutex);
+
+    u32 order = p->page_order[page];
+    p->page_order[page] = PAGE_NONE;
+    p->free_size += (size_t)DMAPOOL_PAGE_SIZE << order;
+
+    // Merge with the buddy as long as it is free and whole.
+    while (order < DMAPOOL_NUM_ORDERS - 1) {
+        const u32 buddy = page ^ (1U << order);
+        if (buddy >= p->num_pages || p->page_order[buddy] != (order | PAGE_FREE))
+            break;
+
+        _dmapoolUnlink(p, buddy, order);
+        page &= ~(1U << order);
+        order ++;
+    }
+
+    _dmapoolPush(p, page, order);
+
+    mutexUnlock(&p->mutex);
+}
@@ -0,0 +1,547 @@
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "result.h"
+#include "kernel/svc.h"
+#include "kernel/condvar.h"
+#include "services/bsd.h"
+#include "runtime/eventloop.h"
+#include "../internal.h"
+
+enum {
+    SourceState_Idle,
+    SourceState_Armed,       // Waited on by its shard.
+    SourceState_Ready,       // Signaled, in the list of sources pending dispatch.
+    SourceState_Dispatching, // Callback running.
+};
+
+static void _eventloopShardInit(EventLoopShard* shard, EventLoop* loop, bool is_socket)
+{
+    memset(shard, 0, sizeof(*shard));
+    shard->loop = loop;
+    shard->is_socket = is_socket;
+    ueventCreate(&shard->control, true);
+}
+
+static void _eventloopShardLink(EventLoopShard* shard, EventLoopSource* src)
+{
+    src->prev = NULL;
+    src->next = shard->sources;
+    if (shard->sources)
+        shard->sources->prev = src;
+    shard->sources = src;
+    shard->num_sources ++;
+}
+
+static void _eventloopShardUnlink(EventLoopShard* shard, EventLoopSource* src)
+{
+    if (src->prev)
+        src->prev->next = src->next;
+    else
+        shard->sources = src->next;
+    if (src->next)
+        src->next->prev = src->prev;
+    shard->num_sources --;
+}
+
+static void _eventloopReadyLink(EventLoop* loop, EventLoopSource* src)
+{
+    src->ready_prev = loop->ready_tail;
+    src->ready_next = NULL;
+    if (loop->ready_tail)
+        loop->ready_tail->ready_next = src;
+    else
+        loop->ready_head = src;
+    loop->ready_tail = src;
+    loop->num_ready ++;
+}
+
+static void _eventloopReadyUnlink(EventLoop* loop, EventLoopSource* src)
+{
+    if (src->ready_prev)
+        src->ready_prev->ready_next = src->ready_next;
+    else
+        loop->ready_head = src->ready_next;
+    if (src->ready_next)
+        src->ready_next->ready_prev = src->ready_prev;
+    else
+        loop->ready_tail = src->ready_prev;
+    loop->num_ready --;
+}
+
+static void _eventloopWakeSockets(EventLoop* loop)
+{
+    if (loop->wake_fd >= 0)
+        bsdSend(loop->wake_fd, "", 1, 0);
+}
+
+// Makes the thread of a shard rebuild its wait set. Must be called with the loop mutex held.
+static void _eventloopWakeShard(EventLoop* loop, EventLoopShard* shard)
+{
+    if (!shard->waiting)
+        return;
+
+    if (shard == &loop->main)
+        ueventSignal(&loop->wakeup);
+    else if (shard->is_socket)
+        _eventloopWakeSockets(loop);
+    else
+        ueventSignal(&shard->control);
+}
+
+static void _eventloopSourceSignaled(EventLoop* loop, EventLoopShard* shard, EventLoopSource* src)
+{
+    // The source may have been removed while the shard was waiting; the remover waits for us before returning.
+    if (src->shard != shard || src->state != SourceState_Armed)
+        return;
+
+    src->state = SourceState_Ready;
+    _eventloopReadyLink(loop, src);
+    if (shard != &loop->main)
+        ueventSignal(&loop->wakeup);
+}
+
+// Must be called with the loop mutex held.
+static void _eventloopEndWait(EventLoopShard* shard)
+{
+    shard->waiting = false;
+    shard->seq ++;
+    condvarWakeAll(&shard->loop->seq_condvar);
+}
+
+static s32 _eventloopBuildWaitSet(EventLoopShard* shard, Waiter control, Waiter* objects, EventLoopSource** srcs)
+{
+    s32 num = 0;
+    objects[num] = control;
+    srcs[num++] = NULL;
+
+    for (EventLoopSource* src = shard->sources; src; src = src->next) {
+        if (src->state != SourceState_Armed)
+            continue;
+        objects[num] = src->waiter;
+        srcs[num++] = src;
+    }
+
+    return num;
+}
+
+static void _eventloopShardThread(void* arg)
+{
+    EventLoopShard* shard = (EventLoopShard*)arg;
+    EventLoop* loop = shard->loop;
+    Waiter objects[MAX_WAIT_OBJECTS];
+    EventLoopSource* srcs[MAX_WAIT_OBJECTS];
+
+    mutexLock(&loop->mutex);
+    while (!loop->exiting) {
+        s32 num = _eventloopBuildWaitSet(shard, waiterForUEvent(&shard->control), objects, srcs);
+        shard->waiting = true;
+        mutexUnlock(&loop->mutex);
+
+        s32 idx = -1;
+        Result rc = waitObjects(&idx, objects, num, UINT64_MAX);
+
+        mutexLock(&loop->mutex);
+        if (R_SUCCEEDED(rc) && idx > 0)
+            _eventloopSourceSignaled(loop, shard, srcs[idx]);
+        _eventloopEndWait(shard);
+    }
+    mutexUnlock(&loop->mutex);
+}
+
+static void _eventloopSocketThread(void* arg)
+{
+    EventLoopShard* shard = (EventLoopShard*)arg;
+    EventLoop* loop = shard->loop;
+    const int wake_fd = loop->wake_fd;
+    struct pollfd* fds = NULL;
+    EventLoopSource** srcs = NULL;
+    u32 capacity = 0;
+
+    mutexLock(&loop->mutex);
+    while (!loop->exiting) {
+        const u32 needed = shard->num_sources + 1;
+        if (needed > capacity) {
+            u32 new_capacity = needed * 2;
+            struct pollfd* new_fds = (struct pollfd*)realloc(fds, new_capacity * sizeof(struct pollfd));
+            if (new_fds)
+                fds = new_fds;
+            EventLoopSource** new_srcs = (EventLoopSource**)realloc(srcs, new_capacity * sizeof(EventLoopSource*));
+            if (new_srcs)
+                srcs = new_srcs;
+
+            if (new_fds && new_srcs)
+                capacity = new_capacity;
+            else {
+                // Retry later, keeping the sources armed.
+                mutexUnlock(&loop->mutex);
+                svcSleepThread(EVENTLOOP_SOCKET_POLL_INTERVAL_MS * 1000000ULL);
+                mutexLock(&loop->mutex);
+                continue;
+            }
+        }
+
+        nfds_t num = 0;
+        if (wake_fd >= 0) {
+            fds[num].fd = wake_fd;
+            fds[num].events = POLLIN;
+            fds[num].revents = 0;
+            srcs[num++] = NULL;
+        }
+
+        for (EventLoopSource* src = shard->sources; src; src = src->next) {
+            if (src->state != SourceState_Armed)
+                continue;
+            fds[num].fd = src->fd;
+            fds[num].events = src->events;
+            fds[num].revents = 0;
+            srcs[num++] = src;
+        }
+
+        shard->waiting = true;
+        mutexUnlock(&loop->mutex);
+
+        // Without a wake socket, changes to the set of sources are picked up on the next timeout.
+        int ret = bsdPoll(fds, num, wake_fd >= 0 ? -1 : EVENTLOOP_SOCKET_POLL_INTERVAL_MS);
+        if (ret < 0)
+            svcSleepThread(EVENTLOOP_SOCKET_POLL_INTERVAL_MS * 1000000ULL);
+        else if (wake_fd >= 0 && fds[0].revents) {
+            char buf[16];
+            while (bsdRecv(wake_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+        }
+
+        mutexLock(&loop->mutex);
+        for (nfds_t i = 0; ret > 0 && i < num; i ++) {
+            EventLoopSource* src = srcs[i];
+            if (src && fds[i].revents && src->shard == shard && src->state == SourceState_Armed) {
+                src->revents = fds[i].revents;
+                _eventloopSourceSignaled(loop, shard, src);
+            }
+        }
+        _eventloopEndWait(shard);
+    }
+    mutexUnlock(&loop->mutex);
+
+    free(fds);
+    free(srcs);
+}
+
+static int _eventloopCreateWakeSocket(void)
+{
+    int fd = bsdSocket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return -1;
+
+    // Bind to an ephemeral loopback port and connect the socket to itself, so that sending to it wakes up bsdPoll.
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bsdBind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+        bsdGetSockName(fd, (struct sockaddr*)&addr, &addrlen) == 0 &&
+        bsdConnect(fd, (struct sockaddr*)&addr, addrlen) == 0)
+        return fd;
+
+    bsdClose(fd);
+    return -1;
+}
+
+static Result _eventloopStartShard(EventLoop* loop, EventLoopShard* shard)
+{
+    Result rc = threadCreate(&shard->thread, shard->is_socket ? _eventloopSocketThread : _eventloopShardThread,
+        shard, NULL, loop->stack_sz, loop->prio, -2);
+
+    if (R_SUCCEEDED(rc)) {
+        schedAddHelperThread(shard->thread.handle);
+        rc = threadStart(&shard->thread);
+        if (R_FAILED(rc)) {
+            schedRemoveHelperThread(shard->thread.handle);
+            threadClose(&shard->thread);
+        }
+    }
+
+    return rc;
+}
+
+static EventLoopShard* _eventloopGetShard(EventLoop* loop, u8 type, Result* out_rc)
+{
+    *out_rc = 0;
+
+    if (type == EventLoopSourceType_Socket) {
+        if (loop->sockets)
+            return loop->sockets;
+    } else {
+        if (loop->main.num_sources < EVENTLOOP_SHARD_SIZE)
+            return &loop->main;
+        for (EventLoopShard* shard = loop->helpers; shard; shard = shard->next)
+            if (shard->num_sources < EVENTLOOP_SHARD_SIZE)
+                return shard;
+    }
+
+    EventLoopShard* shard = (EventLoopShard*)malloc(sizeof(EventLoopShard));
+    if (!shard) {
+        *out_rc = MAKERESULT(Module_Libnx, LibnxError_OutOfMemory);
+        return NULL;
+    }
+
+    _eventloopShardInit(shard, loop, type == EventLoopSourceType_Socket);
+    if (shard->is_socket && loop->wake_fd < 0)
+        loop->wake_fd = _eventloopCreateWakeSocket();
+
+    *out_rc = _eventloopStartShard(loop, shard);
+    if (R_FAILED(*out_rc)) {
+        free(shard);
+        return NULL;
+    }
+
+    if (shard->is_socket)
+        loop->sockets = shard;
+    else {
+        shard->next = loop->helpers;
+        loop->helpers = shard;
+    }
+
+    return shard;
+}
+
+static Result _eventloopAdd(EventLoop* loop, EventLoopSource* src)
+{
+    Result rc;
+
+    mutexLock(&loop->mutex);
+
+    EventLoopShard* shard = _eventloopGetShard(loop, src->type, &rc);
+    if (shard) {
+        _eventloopShardLink(shard, src);
+        src->shard = shard;
+        src->state = SourceState_Armed;
+        _eventloopWakeShard(loop, shard);
+    }
+
+    mutexUnlock(&loop->mutex);
+    return rc;
+}
+
+Result eventloopCreate(EventLoop* loop, int prio, size_t stack_sz)
+{
+    memset(loop, 0, sizeof(*loop));
+    mutexInit(&loop->mutex);
+    condvarInit(&loop->seq_condvar);
+    ueventCreate(&loop->wakeup, true);
+    loop->prio = prio;
+    loop->stack_sz = stack_sz;
+    loop->owner = INVALID_HANDLE;
+    loop->wake_fd = -1;
+    _eventloopShardInit(&loop->main, loop, false);
+    return 0;
+}
+
+void eventloopClose(EventLoop* loop)
+{
+    mutexLock(&loop->mutex);
+    loop->exiting = true;
+    for (EventLoopShard* shard = loop->helpers; shard; shard = shard->next)
+        ueventSignal(&shard->control);
+    if (loop->sockets)
+        _eventloopWakeSockets(loop);
+    mutexUnlock(&loop->mutex);
+
+    while (loop->helpers) {
+        EventLoopShard* shard = loop->helpers;
+        loop->helpers = shard->next;
+        threadWaitForExit(&shard->thread);
+        schedRemoveHelperThread(shard->thread.handle);
+        threadClose(&shard->thread);
+        free(shard);
+    }
+
+    if (loop->sockets) {
+        threadWaitForExit(&loop->sockets->thread);
+        schedRemoveHelperThread(loop->sockets->thread.handle);
+        threadClose(&loop->sockets->thread);
+        free(loop->sockets);
+        loop->sockets = NULL;
+    }
+
+    if (loop->wake_fd >= 0) {
+        bsdClose(loop->wake_fd);
+        loop->wake_fd = -1;
+    }
+}
+
+Result eventloopAddWaiter(EventLoop* loop, EventLoopSource* src, Waiter waiter, EventLoopCallback callback, void* userdata)
+{
+    src->type = EventLoopSourceType_Waiter;
+    src->waiter = waiter;
+    src->fd = -1;
+    src->events = 0;
+    src->revents = 0;
+    src->callback = callback;
+    src->userdata = userdata;
+    return _eventloopAdd(loop, src);
+}
+
+Result eventloopAddSocket(EventLoop* loop, EventLoopSource* src, int fd, s16 events, EventLoopCallback callback, void* userdata)
+{
+    src->type = EventLoopSourceType_Socket;
+    src->fd = fd;
+    src->events = events;
+    src->revents = 0;
+    src->callback = callback;
+    src->userdata = userdata;
+    return _eventloopAdd(loop, src);
+}
+
+void eventloopRemove(EventLoop* loop, EventLoopSource* src)
+{
+    u32* seq = NULL;
+    u32 old_seq = 0;
+
+    mutexLock(&loop->mutex);
+
+    EventLoopShard* shard = src->shard;
+    if (shard) {
+        _eventloopShardUnlink(shard, src);
+        src->shard = NULL;
+
+        switch (src->state) {
+            case SourceState_Armed:
+                // Wait for the shard to stop waiting on the source.
+                if (shard->waiting) {
+                    seq = &shard->seq;
+                    old_seq = shard->seq;
+                    _eventloopWakeShard(loop, shard);
+                }
+                break;
+
+            case SourceState_Ready:
+                _eventloopReadyUnlink(loop, src);
+                break;
+
+            case SourceState_Dispatching:
+                // Wait for the callback to return, unless we are being called from it. Either way, the loop must not touch the source anymore.
+                if (loop->dispatching == src) {
+                    loop->dispatching = NULL;
+                    if (loop->owner != threadGetCurHandle()) {
+                        seq = &loop->dispatch_seq;
+                        old_seq = loop->dispatch_seq;
+                    }
+                }
+                break;
+        }
+
+        src->state = SourceState_Idle;
+    }
+
+    if (seq) {
+        while (*seq == old_seq)
+            condvarWait(&loop->seq_condvar, &loop->mutex);
+    }
+
+    mutexUnlock(&loop->mutex);
+}
+
+void eventloopPost(EventLoop* loop, EventLoopWork* work, EventLoopWorkFunc func, void* userdata)
+{
+    work->next = NULL;
+    work->func = func;
+    work->userdata = userdata;
+
+    mutexLock(&loop->mutex);
+    if (loop->work_tail)
+        loop->work_tail->next = work;
+    else
+        loop->work_head = work;
+    loop->work_tail = work;
+    ueventSignal(&loop->wakeup);
+    mutexUnlock(&loop->mutex);
+}
+
+u32 eventloopRunOnce(EventLoop* loop, u64 timeout)
+{
+    Waiter objects[MAX_WAIT_OBJECTS];
+    EventLoopSource* srcs[MAX_WAIT_OBJECTS];
+    EventLoopShard* shard = &loop->main;
+    u32 count = 0;
+
+    mutexLock(&loop->mutex);
+    loop->owner = threadGetCurHandle();
+
+    if (!loop->ready_head && !loop->work_head && !loop->stop) {
+        s32 num = _eventloopBuildWaitSet(shard, waiterForUEvent(&loop->wakeup), objects, srcs);
+        shard->waiting = true;
+        mutexUnlock(&loop->mutex);
+
+        s32 idx = -1;
+        Result rc = waitObjects(&idx, objects, num, timeout);
+
+        mutexLock(&loop->mutex);
+        if (R_SUCCEEDED(rc) && idx > 0)
+            _eventloopSourceSignaled(loop, shard, srcs[idx]);
+        _eventloopEndWait(shard);
+    }
+
+    // Only dispatch the sources which were ready beforehand, so that sources signaled continuously can't starve posted work.
+    for (u32 n = loop->num_ready; n && loop->ready_head && !loop->stop; n --) {
+        EventLoopSource* src = loop->ready_head;
+        _eventloopReadyUnlink(loop, src);
+        src->state = SourceState_Dispatching;
+        loop->dispatching = src;
+        mutexUnlock(&loop->mutex);
+
+        src->callback(loop, src, src->userdata);
+        count ++;
+
+        mutexLock(&loop->mutex);
+
+        // If the source was removed by the callback it may already be freed, otherwise wait on it again.
+        if (loop->dispatching == src) {
+            loop->dispatching = NULL;
+            src->state = SourceState_Armed;
+            _eventloopWakeShard(loop, src->shard);
+        }
+
+        loop->dispatch_seq ++;
+        condvarWakeAll(&loop->seq_condvar);
+    }
+
+    EventLoopWork* work = loop->work_head;
+    loop->work_head = NULL;
+    loop->work_tail = NULL;
+
+    while (work) {
+        EventLoopWork* next = work->next;
+        mutexUnlock(&loop->mutex);
+
+        work->func(loop, work->userdata);
+        count ++;
+
+        mutexLock(&loop->mutex);
+        work = next;
+    }
+
+    loop->owner = INVALID_HANDLE;
+    mutexUnlock(&loop->mutex);
+    return count;
+}
+
+void eventloopRun(EventLoop* loop)
+{
+    while (!__atomic_load_n(&loop->stop, __ATOMIC_ACQUIRE))
+        eventloopRunOnce(loop, UINT64_MAX);
+
+    mutexLock(&loop->mutex);
+    loop->stop = false;
+    mutexUnlock(&loop->mutex);
+}
+
+void eventloopStop(EventLoop* loop)
+{
+    mutexLock(&loop->mutex);
+    loop->stop = true;
+    ueventSignal(&loop->wakeup);
+    mutexUnlock(&loop->mutex);
+}
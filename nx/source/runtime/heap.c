@@ -0,0 +1,134 @@
+#include "types.h"
+#include "result.h"
+#include "kernel/svc.h"
+#include "kernel/mutex.h"
+#include "runtime/heap.h"
+
+/*
+    The heap range is kept in libsysbase's fake_heap_start/fake_heap_end. newlib's malloc reaches
+    heapSbrk through the __syscall_sbrk_r hook (see newlib.c), so that memory is mapped on demand
+    when the heap is growable.
+*/
+
+extern char* fake_heap_start;
+extern char* fake_heap_end;
+
+static Mutex g_heapMutex;
+static bool g_heapGrowable;
+static char* g_heapStart;
+static char* g_heapBreak;
+static char* g_heapCommitEnd;
+
+bool heapSetupGrowable(size_t size)
+{
+    u64 region_addr = 0, region_size = 0, extra_size = 0;
+    if (R_FAILED(svcGetInfo(&region_addr, InfoType_AliasRegionAddress, CUR_PROCESS_HANDLE, 0)) ||
+        R_FAILED(svcGetInfo(&region_size, InfoType_AliasRegionSize, CUR_PROCESS_HANDLE, 0)))
+        return false;
+
+    // Stay clear of the extra size added to the alias region, which is used by the kernel.
+    if (R_SUCCEEDED(svcGetInfo(&extra_size, InfoType_AliasRegionExtraSize, CUR_PROCESS_HANDLE, 0)))
+        region_size -= extra_size;
+
+    // The alias region is skipped by virtmem, so the range doesn't need to be reserved there.
+    const uintptr_t start = (region_addr + HEAP_CHUNK_SIZE - 1) &~ (uintptr_t)(HEAP_CHUNK_SIZE - 1);
+    const uintptr_t end = (region_addr + region_size) &~ (uintptr_t)(HEAP_CHUNK_SIZE - 1);
+    if (end <= start)
+        return false;
+
+    size = (size + HEAP_CHUNK_SIZE - 1) &~ (size_t)(HEAP_CHUNK_SIZE - 1);
+    if (size > end - start)
+        size = end - start;
+    if (size < HEAP_CHUNK_SIZE)
+        return false;
+
+    // The start of the heap is used before the first call to sbrk (see argvSetup), so map the first chunk right away.
+    if (R_FAILED(svcMapPhysicalMemory((void*)start, HEAP_CHUNK_SIZE)))
+        return false;
+
+    g_heapGrowable = true;
+    g_heapStart = (char*)start;
+    g_heapCommitEnd = (char*)start + HEAP_CHUNK_SIZE;
+    fake_heap_start = (char*)start;
+    fake_heap_end = (char*)start + size;
+    return true;
+}
+
+bool heapIsGrowable(void)
+{
+    return g_heapGrowable;
+}
+
+static bool _heapCommit(char* end)
+{
+    end = (char*)(((uintptr_t)end + HEAP_CHUNK_SIZE - 1) &~ (uintptr_t)(HEAP_CHUNK_SIZE - 1));
+    if (end <= g_heapCommitEnd)
+        return true;
+
+    if (R_FAILED(svcMapPhysicalMemory(g_heapCommitEnd, end - g_heapCommitEnd)))
+        return false;
+
+    g_heapCommitEnd = end;
+    return true;
+}
+
+static size_t _heapDecommit(char* end)
+{
+    end = (char*)(((uintptr_t)end + HEAP_CHUNK_SIZE - 1) &~ (uintptr_t)(HEAP_CHUNK_SIZE - 1));
+    if (end >= g_heapCommitEnd)
+        return 0;
+
+    const size_t size = g_heapCommitEnd - end;
+    if (R_FAILED(svcUnmapPhysicalMemory(end, size)))
+        return 0;
+
+    g_heapCommitEnd = end;
+    return size;
+}
+
+void* heapSbrk(ptrdiff_t incr)
+{
+    void* ret = (void*)-1;
+
+    mutexLock(&g_heapMutex);
+
+    if (!g_heapBreak)
+        g_heapBreak = fake_heap_start;
+
+    char* new_break = g_heapBreak + incr;
+    if (new_break >= fake_heap_start && new_break <= fake_heap_end) {
+        bool ok = true;
+        if (g_heapGrowable) {
+            if (incr > 0)
+                ok = _heapCommit(new_break);
+            else // Keep a chunk mapped above the break, so that the heap doesn't map and unmap memory back and forth.
+                _heapDecommit(new_break + HEAP_CHUNK_SIZE);
+        }
+
+        if (ok) {
+            ret = g_heapBreak;
+            g_heapBreak = new_break;
+        }
+    }
+
+    mutexUnlock(&g_heapMutex);
+
+    return ret;
+}
+
+size_t heapTrim(size_t pad)
+{
+    size_t ret = 0;
+
+    mutexLock(&g_heapMutex);
+    if (g_heapGrowable)
+        ret = _heapDecommit((g_heapBreak ? g_heapBreak : fake_heap_start) + pad);
+    mutexUnlock(&g_heapMutex);
+
+    return ret;
+}
+
+size_t heapGetCommittedSize(void)
+{
+    return g_heapGrowable ? (size_t)(g_heapCommitEnd - g_heapStart) : (size_t)(fake_heap_end - fake_heap_start);
+}
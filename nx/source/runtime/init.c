@@ -18,11 +18,14 @@ void argvSetup(void);
 void __libnx_init_thread(void);
 void __libnx_init_time(void);
 void __libnx_init_cwd(void);
+bool heapSetupGrowable(size_t size);
 
 extern u32 __nx_applet_type;
 
 // Must be a multiple of 0x200000.
 __attribute__((weak)) size_t __nx_heap_size = 0;
+/// Set this to non-zero to map the heap on demand, see \ref heapIsGrowable.
+__attribute__((weak)) u32 __nx_heap_growable = 0;
 
 /// Override these with your own if you're using \ref__libnx_exception_handler. __nx_exception_stack is the stack-bottom. Update \ref __nx_exception_stack_size if you change this.
 __attribute__((weak)) alignas(16) u8 __nx_exception_stack[0x400];
@@ -36,7 +39,7 @@ void __attribute__((weak)) __libnx_exception_handler(ThreadExceptionDump *ctx);
 ThreadExceptionDump __nx_exceptiondump;
 
 /*
-  There are three ways of allocating heap:
+  There are four ways of allocating heap:
 
     - Normal syscall:
 
@@ -45,6 +48,15 @@ ThreadExceptionDump __nx_exceptiondump;
     determined with svcGetInfo. If running under a process where heap was already
     allocated with svcSetHeapSize, __nx_heap_size should be set manually.
 
+    - Growable heap:
+
+    Used when the weak symbol |__nx_heap_growable| is set. A range of the alias
+    region is used as heap, and memory is mapped into it with
+    |svcMapPhysicalMemory| as the heap grows, and unmapped as it shrinks. The
+    size of the range is given by |__nx_heap_size|, or is the total memory of the
+    process by default. If the process can't map physical memory, this falls back
+    to the normal syscall.
+
     - Heap override:
 
     Uses existing heap segment as provided by the homebrew loader environment
@@ -72,6 +84,12 @@ void __attribute__((weak)) __libnx_initheap(void)
         size = envGetHeapOverrideSize();
     }
     else {
+        if (__nx_heap_growable) {
+            svcGetInfo(&mem_available, InfoType_TotalMemorySize, CUR_PROCESS_HANDLE, 0);
+            if (heapSetupGrowable(__nx_heap_size ? __nx_heap_size : mem_available))
+                return;
+        }
+
         if (__nx_heap_size==0) {
             svcGetInfo(&mem_available, InfoType_TotalMemorySize, CUR_PROCESS_HANDLE, 0);
             svcGetInfo(&mem_used, InfoType_UsedMemorySize, CUR_PROCESS_HANDLE, 0);
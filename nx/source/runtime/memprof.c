@@ -0,0 +1,270 @@
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "result.h"
+#include "kernel/svc.h"
+#include "kernel/mutex.h"
+#include "runtime/heap.h"
+#include "runtime/memprof.h"
+#include "alloc.h"
+
+#define ALLOC_TOMBSTONE ((uintptr_t)1)
+#define SITE_NONE       UINT32_MAX
+#define MAX_PROBE       64 // Longest run of entries scanned for a pointer, so that tombstones don't make lookups scan the whole table.
+
+typedef struct {
+    uintptr_t ptr;  // 0: never used, ALLOC_TOMBSTONE: freed.
+    u64 size;
+    u32 site;
+    u32 padding;
+} MemProfAlloc;
+
+bool __nx_memprof_enabled;
+
+static Mutex g_memprofMutex;
+static MemProfSite* g_memprofSites;
+static MemProfAlloc* g_memprofAllocs;
+static u64 g_memprofUntracked;
+static __thread bool g_memprofSuspended; // Set while the profiler allocates memory for itself.
+
+static inline u32 _memprofHash(uintptr_t key)
+{
+    u64 hash = (key >> 4) * 0x9E3779B97F4A7C15ULL;
+    return hash >> 32;
+}
+
+static u32 _memprofGetSite(uintptr_t site)
+{
+    const u32 hash = _memprofHash(site);
+    for (u32 i = 0; i < MEMPROF_MAX_SITES; i ++) {
+        const u32 idx = (hash + i) % MEMPROF_MAX_SITES;
+        MemProfSite* s = &g_memprofSites[idx];
+        uintptr_t cur = __atomic_load_n(&s->site, __ATOMIC_RELAXED);
+        if (cur == 0 && __atomic_compare_exchange_n(&s->site, &cur, site, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return idx;
+        if (cur == site)
+            return idx;
+    }
+
+    // Table is full, the allocation is tracked without a site.
+    return SITE_NONE;
+}
+
+static void _memprofSiteAdd(u32 site, s64 size, s64 count)
+{
+    if (site == SITE_NONE)
+        return;
+
+    MemProfSite* s = &g_memprofSites[site];
+    __atomic_fetch_add(&s->live_bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->live_count, count, __ATOMIC_RELAXED);
+}
+
+Result memprofSetEnabled(bool enabled)
+{
+    if (enabled && !g_memprofAllocs) {
+        mutexLock(&g_memprofMutex);
+        if (!g_memprofAllocs) {
+            // Allocated while profiling is still disabled, so these aren't recorded.
+            MemProfSite* sites = (MemProfSite*)__libnx_alloc(MEMPROF_MAX_SITES * sizeof(MemProfSite));
+            MemProfAlloc* allocs = (MemProfAlloc*)__libnx_alloc(MEMPROF_MAX_ALLOCS * sizeof(MemProfAlloc));
+            if (sites && allocs) {
+                memset(sites, 0, MEMPROF_MAX_SITES * sizeof(MemProfSite));
+                memset(allocs, 0, MEMPROF_MAX_ALLOCS * sizeof(MemProfAlloc));
+                g_memprofSites = sites;
+                __atomic_store_n(&g_memprofAllocs, allocs, __ATOMIC_RELEASE);
+            }
+            else {
+                __libnx_free(sites);
+                __libnx_free(allocs);
+            }
+        }
+        mutexUnlock(&g_memprofMutex);
+
+        if (!g_memprofAllocs)
+            return MAKERESULT(Module_Libnx, LibnxError_OutOfMemory);
+    }
+
+    __atomic_store_n(&__nx_memprof_enabled, enabled, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Removes a pointer from the table, returning its entry contents.
+static bool _memprofRemove(uintptr_t ptr, u64* out_size, u32* out_site)
+{
+    const u32 hash = _memprofHash(ptr);
+    for (u32 i = 0; i < MAX_PROBE; i ++) {
+        MemProfAlloc* e = &g_memprofAllocs[(hash + i) % MEMPROF_MAX_ALLOCS];
+        uintptr_t cur = __atomic_load_n(&e->ptr, __ATOMIC_ACQUIRE);
+        if (cur == 0)
+            break;
+        if (cur != ptr)
+            continue;
+
+        // Only the owner of the memory adds or removes its entry, so the contents are stable.
+        *out_size = e->size;
+        *out_site = e->site;
+        __atomic_store_n(&e->ptr, ALLOC_TOMBSTONE, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    return false;
+}
+
+// Inserts a pointer within MAX_PROBE entries of its hash, reusing freed entries. Fails if they are all in use.
+static bool _memprofInsert(uintptr_t ptr, u64 size, u32 site)
+{
+    const u32 hash = _memprofHash(ptr);
+    for (;;) {
+        MemProfAlloc* slot = NULL;
+        uintptr_t expected = 0;
+
+        for (u32 i = 0; i < MAX_PROBE; i ++) {
+            MemProfAlloc* e = &g_memprofAllocs[(hash + i) % MEMPROF_MAX_ALLOCS];
+            uintptr_t cur = __atomic_load_n(&e->ptr, __ATOMIC_ACQUIRE);
+            if (cur == ALLOC_TOMBSTONE && !slot) {
+                slot = e;
+                expected = ALLOC_TOMBSTONE;
+            }
+            else if (cur == 0) {
+                if (!slot)
+                    slot = e;
+                break;
+            }
+        }
+
+        if (!slot)
+            return false;
+
+        // Entries are claimed with a CAS, so that two threads never claim the same slot.
+        if (__atomic_compare_exchange_n(&slot->ptr, &expected, ptr, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            slot->size = size;
+            slot->site = site;
+            return true;
+        }
+    }
+}
+
+void memprofRecordAlloc(void* p, size_t size, const void* site)
+{
+    MemProfAlloc* allocs = __atomic_load_n(&g_memprofAllocs, __ATOMIC_ACQUIRE);
+    if (!p || !allocs || g_memprofSuspended)
+        return;
+
+    // An allocation wrapping another one (e.g. __libnx_alloc over a wrapped malloc) is attributed to the outer caller.
+    u64 old_size;
+    u32 old_site;
+    if (_memprofRemove((uintptr_t)p, &old_size, &old_site)) {
+        _memprofSiteAdd(old_site, -(s64)old_size, -1);
+        if (old_site != SITE_NONE) {
+            __atomic_fetch_sub(&g_memprofSites[old_site].total_bytes, old_size, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&g_memprofSites[old_site].total_count, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    const u32 idx = _memprofGetSite((uintptr_t)site);
+    if (!_memprofInsert((uintptr_t)p, size, idx)) {
+        __atomic_fetch_add(&g_memprofUntracked, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    _memprofSiteAdd(idx, size, 1);
+    if (idx != SITE_NONE) {
+        __atomic_fetch_add(&g_memprofSites[idx].total_bytes, size, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&g_memprofSites[idx].total_count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void memprofRecordFree(void* p)
+{
+    MemProfAlloc* allocs = __atomic_load_n(&g_memprofAllocs, __ATOMIC_ACQUIRE);
+    if (!p || !allocs || g_memprofSuspended)
+        return;
+
+    u64 size;
+    u32 site;
+    if (_memprofRemove((uintptr_t)p, &size, &site))
+        _memprofSiteAdd(site, -(s64)size, -1);
+}
+
+size_t memprofGetSites(MemProfSite* out, size_t max_sites)
+{
+    if (!__atomic_load_n(&g_memprofAllocs, __ATOMIC_ACQUIRE))
+        return 0;
+
+    size_t count = 0;
+    for (u32 i = 0; i < MEMPROF_MAX_SITES && count < max_sites; i ++) {
+        const MemProfSite* s = &g_memprofSites[i];
+        const uintptr_t site = __atomic_load_n(&s->site, __ATOMIC_RELAXED);
+        if (!site)
+            continue;
+
+        MemProfSite* o = &out[count++];
+        o->site = site;
+        o->live_bytes = __atomic_load_n(&s->live_bytes, __ATOMIC_RELAXED);
+        o->live_count = __atomic_load_n(&s->live_count, __ATOMIC_RELAXED);
+        o->total_bytes = __atomic_load_n(&s->total_bytes, __ATOMIC_RELAXED);
+        o->total_count = __atomic_load_n(&s->total_count, __ATOMIC_RELAXED);
+    }
+
+    return count;
+}
+
+void memprofGetTotals(MemProfTotals* out)
+{
+    memset(out, 0, sizeof(*out));
+    svcGetInfo(&out->total_memory, InfoType_TotalMemorySize, CUR_PROCESS_HANDLE, 0);
+    svcGetInfo(&out->used_memory, InfoType_UsedMemorySize, CUR_PROCESS_HANDLE, 0);
+    out->heap_size = heapGetCommittedSize();
+    out->untracked_count = __atomic_load_n(&g_memprofUntracked, __ATOMIC_RELAXED);
+
+    if (!__atomic_load_n(&g_memprofAllocs, __ATOMIC_ACQUIRE))
+        return;
+
+    for (u32 i = 0; i < MEMPROF_MAX_SITES; i ++) {
+        out->live_bytes += __atomic_load_n(&g_memprofSites[i].live_bytes, __ATOMIC_RELAXED);
+        out->live_count += __atomic_load_n(&g_memprofSites[i].live_count, __ATOMIC_RELAXED);
+    }
+}
+
+static int _memprofCompareSites(const void* a, const void* b)
+{
+    const MemProfSite* sa = (const MemProfSite*)a;
+    const MemProfSite* sb = (const MemProfSite*)b;
+    return sa->live_bytes < sb->live_bytes ? 1 : sa->live_bytes > sb->live_bytes ? -1 : 0;
+}
+
+void memprofDump(FILE* f)
+{
+    extern char _start[]; // Base of the main module.
+
+    MemProfTotals totals;
+    memprofGetTotals(&totals);
+
+    fprintf(f, "# Memory usage (KiB)\n");
+    fprintf(f, "total %-10" PRIu64 " used %-10" PRIu64 " heap %" PRIu64 "\n",
+        totals.total_memory / 1024, totals.used_memory / 1024, totals.heap_size / 1024);
+    fprintf(f, "tracked %" PRIu64 " KiB in %" PRIu64 " allocations, %" PRIu64 " untracked allocations\n",
+        totals.live_bytes / 1024, totals.live_count, totals.untracked_count);
+
+    // The buffer isn't recorded, so that the dump doesn't show up in itself.
+    g_memprofSuspended = true;
+    MemProfSite* sites = (MemProfSite*)__libnx_alloc(MEMPROF_MAX_SITES * sizeof(MemProfSite));
+    g_memprofSuspended = false;
+    if (!sites)
+        return;
+
+    size_t count = memprofGetSites(sites, MEMPROF_MAX_SITES);
+    qsort(sites, count, sizeof(MemProfSite), _memprofCompareSites);
+
+    fprintf(f, "# Allocation sites: address (main module offset), live bytes, live count, total bytes, total count\n");
+    for (size_t i = 0; i < count; i ++) {
+        const MemProfSite* s = &sites[i];
+        fprintf(f, "%016" PRIxPTR " (%+" PRIdPTR ") live %-10" PRIu64 " %-8" PRIu64 " total %-12" PRIu64 " %" PRIu64 "\n",
+            s->site, (intptr_t)(s->site - (uintptr_t)_start), s->live_bytes, s->live_count, s->total_bytes, s->total_count);
+    }
+
+    g_memprofSuspended = true;
+    __libnx_free(sites);
+    g_memprofSuspended = false;
+}
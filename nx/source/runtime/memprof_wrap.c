@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <malloc.h>
+#include "runtime/memprof.h"
+
+/*
+    Wrappers recording newlib's malloc family in the memory profiler. These are only linked in
+    when the program is linked with the --wrap flags listed in memprof.h.
+*/
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t num, size_t size);
+void* __real_realloc(void* p, size_t size);
+void  __real_free(void* p);
+void* __real_memalign(size_t alignment, size_t size);
+void* __real_aligned_alloc(size_t alignment, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    void* p = __real_malloc(size);
+    if (memprofIsEnabled())
+        memprofRecordAlloc(p, size, __builtin_return_address(0));
+    return p;
+}
+
+void* __wrap_calloc(size_t num, size_t size)
+{
+    void* p = __real_calloc(num, size);
+    if (memprofIsEnabled())
+        memprofRecordAlloc(p, num * size, __builtin_return_address(0));
+    return p;
+}
+
+void* __wrap_realloc(void* p, size_t size)
+{
+    // The old block must be removed before it is freed, as another thread could get the same address afterwards.
+    const bool enabled = memprofIsEnabled();
+    if (enabled)
+        memprofRecordFree(p);
+
+    void* ret = __real_realloc(p, size);
+    if (enabled)
+        memprofRecordAlloc(ret ? ret : (size ? p : NULL), size, __builtin_return_address(0));
+    return ret;
+}
+
+void __wrap_free(void* p)
+{
+    if (memprofIsEnabled())
+        memprofRecordFree(p);
+    __real_free(p);
+}
+
+void* __wrap_memalign(size_t alignment, size_t size)
+{
+    void* p = __real_memalign(alignment, size);
+    if (memprofIsEnabled())
+        memprofRecordAlloc(p, size, __builtin_return_address(0));
+    return p;
+}
+
+void* __wrap_aligned_alloc(size_t alignment, size_t size)
+{
+    void* p = __real_aligned_alloc(alignment, size);
+    if (memprofIsEnabled())
+        memprofRecordAlloc(p, size, __builtin_return_address(0));
+    return p;
+}
@@ -10,6 +10,7 @@
 #include "../internal.h"
 #include "types.h"
 #include "runtime/env.h"
+#include "runtime/heap.h"
 #include "arm/counter.h"
 #include "kernel/mutex.h"
 #include "kernel/condvar.h"
@@ -52,6 +53,14 @@ void __syscall_exit(int rc)
     for (;;);
 }
 
+void* __syscall_sbrk_r(struct _reent *ptr, ptrdiff_t incr)
+{
+    void* ret = heapSbrk(incr);
+    if (ret == (void*)-1)
+        ptr->_errno = ENOMEM;
+    return ret;
+}
+
 struct _reent* __syscall_getreent(void)
 {
     ThreadVars* tv = getThreadVars();
@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include "result.h"
+#include "kernel/mutex.h"
+#include "kernel/thread.h"
+#include "slab.h"
+
+/*
+    Size-class slab allocator, used by __libnx_alloc when __nx_alloc_slab is set.
+
+    Objects of each size class are carved from SLAB_CHUNK_SIZE-aligned chunks dedicated to that class, whose
+    header records the class. Chunks are obtained from newlib, so its lock is only taken once per chunk.
+    A bitmap over the heap tells whether a pointer belongs to a slab chunk.
+
+    Each thread keeps a cache of free objects per class, refilled from (and flushed to) a central free list
+    in batches. The cache of an exiting thread is flushed by a TLS slot destructor.
+*/
+
+#define SLAB_NUM_CLASSES   24
+#define SLAB_CHUNK_HEADER  64
+#define SLAB_BATCH_BYTES   0x1000 // Amount of memory moved between a thread cache and the central list at once.
+#define SLAB_CACHE_BYTES   0x4000 // Amount of memory a thread cache keeps per class before flushing.
+
+typedef struct SlabObject {
+    struct SlabObject* next;
+} SlabObject;
+
+typedef struct {
+    u32 cls;
+} SlabChunkHeader;
+
+// Chunks are found by masking pointers, and objects must stay 16-byte aligned after the header.
+_Static_assert((SLAB_CHUNK_SIZE & (SLAB_CHUNK_SIZE-1)) == 0, "SLAB_CHUNK_SIZE must be a power of two");
+_Static_assert(sizeof(SlabChunkHeader) <= SLAB_CHUNK_HEADER && SLAB_CHUNK_HEADER % 16 == 0, "Bad SLAB_CHUNK_HEADER");
+_Static_assert(SLAB_BATCH_BYTES >= SLAB_MAX_SIZE && SLAB_CACHE_BYTES >= SLAB_BATCH_BYTES, "Batches must hold at least one object");
+
+typedef struct {
+    Mutex mutex;
+    SlabObject* free;
+    u8* bump;
+    u8* bump_end;
+} SlabCentral;
+
+typedef struct {
+    SlabObject* free[SLAB_NUM_CLASSES];
+    u32 count[SLAB_NUM_CLASSES];
+    bool registered;
+    bool flushed; // Set once the thread is exiting, the cache isn't used anymore then.
+} SlabCache;
+
+static const u16 g_slabClassSizes[SLAB_NUM_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+};
+
+static SlabCentral g_slabCentral[SLAB_NUM_CLASSES];
+static __thread SlabCache g_slabCache;
+
+static Mutex g_slabInitMutex;
+static bool g_slabInitialized;
+static bool g_slabDisabled;
+static u8 g_slabClassLookup[SLAB_MAX_SIZE/16 + 1];
+static uintptr_t g_slabHeapStart;
+static uintptr_t g_slabHeapEnd;
+static u64* g_slabChunkMap;
+static s32 g_slabTlsSlot = -1;
+
+static void _slabCacheFlush(void* arg);
+
+static bool _slabInit(void)
+{
+    if (__atomic_load_n(&g_slabInitialized, __ATOMIC_ACQUIRE))
+        return !g_slabDisabled;
+
+    mutexLock(&g_slabInitMutex);
+    if (!g_slabInitialized) {
+        u32 cls = 0;
+        for (u32 i = 0; i <= SLAB_MAX_SIZE/16; i ++) {
+            while (g_slabClassSizes[cls] < i*16)
+                cls ++;
+            g_slabClassLookup[i] = cls;
+        }
+
+        // Track the range newlib allocates from, which is outside of the heap region with a growable heap or a heap override.
+        extern char* fake_heap_start;
+        extern char* fake_heap_end;
+        const uintptr_t addr = (uintptr_t)fake_heap_start &~ (uintptr_t)(SLAB_CHUNK_SIZE - 1);
+        const size_t size = (uintptr_t)fake_heap_end - addr;
+
+        const size_t num_chunks = size / SLAB_CHUNK_SIZE;
+        g_slabChunkMap = num_chunks ? (u64*)calloc((num_chunks + 63) / 64, sizeof(u64)) : NULL;
+        g_slabHeapStart = addr;
+        g_slabHeapEnd = addr + num_chunks * SLAB_CHUNK_SIZE;
+        g_slabDisabled = g_slabChunkMap == NULL;
+
+        g_slabTlsSlot = threadTlsAlloc(_slabCacheFlush);
+        __atomic_store_n(&g_slabInitialized, true, __ATOMIC_RELEASE);
+    }
+    mutexUnlock(&g_slabInitMutex);
+
+    return !g_slabDisabled;
+}
+
+bool slabOwns(void* p)
+{
+    const uintptr_t addr = (uintptr_t)p;
+    if (!g_slabChunkMap || addr < g_slabHeapStart || addr >= g_slabHeapEnd)
+        return false;
+
+    const size_t idx = (addr - g_slabHeapStart) / SLAB_CHUNK_SIZE;
+    return (__atomic_load_n(&g_slabChunkMap[idx / 64], __ATOMIC_RELAXED) >> (idx % 64)) & 1;
+}
+
+static bool _slabNewChunk(SlabCentral* central, u32 cls)
+{
+    u8* chunk = (u8*)aligned_alloc(SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE);
+    if (!chunk)
+        return false;
+
+    // Chunks outside the heap (e.g. from custom inner heaps) can't be tracked.
+    const uintptr_t addr = (uintptr_t)chunk;
+    if (addr < g_slabHeapStart || addr + SLAB_CHUNK_SIZE > g_slabHeapEnd) {
+        free(chunk);
+        return false;
+    }
+
+    ((SlabChunkHeader*)chunk)->cls = cls;
+    const size_t idx = (addr - g_slabHeapStart) / SLAB_CHUNK_SIZE;
+    __atomic_fetch_or(&g_slabChunkMap[idx / 64], 1UL << (idx % 64), __ATOMIC_RELAXED);
+
+    central->bump = chunk + SLAB_CHUNK_HEADER;
+    central->bump_end = chunk + SLAB_CHUNK_SIZE;
+    return true;
+}
+
+static void _slabRefill(SlabCache* cache, u32 cls)
+{
+    SlabCentral* central = &g_slabCentral[cls];
+    const size_t obj_size = g_slabClassSizes[cls];
+    u32 batch = SLAB_BATCH_BYTES / obj_size;
+    if (!batch)
+        batch = 1;
+
+    mutexLock(&central->mutex);
+
+    // Take freed objects first, then carve new ones.
+    while (batch && central->free) {
+        SlabObject* obj = central->free;
+        central->free = obj->next;
+        obj->next = cache->free[cls];
+        cache->free[cls] = obj;
+        cache->count[cls] ++;
+        batch --;
+    }
+
+    while (batch) {
+        if ((size_t)(central->bump_end - central->bump) < obj_size && !_slabNewChunk(central, cls))
+            break;
+
+        SlabObject* obj = (SlabObject*)central->bump;
+        central->bump += obj_size;
+        obj->next = cache->free[cls];
+        cache->free[cls] = obj;
+        cache->count[cls] ++;
+        batch --;
+    }
+
+    mutexUnlock(&central->mutex);
+}
+
+// Gives back objects of a class to the central list, keeping at most keep of them in the cache.
+static void _slabRelease(SlabCache* cache, u32 cls, u32 keep)
+{
+    if (cache->count[cls] <= keep)
+        return;
+
+    SlabObject* head = cache->free[cls];
+    SlabObject* tail = head;
+    for (u32 i = cache->count[cls] - keep; i > 1; i --)
+        tail = tail->next;
+
+    cache->free[cls] = tail->next;
+    cache->count[cls] = keep;
+
+    SlabCentral* central = &g_slabCentral[cls];
+    mutexLock(&central->mutex);
+    tail->next = central->free;
+    central->free = head;
+    mutexUnlock(&central->mutex);
+}
+
+static void _slabCacheFlush(void* arg)
+{
+    SlabCache* cache = (SlabCache*)arg;
+    // Objects freed by the thread after this (from later TLS destructors or threadExit) go straight to the central lists.
+    cache->flushed = true;
+    for (u32 cls = 0; cls < SLAB_NUM_CLASSES; cls ++)
+        _slabRelease(cache, cls, 0);
+}
+
+static SlabCache* _slabGetCache(void)
+{
+    SlabCache* cache = &g_slabCache;
+    if (!cache->registered) {
+        // Set first: storing into an extended TLS slot can allocate, which comes back here.
+        cache->registered = true;
+        // Flush the cache when the thread exits.
+        if (g_slabTlsSlot >= 0)
+            threadTlsSet(g_slabTlsSlot, cache);
+    }
+    return cache;
+}
+
+void* slabAlloc(size_t size)
+{
+    if (size > SLAB_MAX_SIZE || !_slabInit())
+        return NULL;
+
+    const u32 cls = g_slabClassLookup[(size + 15) / 16];
+    SlabCache* cache = _slabGetCache();
+    if (cache->flushed)
+        return NULL;
+
+    if (!cache->free[cls]) {
+        _slabRefill(cache, cls);
+        if (!cache->free[cls])
+            return NULL;
+    }
+
+    SlabObject* obj = cache->free[cls];
+    cache->free[cls] = obj->next;
+    cache->count[cls] --;
+    return obj;
+}
+
+void slabFree(void* p)
+{
+    const SlabChunkHeader* chunk = (const SlabChunkHeader*)((uintptr_t)p &~ (SLAB_CHUNK_SIZE - 1));
+    const u32 cls = chunk->cls;
+    SlabCache* cache = _slabGetCache();
+
+    SlabObject* obj = (SlabObject*)p;
+    obj->next = cache->free[cls];
+    cache->free[cls] = obj;
+    cache->count[cls] ++;
+
+    if (cache->flushed) {
+        _slabRelease(cache, cls, 0);
+        return;
+    }
+
+    // Keep the cache bounded, giving back half of it at once.
+    u32 limit = SLAB_CACHE_BYTES / g_slabClassSizes[cls];
+    if (limit < 4)
+        limit = 4;
+    if (cache->count[cls] > limit)
+        _slabRelease(cache, cls, limit / 2);
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "types.h"
+
+#define SLAB_CHUNK_SIZE  0x10000 // Size and alignment of the chunks carved into objects.
+#define SLAB_MAX_SIZE    2048    // Largest size served by the slab allocator.
+
+void* slabAlloc(size_t size);
+void slabFree(void* p);
+bool slabOwns(void* p);
@@ -0,0 +1,331 @@
+#include <string.h>
+#include "result.h"
+#include "kernel/svc.h"
+#include "kernel/thread.h"
+#include "kernel/levent.h"
+#include "kernel/queue.h"
+#include "runtime/threadpool.h"
+
+// Worker currently running on this thread, if any.
+static __thread ThreadPoolWorker* g_threadpoolCurrentWorker;
+
+// Deque indices are wrapped by masking.
+_Static_assert((THREADPOOL_DEQUE_SIZE & (THREADPOOL_DEQUE_SIZE-1)) == 0, "THREADPOOL_DEQUE_SIZE must be a power of two");
+
+/*
+    Chase-Lev deque. Only the owner pushes and pops at the bottom, other threads steal from the top.
+    The deque has a fixed capacity; tasks that don't fit go to the injection queue instead.
+*/
+
+static bool _threadpoolDequePush(ThreadPoolDeque* d, ThreadPoolTask* task)
+{
+    const s64 b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    const s64 t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - t >= THREADPOOL_DEQUE_SIZE)
+        return false;
+
+    __atomic_store_n(&d->tasks[b & (THREADPOOL_DEQUE_SIZE-1)], task, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static ThreadPoolTask* _threadpoolDequePop(ThreadPoolDeque* d)
+{
+    const s64 b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    s64 t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        // Empty.
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    ThreadPoolTask* task = __atomic_load_n(&d->tasks[b & (THREADPOOL_DEQUE_SIZE-1)], __ATOMIC_RELAXED);
+    if (t == b) {
+        // Last task: race against thieves for it.
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            task = NULL;
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return task;
+}
+
+static ThreadPoolTask* _threadpoolDequeSteal(ThreadPoolDeque* d)
+{
+    s64 t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    const s64 b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return NULL;
+
+    ThreadPoolTask* task = __atomic_load_n(&d->tasks[t & (THREADPOOL_DEQUE_SIZE-1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL; // Lost the race, the caller will look elsewhere.
+
+    return task;
+}
+
+static ThreadPoolWorker* _threadpoolGetCurrentWorker(ThreadPool* pool)
+{
+    ThreadPoolWorker* w = g_threadpoolCurrentWorker;
+    return w && w->pool == pool ? w : NULL;
+}
+
+static void _threadpoolWake(ThreadPool* pool)
+{
+    // Pairs with the fence in the worker idle path: either the worker sees the new task, or we see it sleeping.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->num_sleeping, __ATOMIC_RELAXED))
+        leventSignal(&pool->wakeup);
+}
+
+static void _threadpoolEnqueue(ThreadPool* pool, ThreadPoolTask* task);
+
+static void _threadpoolRun(ThreadPool* pool, ThreadPoolTask* task)
+{
+    task->func(task, task->arg);
+
+    // The task may be freed as soon as it is marked done, so fetch the continuation first.
+    ThreadPoolTask* continuation = task->continuation;
+    leventSignal(&task->done);
+
+    if (continuation && __atomic_sub_fetch(&continuation->pending, 1, __ATOMIC_ACQ_REL) == 0)
+        _threadpoolEnqueue(pool, continuation);
+}
+
+static void _threadpoolEnqueue(ThreadPool* pool, ThreadPoolTask* task)
+{
+    ThreadPoolWorker* w = _threadpoolGetCurrentWorker(pool);
+    if (w) {
+        if (!_threadpoolDequePush(&w->deque, task) && !mpmcqueueTryPush(&pool->injection, &task)) {
+            // Both queues are full: run the task right away rather than blocking a worker.
+            _threadpoolRun(pool, task);
+            return;
+        }
+    } else
+        mpmcqueuePush(&pool->injection, &task, UINT64_MAX);
+
+    _threadpoolWake(pool);
+}
+
+static ThreadPoolTask* _threadpoolFindTask(ThreadPool* pool, ThreadPoolWorker* w)
+{
+    ThreadPoolTask* task = NULL;
+
+    if (w && (task = _threadpoolDequePop(&w->deque)))
+        return task;
+
+    if (mpmcqueueTryPop(&pool->injection, &task))
+        return task;
+
+    // Try to steal from the other workers, starting at a pseudo-random one.
+    u32 start = 0;
+    if (w) {
+        w->steal_seed = w->steal_seed * 1103515245 + 12345;
+        start = (w->steal_seed >> 16) % pool->num_workers;
+    }
+
+    for (u32 i = 0; i < pool->num_workers; i ++) {
+        ThreadPoolWorker* victim = &pool->workers[(start + i) % pool->num_workers];
+        if (victim != w && (task = _threadpoolDequeSteal(&victim->deque)))
+            return task;
+    }
+
+    return NULL;
+}
+
+static void _threadpoolWorkerMain(void* arg)
+{
+    ThreadPoolWorker* w = (ThreadPoolWorker*)arg;
+    ThreadPool* pool = w->pool;
+    g_threadpoolCurrentWorker = w;
+
+    while (!__atomic_load_n(&pool->exiting, __ATOMIC_ACQUIRE)) {
+        ThreadPoolTask* task = _threadpoolFindTask(pool, w);
+        if (!task) {
+            // Announce that we're going to sleep, then look again for tasks submitted in the meantime.
+            leventClear(&pool->wakeup);
+            __atomic_add_fetch(&pool->num_sleeping, 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+            task = _threadpoolFindTask(pool, w);
+            if (!task && !__atomic_load_n(&pool->exiting, __ATOMIC_ACQUIRE))
+                leventWait(&pool->wakeup, UINT64_MAX);
+
+            __atomic_sub_fetch(&pool->num_sleeping, 1, __ATOMIC_SEQ_CST);
+            if (!task)
+                continue;
+        }
+
+        // Other workers may be asleep while there is more work around, wake them up.
+        if (mpmcqueueGetCount(&pool->injection) || __atomic_load_n(&w->deque.bottom, __ATOMIC_RELAXED) > __atomic_load_n(&w->deque.top, __ATOMIC_RELAXED))
+            _threadpoolWake(pool);
+
+        _threadpoolRun(pool, task);
+    }
+
+    g_threadpoolCurrentWorker = NULL;
+}
+
+Result threadpoolCreate(ThreadPool* pool, u32 num_workers, int prio, size_t stack_sz)
+{
+    u64 core_mask = 0;
+    Result rc = svcGetInfo(&core_mask, InfoType_CoreMask, CUR_PROCESS_HANDLE, 0);
+    if (R_FAILED(rc))
+        return rc;
+
+    u32 num_cores = __builtin_popcountll(core_mask);
+    if (!num_workers)
+        num_workers = num_cores;
+    if (!num_workers || num_workers > THREADPOOL_MAX_WORKERS)
+        return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+
+    memset(pool, 0, sizeof(*pool));
+    pool->num_workers = num_workers;
+    leventInit(&pool->wakeup, false, false);
+    rc = mpmcqueueInit(&pool->injection, pool->injection_storage, sizeof(ThreadPoolTask*), THREADPOOL_INJECTION_SIZE);
+
+    // Spread the workers over the available cores.
+    for (u32 i = 0; R_SUCCEEDED(rc) && i < num_workers; i ++) {
+        ThreadPoolWorker* w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+        w->steal_seed = i + 1;
+
+        u32 core = 0, n = i % num_cores;
+        for (u64 mask = core_mask;; mask &= mask - 1) {
+            core = __builtin_ctzll(mask);
+            if (!n--)
+                break;
+        }
+
+        rc = threadCreate(&w->thread, _threadpoolWorkerMain, w, NULL, stack_sz, prio, core);
+        if (R_SUCCEEDED(rc)) {
+            rc = threadStart(&w->thread);
+            if (R_FAILED(rc))
+                threadClose(&w->thread);
+        }
+
+        if (R_FAILED(rc)) {
+            pool->num_workers = i;
+            threadpoolClose(pool);
+        }
+    }
+
+    return rc;
+}
+
+void threadpoolClose(ThreadPool* pool)
+{
+    __atomic_store_n(&pool->exiting, true, __ATOMIC_RELEASE);
+    leventSignal(&pool->wakeup);
+
+    for (u32 i = 0; i < pool->num_workers; i ++) {
+        threadWaitForExit(&pool->workers[i].thread);
+        threadClose(&pool->workers[i].thread);
+    }
+
+    pool->num_workers = 0;
+}
+
+void threadpoolTaskInit(ThreadPoolTask* task, ThreadPoolTaskFunc func, void* arg)
+{
+    task->func = func;
+    task->arg = arg;
+    task->continuation = NULL;
+    task->pending = 1;
+    leventInit(&task->done, false, false);
+}
+
+void threadpoolTaskAddContinuation(ThreadPoolTask* task, ThreadPoolTask* continuation)
+{
+    task->continuation = continuation;
+    __atomic_add_fetch(&continuation->pending, 1, __ATOMIC_RELAXED);
+}
+
+void threadpoolSubmit(ThreadPool* pool, ThreadPoolTask* task)
+{
+    if (__atomic_sub_fetch(&task->pending, 1, __ATOMIC_ACQ_REL) == 0)
+        _threadpoolEnqueue(pool, task);
+}
+
+void threadpoolWait(ThreadPool* pool, ThreadPoolTask* task)
+{
+    ThreadPoolWorker* w = _threadpoolGetCurrentWorker(pool);
+
+    while (!leventTryWait(&task->done)) {
+        // Help with the work while waiting. The task we wait for may be queued behind others,
+        // possibly in our own deque, so a worker must never block indefinitely here.
+        ThreadPoolTask* other = _threadpoolFindTask(pool, w);
+        if (other)
+            _threadpoolRun(pool, other);
+        else
+            leventWait(&task->done, w ? 100000 : UINT64_MAX);
+    }
+}
+
+typedef struct {
+    ThreadPoolRangeFunc func;
+    void* userdata;
+    s64 end;
+    s64 grain;
+    s64 next;
+} ThreadPoolParallelFor;
+
+static void _threadpoolParallelForChunks(ThreadPoolParallelFor* state)
+{
+    while (true) {
+        const s64 begin = __atomic_fetch_add(&state->next, state->grain, __ATOMIC_RELAXED);
+        if (begin >= state->end)
+            break;
+
+        const s64 end = state->end - begin > state->grain ? begin + state->grain : state->end;
+        state->func(state->userdata, begin, end);
+    }
+}
+
+static void _threadpoolParallelForTask(ThreadPoolTask* task, void* arg)
+{
+    _threadpoolParallelForChunks((ThreadPoolParallelFor*)arg);
+}
+
+void threadpoolParallelFor(ThreadPool* pool, s64 begin, s64 end, s64 grain, ThreadPoolRangeFunc func, void* userdata)
+{
+    if (begin >= end)
+        return;
+
+    const s64 count = end - begin;
+    if (grain <= 0) {
+        // Aim for a few chunks per worker, so that uneven chunks get balanced.
+        grain = count / (pool->num_workers * 4);
+        if (grain < 1)
+            grain = 1;
+    }
+
+    ThreadPoolParallelFor state = {
+        .func = func,
+        .userdata = userdata,
+        .end = end,
+        .grain = grain,
+        .next = begin,
+    };
+
+    // Chunks are claimed dynamically by the helpers and by the calling thread.
+    const s64 num_chunks = (count + grain - 1) / grain;
+    const u32 num_helpers = num_chunks - 1 < pool->num_workers ? num_chunks - 1 : pool->num_workers;
+
+    ThreadPoolTask helpers[THREADPOOL_MAX_WORKERS];
+    for (u32 i = 0; i < num_helpers; i ++) {
+        threadpoolTaskInit(&helpers[i], _threadpoolParallelForTask, &state);
+        threadpoolSubmit(pool, &helpers[i]);
+    }
+
+    _threadpoolParallelForChunks(&state);
+
+    for (u32 i = 0; i < num_helpers; i ++)
+        threadpoolWait(pool, &helpers[i]);
+}
@@ -1,7 +1,9 @@
 #define NX_SERVICE_ASSUME_NON_DOMAIN
 #include "service_guard.h"
 #include "kernel/tmem.h"
+#include "kernel/tmemcache.h"
 #include "kernel/event.h"
+#include "sf/stub.h"
 #include "runtime/hosversion.h"
 #include "services/applet.h"
 #include "services/audren.h"
@@ -28,6 +30,39 @@ typedef struct {
     s32 unk4;
     u32 revision;
 } AudioRendererParameter;
+SF_STUB_CHECK_SIZE(AudioRendererParameter, 0x34);
+SF_STUB_CHECK_OFFSET(AudioRendererParameter, splitter_count, 0x24);
+SF_STUB_CHECK_OFFSET(AudioRendererParameter, revision, 0x30);
+
+typedef struct {
+    AudioRendererParameter param;
+    u32 pad;
+    u64 work_buffer_size;
+    u64 aruid;
+} AudrenOpenAudioRendererIn;
+SF_STUB_CHECK_SIZE(AudrenOpenAudioRendererIn, 0x48);
+SF_STUB_CHECK_OFFSET(AudrenOpenAudioRendererIn, work_buffer_size, 0x38);
+SF_STUB_CHECK_OFFSET(AudrenOpenAudioRendererIn, aruid, 0x40);
+
+// IAudioRendererManager
+#define AUDREN_MANAGER_CMDS(X) \
+    X(In,    OpenAudioRenderer, 0, AudrenOpenAudioRendererIn) \
+    X(InOut, GetWorkBufferSize, 1, AudioRendererParameter, u64)
+
+// IAudioRenderer
+#define AUDREN_RENDERER_CMDS(X) \
+    X(Out,   GetState,                  3, u32) \
+    X(None,  RequestUpdate,             4) \
+    X(None,  Start,                     5) \
+    X(None,  Stop,                      6) \
+    X(None,  QuerySystemEvent,          7) \
+    X(In,    SetRenderingTimeLimit,     8, s32) \
+    X(None,  RequestUpdateAuto,        10)
+
+#define _AUDREN_MANAGER_STUB(...)  SF_STUB_DEFINE(serviceDispatchImpl, _audrenManagerCmd, __VA_ARGS__)
+#define _AUDREN_RENDERER_STUB(...) SF_STUB_DEFINE(serviceDispatchImpl, _audrenRendererCmd, __VA_ARGS__)
+AUDREN_MANAGER_CMDS(_AUDREN_MANAGER_STUB)
+AUDREN_RENDERER_CMDS(_AUDREN_RENDERER_STUB)
 
 static Result _audrenOpenAudioRenderer(Service* srv, Service* srv_out, const AudioRendererParameter* param);
 static Result _audrenGetWorkBufferSize(Service* srv, const AudioRendererParameter* param, u64* out_size);
@@ -86,7 +121,7 @@ Result _audrenInitialize(const AudioRendererConfig* config) {
         if (R_SUCCEEDED(rc)) {
             // Create transfermem work buffer object
             workBufSize = (workBufSize + 0xFFF) &~ 0xFFF; // 1.x fails hard and returns a non-page-aligned work buffer size
-            rc = tmemCreate(&g_audrenWorkBuf, workBufSize, Perm_None);
+            rc = tmemcacheAcquire(&g_audrenWorkBuf, NULL, workBufSize, Perm_None);
             if (R_SUCCEEDED(rc)) {
                 // Create the IAudioRenderer service
                 rc = _audrenOpenAudioRenderer(&audrenMgrSrv, &g_audrenIAudioRenderer, &param);
@@ -104,7 +139,7 @@ Result _audrenInitialize(const AudioRendererConfig* config) {
 void _audrenCleanup(void) {
     eventClose(&g_audrenEvent);
     serviceClose(&g_audrenIAudioRenderer);
-    tmemClose(&g_audrenWorkBuf);
+    tmemcacheRelease(&g_audrenWorkBuf);
 }
 
 Service* audrenGetServiceSession_AudioRenderer(void) {
@@ -115,64 +150,35 @@ Event* audrenGetFrameEvent(void) {
     return &g_audrenEvent;
 }
 
-static Result _audrenCmdGetHandle(Service* srv, Handle* handle_out, u32 cmd_id) {
-    return serviceDispatch(srv, cmd_id,
-        .out_handle_attrs = { SfOutHandleAttr_HipcCopy },
-        .out_handles = handle_out,
-    );
-}
-
-static Result _audrenCmdGetEvent(Service* srv, Event* out_event, bool autoclear, u32 cmd_id) {
-    Handle tmp_handle = INVALID_HANDLE;
-    Result rc = 0;
-
-    rc = _audrenCmdGetHandle(srv, &tmp_handle, cmd_id);
-    if (R_SUCCEEDED(rc)) eventLoadRemote(out_event, tmp_handle, autoclear);
-    return rc;
-}
-
-static Result _audrenCmdNoIO(Service* srv, u32 cmd_id) {
-    return serviceDispatch(srv, cmd_id);
-}
-
-static Result _audrenCmdNoInOutU32(Service* srv, u32 *out, u32 cmd_id) {
-    return serviceDispatchOut(srv, cmd_id, *out);
-}
-
 void audrenWaitFrame(void) {
     eventWait(&g_audrenEvent, UINT64_MAX);
 }
 
 Result _audrenOpenAudioRenderer(Service* srv, Service* srv_out, const AudioRendererParameter* param) {
-    const struct {
-        AudioRendererParameter param;
-        u32 pad;
-        u64 work_buffer_size;
-        u64 aruid;
-    } in = { *param, 0, g_audrenWorkBuf.size, appletGetAppletResourceUserId() };
-
-    return serviceDispatchIn(srv, 0, in,
+    const AudrenOpenAudioRendererIn in = { *param, 0, g_audrenWorkBuf.size, appletGetAppletResourceUserId() };
+
+    return _audrenManagerCmdOpenAudioRenderer(srv, &in, (SfDispatchParams){
         .in_send_pid = true,
         .in_num_handles = 2,
         .in_handles = { g_audrenWorkBuf.handle, CUR_PROCESS_HANDLE },
         .out_num_objects = 1,
         .out_objects = srv_out,
-    );
+    });
 }
 
 Result _audrenGetWorkBufferSize(Service* srv, const AudioRendererParameter* param, u64* out_size) {
-    return serviceDispatchInOut(srv, 1, *param, *out_size);
+    return _audrenManagerCmdGetWorkBufferSize(srv, param, out_size, (SfDispatchParams){});
 }
 
 Result audrenGetState(u32* out_state) {
-    return _audrenCmdNoInOutU32(&g_audrenIAudioRenderer, out_state, 3);
+    return _audrenRendererCmdGetState(&g_audrenIAudioRenderer, out_state, (SfDispatchParams){});
 }
 
 Result audrenRequestUpdateAudioRenderer(const void* in_param_buf, size_t in_param_buf_size, void* out_param_buf, size_t out_param_buf_size, void* perf_buf, size_t perf_buf_size) {
     bool new_cmd = hosversionAtLeast(3,0,0);
 
     u32 tmpattr = new_cmd==0 ? SfBufferAttr_HipcMapAlias : SfBufferAttr_HipcAutoSelect;
-    return serviceDispatch(&g_audrenIAudioRenderer, new_cmd==0 ? 4 : 10,
+    const SfDispatchParams disp = {
         .buffer_attrs = {
             tmpattr | SfBufferAttr_Out,
             tmpattr | SfBufferAttr_Out,
@@ -183,21 +189,32 @@ Result audrenRequestUpdateAudioRenderer(const void* in_param_buf, size_t in_para
             { perf_buf, perf_buf_size },
             { in_param_buf, in_param_buf_size },
         },
-    );
+    };
+
+    if (new_cmd)
+        return _audrenRendererCmdRequestUpdateAuto(&g_audrenIAudioRenderer, disp);
+    return _audrenRendererCmdRequestUpdate(&g_audrenIAudioRenderer, disp);
 }
 
 Result audrenStartAudioRenderer(void) {
-    return _audrenCmdNoIO(&g_audrenIAudioRenderer, 5);
+    return _audrenRendererCmdStart(&g_audrenIAudioRenderer, (SfDispatchParams){});
 }
 
 Result audrenStopAudioRenderer(void) {
-    return _audrenCmdNoIO(&g_audrenIAudioRenderer, 6);
+    return _audrenRendererCmdStop(&g_audrenIAudioRenderer, (SfDispatchParams){});
 }
 
 Result _audrenQuerySystemEvent(Event* out_event) {
-    return _audrenCmdGetEvent(&g_audrenIAudioRenderer, out_event, true, 7);
+    Handle tmp_handle = INVALID_HANDLE;
+    Result rc = _audrenRendererCmdQuerySystemEvent(&g_audrenIAudioRenderer, (SfDispatchParams){
+        .out_handle_attrs = { SfOutHandleAttr_HipcCopy },
+        .out_handles = &tmp_handle,
+    });
+    if (R_SUCCEEDED(rc)) eventLoadRemote(out_event, tmp_handle, true);
+    return rc;
 }
 
 Result audrenSetAudioRendererRenderingTimeLimit(int percent) {
-    return serviceDispatchIn(&g_audrenIAudioRenderer, 8, percent);
+    const s32 in = percent;
+    return _audrenRendererCmdSetRenderingTimeLimit(&g_audrenIAudioRenderer, &in, (SfDispatchParams){});
 }
@@ -123,6 +123,9 @@ NX_INLINE int _bsdDispatchImpl(
     // Make a copy of the service struct, so that the compiler can assume that it won't be modified by function calls.
     Service srv = g_bsdSrv;
 
+    // Attach before building the request, as attaching may perform IPC of its own (see sessionmgrSetAutoScale).
+    int slot = sessionmgrAttachClient(&g_bsdSessionMgr);
+
     void* in = serviceMakeRequest(&srv, request_id, disp.context,
         in_data_size, disp.in_send_pid,
         disp.buffer_attrs, disp.buffers,
@@ -132,7 +135,6 @@ NX_INLINE int _bsdDispatchImpl(
     if (in_data_size)
         __builtin_memcpy(in, in_data, in_data_size);
 
-    int slot = sessionmgrAttachClient(&g_bsdSessionMgr);
     Result rc = svcSendSyncRequest(sessionmgrGetClientSession(&g_bsdSessionMgr, slot));
     sessionmgrDetachClient(&g_bsdSessionMgr, slot);
 
@@ -277,6 +279,14 @@ Service* bsdGetServiceSession(void) {
     return &g_bsdSrv;
 }
 
+Result bsdSetSessionAutoScale(u32 max_sessions) {
+    return sessionmgrSetAutoScale(&g_bsdSessionMgr, max_sessions, NX_SESSION_MGR_DEFAULT_GROW_DELAY_NS, NX_SESSION_MGR_DEFAULT_IDLE_TIMEOUT_NS);
+}
+
+void bsdGetSessionStats(SessionMgrStats *out) {
+    sessionmgrGetStats(&g_bsdSessionMgr, out);
+}
+
 int bsdSocket(int domain, int type, int protocol) {
     return _bsdCmdInDomainTypeProtocol(domain, type, protocol, 2);
 }
@@ -403,6 +413,45 @@ ssize_t bsdSend(int sockfd, const void* buf, size_t len, int flags) {
     );
 }
 
+static void _bsdSendBatchItem(void* userdata, u32 index) {
+    BsdBatchEntry *e = &((BsdBatchEntry*)userdata)[index];
+    e->ret = bsdSend(e->sockfd, e->buf, e->len, e->flags);
+    e->bsd_errno = g_bsdErrno;
+    e->result = g_bsdResult;
+}
+
+static void _bsdRecvBatchItem(void* userdata, u32 index) {
+    BsdBatchEntry *e = &((BsdBatchEntry*)userdata)[index];
+    e->ret = bsdRecv(e->sockfd, e->buf, e->len, e->flags);
+    e->bsd_errno = g_bsdErrno;
+    e->result = g_bsdResult;
+}
+
+static int _bsdRunBatch(BsdBatchEntry *entries, size_t count, SessionMgrBatchFunc func) {
+    // The number of failed entries must fit in the return value.
+    if(count > INT32_MAX) {
+        g_bsdResult = 0;
+        g_bsdErrno = EINVAL;
+        return -1;
+    }
+
+    sessionmgrRunBatch(&g_bsdSessionMgr, (u32)count, func, entries);
+
+    int num_failed = 0;
+    for (size_t i = 0; i < count; i ++)
+        if (entries[i].ret < 0)
+            num_failed ++;
+    return num_failed;
+}
+
+int bsdSendBatch(BsdBatchEntry *entries, size_t count) {
+    return _bsdRunBatch(entries, count, _bsdSendBatchItem);
+}
+
+int bsdRecvBatch(BsdBatchEntry *entries, size_t count) {
+    return _bsdRunBatch(entries, count, _bsdRecvBatchItem);
+}
+
 ssize_t bsdSendTo(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen) {
     const struct {
         int sockfd;
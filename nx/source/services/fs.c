@@ -2,10 +2,13 @@
 #include <string.h>
 #include "service_guard.h"
 #include "sf/sessionmgr.h"
+#include "sf/stub.h"
 #include "runtime/hosversion.h"
 #include "services/fs.h"
 
 __attribute__((weak)) u32 __nx_fs_num_sessions = 3;
+/// Maximum number of sessions the fs session pool may grow to under contention. 0 keeps the number of sessions fixed.
+__attribute__((weak)) u32 __nx_fs_max_sessions = 0;
 
 static Service g_fsSrv;
 static SessionMgr g_fsSessionMgr;
@@ -72,6 +75,72 @@ NX_INLINE Result _fsObjectDispatchImpl(
     _Static_assert(!(serviceMacroDetectIsPointer(_out))); \
     _fsObjectDispatchImpl((_s),(_rid),&(_in),sizeof(_in),&(_out),sizeof(_out),(SfDispatchParams){ __VA_ARGS__ }); })
 
+typedef struct {
+    u32 option;
+    u32 pad;
+    s64 offset;
+    u64 size;
+} FsFileIoIn;
+SF_STUB_CHECK_SIZE(FsFileIoIn, 0x18);
+SF_STUB_CHECK_OFFSET(FsFileIoIn, offset, 0x8);
+SF_STUB_CHECK_OFFSET(FsFileIoIn, size, 0x10);
+
+typedef struct {
+    s64 offset;
+    u64 size;
+} FsStorageIoIn;
+SF_STUB_CHECK_SIZE(FsStorageIoIn, 0x10);
+SF_STUB_CHECK_OFFSET(FsStorageIoIn, size, 0x8);
+
+typedef struct {
+    u32 op_id;
+    u32 pad;
+    s64 offset;
+    s64 size;
+} FsOperateRangeIn;
+SF_STUB_CHECK_SIZE(FsOperateRangeIn, 0x18);
+SF_STUB_CHECK_OFFSET(FsOperateRangeIn, offset, 0x8);
+SF_STUB_CHECK_OFFSET(FsOperateRangeIn, size, 0x10);
+SF_STUB_CHECK_SIZE(FsRangeInfo, 0x40);
+
+// IFile
+#define FS_FILE_CMDS(X) \
+    X(InOut, Read,         0, FsFileIoIn, u64) \
+    X(In,    Write,        1, FsFileIoIn) \
+    X(None,  Flush,        2) \
+    X(In,    SetSize,      3, s64) \
+    X(Out,   GetSize,      4, s64) \
+    X(InOut, OperateRange, 5, FsOperateRangeIn, FsRangeInfo)
+
+// IStorage
+#define FS_STORAGE_CMDS(X) \
+    X(In,    Read,         0, FsStorageIoIn) \
+    X(In,    Write,        1, FsStorageIoIn) \
+    X(None,  Flush,        2) \
+    X(In,    SetSize,      3, s64) \
+    X(Out,   GetSize,      4, s64) \
+    X(InOut, OperateRange, 5, FsOperateRangeIn, FsRangeInfo)
+
+#define _FS_FILE_STUB(...)    SF_STUB_DEFINE(_fsObjectDispatchImpl, _fsFileCmd, __VA_ARGS__)
+#define _FS_STORAGE_STUB(...) SF_STUB_DEFINE(_fsObjectDispatchImpl, _fsStorageCmd, __VA_ARGS__)
+FS_FILE_CMDS(_FS_FILE_STUB)
+FS_STORAGE_CMDS(_FS_STORAGE_STUB)
+
+typedef struct {
+    void* entries;
+    u32 priority;
+} FsBatch;
+
+static Result _fsRunBatch(void* entries, s32 count, SessionMgrBatchFunc func) {
+    if (count < 0)
+        return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+
+    // Helper threads don't inherit the caller's priority, so it is passed along explicitly.
+    FsBatch batch = { entries, g_fsPriority };
+    sessionmgrRunBatch(&g_fsSessionMgr, count, func, &batch);
+    return 0;
+}
+
 NX_GENERATE_SERVICE_GUARD(fs);
 
 Result _fsInitialize(void) {
@@ -90,6 +159,9 @@ Result _fsInitialize(void) {
     if (R_SUCCEEDED(rc))
         rc = sessionmgrCreate(&g_fsSessionMgr, g_fsSrv.session, __nx_fs_num_sessions);
 
+    if (R_SUCCEEDED(rc) && __nx_fs_max_sessions > __nx_fs_num_sessions)
+        rc = sessionmgrSetAutoScale(&g_fsSessionMgr, __nx_fs_max_sessions, NX_SESSION_MGR_DEFAULT_GROW_DELAY_NS, NX_SESSION_MGR_DEFAULT_IDLE_TIMEOUT_NS);
+
     return rc;
 }
 
@@ -105,6 +177,10 @@ Service* fsGetServiceSession(void) {
     return &g_fsSrv;
 }
 
+void fsGetSessionStats(SessionMgrStats* out) {
+    sessionmgrGetStats(&g_fsSessionMgr, out);
+}
+
 void fsSetPriority(FsPriority prio) {
     if (hosversionAtLeast(5,0,0))
         g_fsPriority = prio;
@@ -973,62 +1049,91 @@ void fsFsClose(FsFileSystem* fs) {
     _fsObjectClose(&fs->s);
 }
 
+static void _fsFsGetEntryTypeBatchItem(void* userdata, u32 index) {
+    FsBatch* batch = (FsBatch*)userdata;
+    FsFsGetEntryTypeBatchEntry* e = &((FsFsGetEntryTypeBatchEntry*)batch->entries)[index];
+    g_fsPriority = batch->priority;
+    e->result = fsFsGetEntryType(e->fs, e->path, &e->type);
+}
+
+Result fsFsGetEntryTypeBatch(FsFsGetEntryTypeBatchEntry* entries, s32 count) {
+    Result rc = _fsRunBatch(entries, count, _fsFsGetEntryTypeBatchItem);
+    for (s32 i = 0; R_SUCCEEDED(rc) && i < count; i ++)
+        rc = entries[i].result;
+    return rc;
+}
+
 //-----------------------------------------------------------------------------
 // IFile
 //-----------------------------------------------------------------------------
 
 Result fsFileRead(FsFile* f, s64 off, void* buf, u64 read_size, u32 option, u64* bytes_read) {
-    const struct {
-        u32 option;
-        u32 pad;
-        s64 offset;
-        u64 read_size;
-    } in = { option, 0, off, read_size };
+    const FsFileIoIn in = { option, 0, off, read_size };
 
-    return _fsObjectDispatchInOut(&f->s, 0, in, *bytes_read,
+    return _fsFileCmdRead(&f->s, &in, bytes_read, (SfDispatchParams){
         .buffer_attrs = { SfBufferAttr_HipcMapAlias | SfBufferAttr_Out | SfBufferAttr_HipcMapTransferAllowsNonSecure },
         .buffers = { { buf, read_size } },
-    );
+    });
+}
+
+static void _fsFileReadBatchItem(void* userdata, u32 index) {
+    FsBatch* batch = (FsBatch*)userdata;
+    FsFileReadBatchEntry* e = &((FsFileReadBatchEntry*)batch->entries)[index];
+    g_fsPriority = batch->priority;
+    e->bytes_read = 0;
+    e->result = fsFileRead(e->f, e->offset, e->buf, e->read_size, e->option, &e->bytes_read);
+}
+
+Result fsFileReadBatch(FsFileReadBatchEntry* entries, s32 count) {
+    Result rc = _fsRunBatch(entries, count, _fsFileReadBatchItem);
+    for (s32 i = 0; R_SUCCEEDED(rc) && i < count; i ++)
+        rc = entries[i].result;
+    return rc;
+}
+
+Result fsFileReadAsync(FsFile* f, s64 off, void* buf, u64 read_size, u32 option, void* msg_buf, size_t msg_buf_size, Handle* out_event) {
+    const FsFileIoIn in = { option, 0, off, read_size };
+
+    // Nothing blocks while the request is in flight, so it can go straight to the root session instead of claiming one from the pool.
+    return serviceDispatchAsyncImpl(&f->s, 0, &in, sizeof(in), msg_buf, msg_buf_size, (SfDispatchParams){
+        .context = g_fsPriority,
+        .buffer_attrs = { SfBufferAttr_HipcMapAlias | SfBufferAttr_Out | SfBufferAttr_HipcMapTransferAllowsNonSecure },
+        .buffers = { { buf, read_size } },
+    }, out_event);
+}
+
+Result fsFileReadAsyncGetResult(FsFile* f, void* msg_buf, u64* bytes_read) {
+    return serviceParseAsyncResponseOut(&f->s, msg_buf, *bytes_read);
 }
 
 Result fsFileWrite(FsFile* f, s64 off, const void* buf, u64 write_size, u32 option) {
-    const struct {
-        u32 option;
-        u32 pad;
-        s64 offset;
-        u64 write_size;
-    } in = { option, 0, off, write_size };
+    const FsFileIoIn in = { option, 0, off, write_size };
 
-    return _fsObjectDispatchIn(&f->s, 1, in,
+    return _fsFileCmdWrite(&f->s, &in, (SfDispatchParams){
         .buffer_attrs = { SfBufferAttr_HipcMapAlias | SfBufferAttr_In | SfBufferAttr_HipcMapTransferAllowsNonSecure },
         .buffers = { { buf, write_size } },
-    );
+    });
 }
 
 Result fsFileFlush(FsFile* f) {
-    return _fsCmdNoIO(&f->s, 2);
+    return _fsFileCmdFlush(&f->s, (SfDispatchParams){});
 }
 
 Result fsFileSetSize(FsFile* f, s64 sz) {
-    return _fsObjectDispatchIn(&f->s, 3, sz);
+    return _fsFileCmdSetSize(&f->s, &sz, (SfDispatchParams){});
 }
 
 Result fsFileGetSize(FsFile* f, s64* out) {
-    return _fsObjectDispatchOut(&f->s, 4, *out);
+    return _fsFileCmdGetSize(&f->s, out, (SfDispatchParams){});
 }
 
 Result fsFileOperateRange(FsFile* f, FsOperationId op_id, s64 off, s64 len, FsRangeInfo* out) {
     if (hosversionBefore(4,0,0))
         return MAKERESULT(Module_Libnx, LibnxError_IncompatSysVer);
 
-    const struct {
-        u32 op_id;
-        u32 pad;
-        s64 off;
-        s64 len;
-    } in = { op_id, 0, off, len };
+    const FsOperateRangeIn in = { op_id, 0, off, len };
 
-    return _fsObjectDispatchInOut(&f->s, 5, in, *out);
+    return _fsFileCmdOperateRange(&f->s, &in, out, (SfDispatchParams){});
 }
 
 void fsFileClose(FsFile* f) {
@@ -1056,53 +1161,42 @@ Result fsDirGetEntryCount(FsDir* d, s64* count) {
 //-----------------------------------------------------------------------------
 
 Result fsStorageRead(FsStorage* s, s64 off, void* buf, u64 read_size) {
-    const struct {
-        s64 offset;
-        u64 read_size;
-    } in = { off, read_size };
+    const FsStorageIoIn in = { off, read_size };
 
-    return _fsObjectDispatchIn(&s->s, 0, in,
+    return _fsStorageCmdRead(&s->s, &in, (SfDispatchParams){
         .buffer_attrs = { SfBufferAttr_HipcMapAlias | SfBufferAttr_Out | SfBufferAttr_HipcMapTransferAllowsNonSecure },
         .buffers = { { buf, read_size } },
-    );
+    });
 }
 
 Result fsStorageWrite(FsStorage* s, s64 off, const void* buf, u64 write_size) {
-    const struct {
-        s64 offset;
-        u64 write_size;
-    } in = { off, write_size };
+    const FsStorageIoIn in = { off, write_size };
 
-    return _fsObjectDispatchIn(&s->s, 1, in,
+    return _fsStorageCmdWrite(&s->s, &in, (SfDispatchParams){
         .buffer_attrs = { SfBufferAttr_HipcMapAlias | SfBufferAttr_In | SfBufferAttr_HipcMapTransferAllowsNonSecure },
         .buffers = { { buf, write_size } },
-    );
+    });
 }
 
 Result fsStorageFlush(FsStorage* s) {
-    return _fsCmdNoIO(&s->s, 2);
+    return _fsStorageCmdFlush(&s->s, (SfDispatchParams){});
 }
 
 Result fsStorageSetSize(FsStorage* s, s64 sz) {
-    return _fsObjectDispatchIn(&s->s, 3, sz);
+    return _fsStorageCmdSetSize(&s->s, &sz, (SfDispatchParams){});
 }
 
 Result fsStorageGetSize(FsStorage* s, s64* out) {
-    return _fsObjectDispatchOut(&s->s, 4, *out);
+    return _fsStorageCmdGetSize(&s->s, out, (SfDispatchParams){});
 }
 
 Result fsStorageOperateRange(FsStorage* s, FsOperationId op_id, s64 off, s64 len, FsRangeInfo* out) {
     if (hosversionBefore(4,0,0))
         return MAKERESULT(Module_Libnx, LibnxError_IncompatSysVer);
 
-    const struct {
-        u32 op_id;
-        u32 pad;
-        s64 off;
-        s64 len;
-    } in = { op_id, 0, off, len };
+    const FsOperateRangeIn in = { op_id, 0, off, len };
 
-    return _fsObjectDispatchInOut(&s->s, 5, in, *out);
+    return _fsStorageCmdOperateRange(&s->s, &in, out, (SfDispatchParams){});
 }
 
 void fsStorageClose(FsStorage* s) {
@@ -6,6 +6,7 @@
 #include "kernel/shmem.h"
 #include "kernel/mutex.h"
 #include "kernel/rwlock.h"
+#include "sf/stub.h"
 #include "services/applet.h"
 #include "services/hid.h"
 #include "runtime/hosversion.h"
@@ -735,25 +736,6 @@ static Result _hidCmdInU32U32AruidNoOut(u32 val0, u32 val1, u32 cmd_id) {
     );
 }
 
-static Result _hidCmdInU32AruidOutU8(u32 inval, u8 *out, u32 cmd_id) {
-    const struct {
-        u32 inval;
-        u32 pad;
-        u64 AppletResourceUserId;
-    } in = { inval, 0, appletGetAppletResourceUserId() };
-
-    return serviceDispatchInOut(&g_hidSrv, cmd_id, in, *out,
-        .in_send_pid = true,
-    );
-}
-
-static Result _hidCmdInU32AruidOutBool(u32 inval, bool *out, u32 cmd_id) {
-    u8 tmp=0;
-    Result rc = _hidCmdInU32AruidOutU8(inval, &tmp, cmd_id);
-    if (R_SUCCEEDED(rc) && out) *out = tmp & 1;
-    return rc;
-}
-
 static Result _hidCmdInU32AruidOutU64(u32 inval, u64 *out, u32 cmd_id) {
     const struct {
         u32 inval;
@@ -797,6 +779,81 @@ static Result _hidCmdNoInOutU64(u64 *out, u32 cmd_id) {
     return serviceDispatchOut(&g_hidSrv, cmd_id, *out);
 }
 
+typedef struct {
+    HidSixAxisSensorHandle handle;
+    u32 pad;
+    u64 AppletResourceUserId;
+} HidSixAxisSensorIn;
+SF_STUB_CHECK_SIZE(HidSixAxisSensorIn, 0x10);
+SF_STUB_CHECK_OFFSET(HidSixAxisSensorIn, AppletResourceUserId, 0x8);
+
+typedef struct {
+    u8 flag;
+    u8 pad[3];
+    HidSixAxisSensorHandle handle;
+    u64 AppletResourceUserId;
+} HidEnableSixAxisSensorFusionIn;
+SF_STUB_CHECK_SIZE(HidEnableSixAxisSensorFusionIn, 0x10);
+SF_STUB_CHECK_OFFSET(HidEnableSixAxisSensorFusionIn, handle, 0x4);
+SF_STUB_CHECK_OFFSET(HidEnableSixAxisSensorFusionIn, AppletResourceUserId, 0x8);
+
+typedef struct {
+    float unk0;
+    float unk1;
+} HidSixAxisSensorFusionParameters;
+SF_STUB_CHECK_SIZE(HidSixAxisSensorFusionParameters, 0x8);
+SF_STUB_CHECK_OFFSET(HidSixAxisSensorFusionParameters, unk1, 0x4);
+
+typedef struct {
+    HidSixAxisSensorHandle handle;
+    HidSixAxisSensorFusionParameters params;
+    u32 pad;
+    u64 AppletResourceUserId;
+} HidSetSixAxisSensorFusionParametersIn;
+SF_STUB_CHECK_SIZE(HidSetSixAxisSensorFusionParametersIn, 0x18);
+SF_STUB_CHECK_OFFSET(HidSetSixAxisSensorFusionParametersIn, params, 0x4);
+SF_STUB_CHECK_OFFSET(HidSetSixAxisSensorFusionParametersIn, AppletResourceUserId, 0x10);
+
+typedef struct {
+    HidSixAxisSensorHandle handle;
+    u32 mode;
+    u64 AppletResourceUserId;
+} HidSetGyroscopeZeroDriftModeIn;
+SF_STUB_CHECK_SIZE(HidSetGyroscopeZeroDriftModeIn, 0x10);
+SF_STUB_CHECK_OFFSET(HidSetGyroscopeZeroDriftModeIn, mode, 0x4);
+SF_STUB_CHECK_OFFSET(HidSetGyroscopeZeroDriftModeIn, AppletResourceUserId, 0x8);
+
+// IHidServer, SixAxisSensor commands
+#define HID_SIX_AXIS_SENSOR_CMDS(X) \
+    X(In,    StartSixAxisSensor,                       66, HidSixAxisSensorIn) \
+    X(In,    StopSixAxisSensor,                        67, HidSixAxisSensorIn) \
+    X(InOut, IsSixAxisSensorFusionEnabled,             68, HidSixAxisSensorIn, u8) \
+    X(In,    EnableSixAxisSensorFusion,                69, HidEnableSixAxisSensorFusionIn) \
+    X(In,    SetSixAxisSensorFusionParameters,         70, HidSetSixAxisSensorFusionParametersIn) \
+    X(InOut, GetSixAxisSensorFusionParameters,         71, HidSixAxisSensorIn, HidSixAxisSensorFusionParameters) \
+    X(In,    ResetSixAxisSensorFusionParameters,       72, HidSixAxisSensorIn) \
+    X(In,    SetGyroscopeZeroDriftMode,                79, HidSetGyroscopeZeroDriftModeIn) \
+    X(InOut, GetGyroscopeZeroDriftMode,                80, HidSixAxisSensorIn, u32) \
+    X(In,    ResetGyroscopeZeroDriftMode,              81, HidSixAxisSensorIn) \
+    X(InOut, IsSixAxisSensorAtRest,                    82, HidSixAxisSensorIn, u8) \
+    X(InOut, IsFirmwareUpdateAvailableForSixAxisSensor, 83, HidSixAxisSensorIn, u8)
+
+#define _HID_STUB(...) SF_STUB_DEFINE(serviceDispatchImpl, _hidCmd, __VA_ARGS__)
+HID_SIX_AXIS_SENSOR_CMDS(_HID_STUB)
+
+static Result _hidSixAxisSensorCmdInNoOut(HidSixAxisSensorHandle handle, Result (*cmd)(Service*, const HidSixAxisSensorIn*, SfDispatchParams)) {
+    const HidSixAxisSensorIn in = { handle, 0, appletGetAppletResourceUserId() };
+    return cmd(&g_hidSrv, &in, (SfDispatchParams){ .in_send_pid = true });
+}
+
+static Result _hidSixAxisSensorCmdInOutBool(HidSixAxisSensorHandle handle, bool *out, Result (*cmd)(Service*, const HidSixAxisSensorIn*, u8*, SfDispatchParams)) {
+    const HidSixAxisSensorIn in = { handle, 0, appletGetAppletResourceUserId() };
+    u8 tmp=0;
+    Result rc = cmd(&g_hidSrv, &in, &tmp, (SfDispatchParams){ .in_send_pid = true });
+    if (R_SUCCEEDED(rc) && out) *out = tmp & 1;
+    return rc;
+}
+
 static Result _hidCreateAppletResource(Service* srv, Service* srv_out) {
     u64 AppletResourceUserId = appletGetAppletResourceUserId();
 
@@ -835,106 +892,84 @@ Result hidGetSixAxisSensorHandles(HidSixAxisSensorHandle *handles, s32 total_han
 }
 
 Result hidStartSixAxisSensor(HidSixAxisSensorHandle handle) {
-    return _hidCmdInU32AruidNoOut(handle.type_value, 66);
+    return _hidSixAxisSensorCmdInNoOut(handle, _hidCmdStartSixAxisSensor);
 }
 
 Result hidStopSixAxisSensor(HidSixAxisSensorHandle handle) {
-    return _hidCmdInU32AruidNoOut(handle.type_value, 67);
+    return _hidSixAxisSensorCmdInNoOut(handle, _hidCmdStopSixAxisSensor);
 }
 
 Result hidIsSixAxisSensorFusionEnabled(HidSixAxisSensorHandle handle, bool *out) {
-    return _hidCmdInU32AruidOutBool(handle.type_value, out, 68);
+    return _hidSixAxisSensorCmdInOutBool(handle, out, _hidCmdIsSixAxisSensorFusionEnabled);
 }
 
 Result hidEnableSixAxisSensorFusion(HidSixAxisSensorHandle handle, bool flag) {
-    return _hidCmdInBoolU32AruidNoOut(flag, handle.type_value, 69);
+    const HidEnableSixAxisSensorFusionIn in = { flag!=0, {0}, handle, appletGetAppletResourceUserId() };
+
+    return _hidCmdEnableSixAxisSensorFusion(&g_hidSrv, &in, (SfDispatchParams){
+        .in_send_pid = true,
+    });
 }
 
 Result hidSetSixAxisSensorFusionParameters(HidSixAxisSensorHandle handle, float unk0, float unk1) {
     if (unk0 < 0.0f || unk0 > 1.0f)
         return MAKERESULT(Module_Libnx, LibnxError_BadInput);
 
-    const struct {
-        HidSixAxisSensorHandle handle;
-        float unk0;
-        float unk1;
-        u32 pad;
-        u64 AppletResourceUserId;
-    } in = { handle, unk0, unk1, 0, appletGetAppletResourceUserId() };
+    const HidSetSixAxisSensorFusionParametersIn in = { handle, { unk0, unk1 }, 0, appletGetAppletResourceUserId() };
 
-    return serviceDispatchIn(&g_hidSrv, 70, in,
+    return _hidCmdSetSixAxisSensorFusionParameters(&g_hidSrv, &in, (SfDispatchParams){
         .in_send_pid = true,
-    );
+    });
 }
 
 Result hidGetSixAxisSensorFusionParameters(HidSixAxisSensorHandle handle, float *unk0, float *unk1) {
-    Result rc;
-
-    const struct {
-        HidSixAxisSensorHandle handle;
-        u32 pad;
-        u64 AppletResourceUserId;
-    } in = { handle, 0, appletGetAppletResourceUserId() };
-
-    struct {
-        float unk0;
-        float unk1;
-    } out;
+    const HidSixAxisSensorIn in = { handle, 0, appletGetAppletResourceUserId() };
+    HidSixAxisSensorFusionParameters out;
 
-    rc = serviceDispatchInOut(&g_hidSrv, 71, in, out,
+    Result rc = _hidCmdGetSixAxisSensorFusionParameters(&g_hidSrv, &in, &out, (SfDispatchParams){
         .in_send_pid = true,
-    );
+    });
     if (R_SUCCEEDED(rc) && unk0) *unk0 = out.unk0;
     if (R_SUCCEEDED(rc) && unk1) *unk1 = out.unk1;
     return rc;
 }
 
 Result hidResetSixAxisSensorFusionParameters(HidSixAxisSensorHandle handle) {
-    return _hidCmdInU32AruidNoOut(handle.type_value, 72);
+    return _hidSixAxisSensorCmdInNoOut(handle, _hidCmdResetSixAxisSensorFusionParameters);
 }
 
 Result hidSetGyroscopeZeroDriftMode(HidSixAxisSensorHandle handle, HidGyroscopeZeroDriftMode mode) {
-    const struct {
-        HidSixAxisSensorHandle handle;
-        u32 mode;
-        u64 AppletResourceUserId;
-    } in = { handle, mode, appletGetAppletResourceUserId() };
+    const HidSetGyroscopeZeroDriftModeIn in = { handle, mode, appletGetAppletResourceUserId() };
 
-    return serviceDispatchIn(&g_hidSrv, 79, in,
+    return _hidCmdSetGyroscopeZeroDriftMode(&g_hidSrv, &in, (SfDispatchParams){
         .in_send_pid = true,
-    );
+    });
 }
 
 Result hidGetGyroscopeZeroDriftMode(HidSixAxisSensorHandle handle, HidGyroscopeZeroDriftMode *mode) {
-    Result rc;
-
-    const struct {
-        HidSixAxisSensorHandle handle;
-        u32 pad;
-        u64 AppletResourceUserId;
-    } in = { handle, 0, appletGetAppletResourceUserId() };
+    const HidSixAxisSensorIn in = { handle, 0, appletGetAppletResourceUserId() };
 
     u32 tmp=0;
-    rc = serviceDispatchInOut(&g_hidSrv, 80, in, tmp,
+    Result rc = _hidCmdGetGyroscopeZeroDriftMode(&g_hidSrv, &in, &tmp, (SfDispatchParams){
         .in_send_pid = true,
-    );
+    });
     if (R_SUCCEEDED(rc) && mode) *mode = tmp;
     return rc;
 }
 
 Result hidResetGyroscopeZeroDriftMode(HidSixAxisSensorHandle handle) {
-    return _hidCmdInU32AruidNoOut(handle.type_value, 81);
+    return _hidSixAxisSensorCmdInNoOut(handle, _hidCmdResetGyroscopeZeroDriftMode);
 }
 
 Result hidIsSixAxisSensorAtRest(HidSixAxisSensorHandle handle, bool *out) {
-    return _hidCmdInU32AruidOutBool(handle.type_value, out, 82);
+    return _hidSixAxisSensorCmdInOutBool(handle, out, _hidCmdIsSixAxisSensorAtRest);
 }
 
 Result hidIsFirmwareUpdateAvailableForSixAxisSensor(HidSixAxisSensorHandle handle, bool *out) {
     if (hosversionBefore(6,0,0))
         return MAKERESULT(Module_Libnx, LibnxError_IncompatSysVer);
 
-    return _hidCmdInU32AruidOutBool(handle.type_value, out, 83);
+    return _hidSixAxisSensorCmdInOutBool(handle, out, _hidCmdIsFirmwareUpdateAvailableForSixAxisSensor);
 }
 
 static Result _hidActivateGesture(void) {
@@ -1,6 +1,7 @@
 #define NX_SERVICE_ASSUME_NON_DOMAIN
 #include <string.h>
 #include "service_guard.h"
+#include "kernel/tmemcache.h"
 #include "services/hwopus.h"
 #include "runtime/hosversion.h"
 
@@ -27,11 +28,11 @@ Result hwopusDecoderInitialize(HwopusDecoder* decoder, s32 SampleRate, s32 Chann
         rc = _hwopusGetWorkBufferSize(&hwopusMgrSrv, &size, SampleRate, ChannelCount);
         if (R_SUCCEEDED(rc)) size = (size + 0xfff) & ~0xfff;
 
-        if (R_SUCCEEDED(rc)) rc = tmemCreate(&decoder->tmem, size, Perm_None);
+        if (R_SUCCEEDED(rc)) rc = tmemcacheAcquire(&decoder->tmem, NULL, size, Perm_None);
 
         if (R_SUCCEEDED(rc)) {
             rc = _hwopusInitialize(&hwopusMgrSrv, &decoder->s, &decoder->tmem, SampleRate, ChannelCount);
-            if (R_FAILED(rc)) tmemClose(&decoder->tmem);
+            if (R_FAILED(rc)) tmemcacheRelease(&decoder->tmem);
         }
 
         serviceClose(&hwopusMgrSrv);
@@ -68,13 +69,13 @@ Result hwopusDecoderMultistreamInitialize(HwopusDecoder* decoder, s32 SampleRate
         rc = _hwopusGetWorkBufferSizeForMultiStream(&hwopusMgrSrv, &size, &state);
         if (R_SUCCEEDED(rc)) size = (size + 0xfff) & ~0xfff;
 
-        if (R_SUCCEEDED(rc)) rc = tmemCreate(&decoder->tmem, size, Perm_None);
+        if (R_SUCCEEDED(rc)) rc = tmemcacheAcquire(&decoder->tmem, NULL, size, Perm_None);
 
         if (R_SUCCEEDED(rc)) {
             memcpy(state.channel_mapping, channel_mapping, ChannelCount);
 
             rc = _hwopusOpenHardwareOpusDecoderForMultiStream(&hwopusMgrSrv, &decoder->s, &decoder->tmem, &state);
-            if (R_FAILED(rc)) tmemClose(&decoder->tmem);
+            if (R_FAILED(rc)) tmemcacheRelease(&decoder->tmem);
         }
 
         serviceClose(&hwopusMgrSrv);
@@ -85,7 +86,7 @@ Result hwopusDecoderMultistreamInitialize(HwopusDecoder* decoder, s32 SampleRate
 
 void hwopusDecoderExit(HwopusDecoder* decoder) {
     serviceClose(&decoder->s);
-    tmemClose(&decoder->tmem);
+    tmemcacheRelease(&decoder->tmem);
 }
 
 static Result _hwopusInitialize(Service* srv, Service* srv_out, TransferMemory *tmem, s32 SampleRate, s32 ChannelCount) {
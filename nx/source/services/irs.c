@@ -5,6 +5,7 @@
 #include "runtime/hosversion.h"
 #include "kernel/shmem.h"
 #include "kernel/tmem.h"
+#include "kernel/tmemcache.h"
 #include "services/applet.h"
 #include "services/irs.h"
 #include "applets/hid_la.h"
@@ -149,7 +150,7 @@ static Result _irsCameraEntryGet(IrsIrCameraHandle handle, IrsCameraEntry **out_
 }
 
 static void _irsCameraEntryFree(IrsCameraEntry *entry) {
-    tmemClose(&entry->transfermem);
+    tmemcacheRelease(&entry->transfermem);
 }
 
 static bool _irsGetIrSensorAruidStatus(u32 *out) {
@@ -876,7 +877,7 @@ Result irsRunImageTransferProcessor(IrsIrCameraHandle handle, const IrsImageTran
     }
 
     if (R_SUCCEEDED(rc)) {
-        rc = tmemCreate(&entry->transfermem, size, Perm_None);
+        rc = tmemcacheAcquire(&entry->transfermem, NULL, size, Perm_None);
         if (R_FAILED(rc)) return rc;
 
         rc = _irsRunImageTransferProcessor(handle, &packed_config, &entry->transfermem);
@@ -925,7 +926,7 @@ Result irsRunImageTransferExProcessor(IrsIrCameraHandle handle, const IrsImageTr
     }
 
     if (R_SUCCEEDED(rc)) {
-        rc = tmemCreate(&entry->transfermem, size, Perm_None);
+        rc = tmemcacheAcquire(&entry->transfermem, NULL, size, Perm_None);
         if (R_FAILED(rc)) return rc;
 
         rc = _irsRunImageTransferExProcessor(handle, &packed_config, &entry->transfermem);
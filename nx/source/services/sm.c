@@ -96,6 +96,9 @@ Result smGetServiceWrapper(Service* service_out, SmServiceName name) {
     if (R_SUCCEEDED(rc)) {
         serviceCreate(service_out, handle);
         service_out->own_handle = own_handle;
+#if defined(NX_SERVICE_TRACE)
+        sftraceRegisterName(handle, name.name);
+#endif
     }
 
     return rc;
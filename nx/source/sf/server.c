@@ -0,0 +1,694 @@
+#include <string.h>
+#include "result.h"
+#include "arm/tls.h"
+#include "kernel/svc.h"
+#include "kernel/wait.h"
+#include "sf/service.h"
+#include "sf/server.h"
+#include "../runtime/alloc.h"
+
+struct SfServerDomain {
+    Mutex mutex;
+    u32 refcount;
+    SfServerObject* objects[SF_SERVER_MAX_DOMAIN_OBJECTS];
+};
+
+enum {
+    SfServerControl_ConvertCurrentObjectToDomain = 0,
+    SfServerControl_CopyFromCurrentDomain        = 1,
+    SfServerControl_CloneCurrentObject           = 2,
+    SfServerControl_QueryPointerBufferSize       = 3,
+    SfServerControl_CloneCurrentObjectEx         = 4,
+};
+
+static SfServerObject* _sfServerDomainGet(SfServerDomain* domain, u32 object_id)
+{
+    SfServerObject* obj = NULL;
+    mutexLock(&domain->mutex);
+    if (object_id >= 1 && object_id <= SF_SERVER_MAX_DOMAIN_OBJECTS) {
+        obj = domain->objects[object_id-1];
+        if (obj)
+            sfServerObjectRetain(obj);
+    }
+    mutexUnlock(&domain->mutex);
+    return obj;
+}
+
+static u32 _sfServerDomainInsert(SfServerDomain* domain, SfServerObject* obj)
+{
+    u32 object_id = 0;
+    mutexLock(&domain->mutex);
+    for (u32 i = 0; i < SF_SERVER_MAX_DOMAIN_OBJECTS; i ++) {
+        if (!domain->objects[i]) {
+            domain->objects[i] = obj;
+            object_id = i+1;
+            break;
+        }
+    }
+    mutexUnlock(&domain->mutex);
+    return object_id;
+}
+
+static SfServerObject* _sfServerDomainRemove(SfServerDomain* domain, u32 object_id)
+{
+    SfServerObject* obj = NULL;
+    mutexLock(&domain->mutex);
+    if (object_id >= 1 && object_id <= SF_SERVER_MAX_DOMAIN_OBJECTS) {
+        obj = domain->objects[object_id-1];
+        domain->objects[object_id-1] = NULL;
+    }
+    mutexUnlock(&domain->mutex);
+    return obj;
+}
+
+static void _sfServerDomainRelease(SfServerDomain* domain)
+{
+    if (__atomic_sub_fetch(&domain->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    for (u32 i = 0; i < SF_SERVER_MAX_DOMAIN_OBJECTS; i ++)
+        if (domain->objects[i])
+            sfServerObjectRelease(domain->objects[i]);
+
+    __libnx_free(domain);
+}
+
+static Result _sfServerSessionCreate(SfServer* srv, Handle handle, SfServerObject* obj, SfServerDomain* domain)
+{
+    // The session takes ownership of the handle and of the object/domain references, even on failure.
+    Result rc = 0;
+    SfServerSession* session = (SfServerSession*)__libnx_alloc(sizeof(SfServerSession) + srv->pointer_buffer_size);
+    if (!session)
+        rc = MAKERESULT(Module_Libnx, LibnxError_OutOfMemory);
+
+    if (R_SUCCEEDED(rc)) {
+        *session = (SfServerSession){
+            .server = srv,
+            .handle = handle,
+            .object = obj,
+            .domain = domain,
+            .pointer_buffer = srv->pointer_buffer_size ? session+1 : NULL,
+        };
+
+        mutexLock(&srv->mutex);
+        if (srv->num_sessions < SF_SERVER_MAX_SESSIONS)
+            srv->sessions[srv->num_sessions++] = session;
+        else
+            rc = MAKERESULT(Module_Libnx, LibnxError_ServerFull);
+        mutexUnlock(&srv->mutex);
+
+        if (R_FAILED(rc))
+            __libnx_free(session);
+    }
+
+    if (R_FAILED(rc)) {
+        svcCloseHandle(handle);
+        if (obj)
+            sfServerObjectRelease(obj);
+        if (domain)
+            _sfServerDomainRelease(domain);
+        return rc;
+    }
+
+    ueventSignal(&srv->wakeup);
+    return 0;
+}
+
+static void _sfServerSessionDestroy(SfServerSession* session)
+{
+    SfServer* srv = session->server;
+
+    mutexLock(&srv->mutex);
+    for (u32 i = 0; i < srv->num_sessions; i ++) {
+        if (srv->sessions[i] == session) {
+            srv->sessions[i] = srv->sessions[--srv->num_sessions];
+            break;
+        }
+    }
+    mutexUnlock(&srv->mutex);
+
+    svcCloseHandle(session->handle);
+    if (session->object)
+        sfServerObjectRelease(session->object);
+    if (session->domain)
+        _sfServerDomainRelease(session->domain);
+    __libnx_free(session);
+}
+
+void* sfServerRequestGetBuffer(const SfServerRequest* req, u32 type, u32 index, size_t* out_size)
+{
+    const HipcBufferDescriptor* descs;
+    u32 num_descs;
+
+    const bool is_in  = (type & SfBufferAttr_In)  != 0;
+    const bool is_out = (type & SfBufferAttr_Out) != 0;
+    if (is_in && is_out) {
+        descs = req->hipc.data.exch_buffers;
+        num_descs = req->hipc.meta.num_exch_buffers;
+    } else if (is_in) {
+        descs = req->hipc.data.send_buffers;
+        num_descs = req->hipc.meta.num_send_buffers;
+    } else {
+        descs = req->hipc.data.recv_buffers;
+        num_descs = req->hipc.meta.num_recv_buffers;
+    }
+
+    if (index >= num_descs)
+        return NULL;
+
+    if (out_size)
+        *out_size = hipcGetBufferSize(&descs[index]);
+    return hipcGetBufferAddress(&descs[index]);
+}
+
+const void* sfServerRequestGetInPointer(const SfServerRequest* req, u32 index, size_t* out_size)
+{
+    if (index >= req->hipc.meta.num_send_statics)
+        return NULL;
+
+    if (out_size)
+        *out_size = hipcGetStaticSize(&req->hipc.data.send_statics[index]);
+    return hipcGetStaticAddress(&req->hipc.data.send_statics[index]);
+}
+
+static Result _sfServerParseInHeader(SfServerRequest* req, const void* start, u32 size)
+{
+    CmifInHeader hdr;
+    if (size < sizeof(hdr))
+        return MAKERESULT(Module_Libnx, LibnxError_InvalidCmifInHeader);
+
+    memcpy(&hdr, start, sizeof(hdr));
+    if (hdr.magic != CMIF_IN_HEADER_MAGIC)
+        return MAKERESULT(Module_Libnx, LibnxError_InvalidCmifInHeader);
+
+    req->command_id = hdr.command_id;
+    if (!req->token)
+        req->token = hdr.token;
+    req->in_data = (const u8*)start + sizeof(hdr);
+    req->in_data_size = size - sizeof(hdr);
+    return 0;
+}
+
+static Result _sfServerDispatch(SfServerObject* obj, SfServerRequest* req)
+{
+    const SfServerInterface* iface = obj->iface;
+    for (u32 i = 0; i < iface->num_commands; i ++)
+        if (iface->commands[i].command_id == req->command_id)
+            return iface->commands[i].handler(obj, req);
+
+    return MAKERESULT(Module_Libnx, LibnxError_CmifCommandNotFound);
+}
+
+static Result _sfServerHandleRequest(SfServerSession* session, void* msg, SfServerRequest* req)
+{
+    u8* start = (u8*)cmifGetAlignedDataStart(req->hipc.data.data_words, msg);
+    u8* end = (u8*)(req->hipc.data.data_words + req->hipc.meta.num_data_words);
+    if (start > end)
+        return MAKERESULT(Module_Libnx, LibnxError_InvalidCmifInHeader);
+    u32 size = end - start;
+
+    if (!session->domain) {
+        Result rc = _sfServerParseInHeader(req, start, size);
+        if (R_SUCCEEDED(rc))
+            rc = _sfServerDispatch(session->object, req);
+        return rc;
+    }
+
+    CmifDomainInHeader dhdr;
+    if (size < sizeof(dhdr))
+        return MAKERESULT(Module_Libnx, LibnxError_InvalidCmifInHeader);
+    memcpy(&dhdr, start, sizeof(dhdr));
+    start += sizeof(dhdr);
+    size -= sizeof(dhdr);
+    req->token = dhdr.token;
+
+    if (dhdr.type == CmifDomainRequestType_Close) {
+        SfServerObject* obj = _sfServerDomainRemove(session->domain, dhdr.object_id);
+        if (!obj)
+            return MAKERESULT(Module_Libnx, LibnxError_DomainObjectNotFound);
+        sfServerObjectRelease(obj);
+        return 0;
+    }
+
+    if (dhdr.type != CmifDomainRequestType_SendMessage)
+        return MAKERESULT(Module_Libnx, LibnxError_DomainMessageUnknownType);
+    if (dhdr.num_in_objects > 8)
+        return MAKERESULT(Module_Libnx, LibnxError_DomainMessageTooManyObjectIds);
+    if (dhdr.data_size + dhdr.num_in_objects*sizeof(u32) > size)
+        return MAKERESULT(Module_Libnx, LibnxError_InvalidCmifInHeader);
+
+    SfServerObject* target = _sfServerDomainGet(session->domain, dhdr.object_id);
+    if (!target)
+        return MAKERESULT(Module_Libnx, LibnxError_DomainObjectNotFound);
+
+    Result rc = _sfServerParseInHeader(req, start, dhdr.data_size);
+    for (u32 i = 0; R_SUCCEEDED(rc) && i < dhdr.num_in_objects; i ++) {
+        u32 object_id;
+        memcpy(&object_id, start + dhdr.data_size + i*sizeof(u32), sizeof(u32));
+        req->in_objects[i] = _sfServerDomainGet(session->domain, object_id);
+        if (!req->in_objects[i])
+            rc = MAKERESULT(Module_Libnx, LibnxError_DomainObjectNotFound);
+        else
+            req->num_in_objects = i+1;
+    }
+
+    if (R_SUCCEEDED(rc))
+        rc = _sfServerDispatch(target, req);
+
+    for (u32 i = 0; i < req->num_in_objects; i ++)
+        sfServerObjectRelease(req->in_objects[i]);
+    sfServerObjectRelease(target);
+    return rc;
+}
+
+static Result _sfServerClone(SfServerSession* session, SfServerRequest* req)
+{
+    Handle server_handle, client_handle;
+    Result rc = svcCreateSession(&server_handle, &client_handle, 0, 0);
+    if (R_FAILED(rc))
+        return rc;
+
+    // Clones of a domain session share the domain.
+    SfServerObject* obj = session->object ? sfServerObjectRetain(session->object) : NULL;
+    SfServerDomain* domain = session->domain;
+    if (domain)
+        __atomic_add_fetch(&domain->refcount, 1, __ATOMIC_RELAXED);
+
+    rc = _sfServerSessionCreate(session->server, server_handle, obj, domain);
+    if (R_FAILED(rc)) {
+        svcCloseHandle(client_handle);
+        return rc;
+    }
+
+    sfServerRequestAddOutMoveHandle(req, client_handle);
+    return 0;
+}
+
+static Result _sfServerHandleControl(SfServerSession* session, void* msg, SfServerRequest* req)
+{
+    u8* start = (u8*)cmifGetAlignedDataStart(req->hipc.data.data_words, msg);
+    u8* end = (u8*)(req->hipc.data.data_words + req->hipc.meta.num_data_words);
+    if (start > end)
+        return MAKERESULT(Module_Libnx, LibnxError_InvalidCmifInHeader);
+
+    Result rc = _sfServerParseInHeader(req, start, end - start);
+    if (R_FAILED(rc))
+        return rc;
+
+    switch (req->command_id) {
+        case SfServerControl_ConvertCurrentObjectToDomain: {
+            if (session->domain)
+                return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+
+            SfServerDomain* domain = (SfServerDomain*)__libnx_alloc(sizeof(SfServerDomain));
+            if (!domain)
+                return MAKERESULT(Module_Libnx, LibnxError_OutOfMemory);
+
+            memset(domain, 0, sizeof(*domain));
+            mutexInit(&domain->mutex);
+            domain->refcount = 1;
+            domain->objects[0] = session->object;
+            session->object = NULL;
+            session->domain = domain;
+
+            *(u32*)sfServerRequestSetOutData(req, sizeof(u32)) = 1;
+            return 0;
+        }
+
+        case SfServerControl_CloneCurrentObject:
+        case SfServerControl_CloneCurrentObjectEx:
+            return _sfServerClone(session, req);
+
+        case SfServerControl_QueryPointerBufferSize:
+            *(u16*)sfServerRequestSetOutData(req, sizeof(u16)) = session->server->pointer_buffer_size;
+            return 0;
+
+        default:
+            return MAKERESULT(Module_Libnx, LibnxError_CmifCommandNotFound);
+    }
+}
+
+static void _sfServerDiscardOutput(SfServerRequest* req)
+{
+    for (u32 i = 0; i < req->num_out_objects; i ++)
+        sfServerObjectRelease(req->out_objects[i]);
+    for (u32 i = 0; i < req->num_out_move_handles; i ++)
+        svcCloseHandle(req->out_move_handles[i]);
+
+    req->out_data_size = 0;
+    req->num_out_objects = 0;
+    req->num_out_copy_handles = 0;
+    req->num_out_move_handles = 0;
+}
+
+static Result _sfServerExportObjects(SfServerSession* session, SfServerRequest* req, u32* out_ids, Handle* out_handles)
+{
+    // Domain sessions return objects as IDs in the same domain, other sessions as new sessions.
+    u32 i;
+    Result rc = 0;
+    for (i = 0; R_SUCCEEDED(rc) && i < req->num_out_objects; i ++) {
+        if (session->domain) {
+            out_ids[i] = _sfServerDomainInsert(session->domain, req->out_objects[i]);
+            if (!out_ids[i]) {
+                sfServerObjectRelease(req->out_objects[i]);
+                rc = MAKERESULT(Module_Libnx, LibnxError_DomainMessageTooManyObjectIds);
+            }
+        } else {
+            Handle server_handle;
+            rc = svcCreateSession(&server_handle, &out_handles[i], 0, 0);
+            if (R_SUCCEEDED(rc)) {
+                rc = _sfServerSessionCreate(session->server, server_handle, req->out_objects[i], NULL);
+                if (R_FAILED(rc))
+                    svcCloseHandle(out_handles[i]);
+            } else
+                sfServerObjectRelease(req->out_objects[i]);
+        }
+    }
+
+    if (R_FAILED(rc)) {
+        // Undo the objects exported so far; closing a client handle makes its server session go away on its own.
+        for (u32 j = 0; j + 1 < i; j ++) {
+            if (session->domain) {
+                SfServerObject* obj = _sfServerDomainRemove(session->domain, out_ids[j]);
+                if (obj)
+                    sfServerObjectRelease(obj);
+            } else
+                svcCloseHandle(out_handles[j]);
+        }
+        for (u32 j = i; j < req->num_out_objects; j ++)
+            sfServerObjectRelease(req->out_objects[j]);
+        req->num_out_objects = 0;
+    }
+
+    return rc;
+}
+
+// Size of the data words of the response, including the padding for aligning the CMIF header.
+static u32 _sfServerGetResponseDataSize(const SfServerRequest* req, bool is_domain)
+{
+    u32 size = 16;
+    if (is_domain)
+        size += sizeof(CmifDomainOutHeader) + req->num_out_objects*sizeof(u32);
+    size += sizeof(CmifOutHeader) + req->out_data_size;
+    return (size + 3) &~ 3;
+}
+
+// Checks that the response fits in the message buffer, and that its handle counts fit in the HIPC header.
+static bool _sfServerResponseFits(const SfServerRequest* req, bool is_domain)
+{
+    const u32 num_copy_handles = req->num_out_copy_handles;
+    const u32 num_move_handles = req->num_out_move_handles + (is_domain ? 0 : req->num_out_objects);
+    if (num_copy_handles > 15 || num_move_handles > 15)
+        return false;
+
+    u32 size = sizeof(HipcHeader) + _sfServerGetResponseDataSize(req, is_domain);
+    if (num_copy_handles || num_move_handles)
+        size += sizeof(HipcSpecialHeader) + (num_copy_handles + num_move_handles)*sizeof(Handle);
+    return size <= 0x100;
+}
+
+// Closes the handles sent with the request which no handler took.
+static void _sfServerCloseInHandles(SfServerRequest* req)
+{
+    for (u32 i = 0; i < req->hipc.meta.num_copy_handles; i ++)
+        if (req->hipc.data.copy_handles[i] != INVALID_HANDLE)
+            svcCloseHandle(req->hipc.data.copy_handles[i]);
+    for (u32 i = 0; i < req->hipc.meta.num_move_handles; i ++)
+        if (req->hipc.data.move_handles[i] != INVALID_HANDLE)
+            svcCloseHandle(req->hipc.data.move_handles[i]);
+}
+
+static void _sfServerWriteResponse(void* base, Result rc, const SfServerRequest* req, bool is_domain, const u32* object_ids, const Handle* object_handles)
+{
+    const u32 num_object_ids = is_domain ? req->num_out_objects : 0;
+    const u32 num_object_handles = is_domain ? 0 : req->num_out_objects;
+
+    HipcRequest hipc = hipcMakeRequestInline(base,
+        .num_data_words   = _sfServerGetResponseDataSize(req, is_domain) / 4,
+        .num_copy_handles = req->num_out_copy_handles,
+        .num_move_handles = num_object_handles + req->num_out_move_handles,
+    );
+
+    for (u32 i = 0; i < req->num_out_copy_handles; i ++)
+        hipc.copy_handles[i] = req->out_copy_handles[i];
+    // Output objects are marshalled as move handles at the beginning of the list.
+    for (u32 i = 0; i < num_object_handles; i ++)
+        hipc.move_handles[i] = object_handles[i];
+    for (u32 i = 0; i < req->num_out_move_handles; i ++)
+        hipc.move_handles[num_object_handles+i] = req->out_move_handles[i];
+
+    CmifOutHeader* hdr = (CmifOutHeader*)cmifGetAlignedDataStart(hipc.data_words, base);
+    if (is_domain) {
+        CmifDomainOutHeader* domain_hdr = (CmifDomainOutHeader*)hdr;
+        *domain_hdr = (CmifDomainOutHeader){ .num_out_objects = num_object_ids };
+        hdr = (CmifOutHeader*)(domain_hdr+1);
+    }
+
+    *hdr = (CmifOutHeader){
+        .magic   = CMIF_OUT_HEADER_MAGIC,
+        .version = 0,
+        .result  = rc,
+        .token   = 0,
+    };
+
+    u8* data = (u8*)(hdr+1);
+    memcpy(data, req->out_data, req->out_data_size);
+    memcpy(data + req->out_data_size, object_ids, num_object_ids*sizeof(u32));
+}
+
+void sfServerHandleMessage(SfServerSession* session, void* base, bool* out_close)
+{
+    // Work on a copy of the message, so that handlers are free to do IPC themselves.
+    u32 msg[0x100/sizeof(u32)];
+    memcpy(msg, base, sizeof(msg));
+    *out_close = false;
+
+    SfServerRequest req;
+    memset(&req, 0, sizeof(req));
+    req.session = session;
+    req.hipc = hipcParseRequest(msg);
+
+    Result rc;
+    bool is_domain = false;
+    switch (req.hipc.meta.type) {
+        case CmifCommandType_Close:
+            *out_close = true;
+            return;
+
+        case CmifCommandType_Request:
+        case CmifCommandType_RequestWithContext:
+            is_domain = session->domain != NULL;
+            rc = _sfServerHandleRequest(session, msg, &req);
+            break;
+
+        case CmifCommandType_Control:
+        case CmifCommandType_ControlWithContext:
+            rc = _sfServerHandleControl(session, msg, &req);
+            break;
+
+        default:
+            rc = MAKERESULT(Module_Libnx, LibnxError_InvalidCmifInHeader);
+            break;
+    }
+
+    _sfServerCloseInHandles(&req);
+
+    if (R_SUCCEEDED(rc) && (req.out_overflow || !_sfServerResponseFits(&req, is_domain)))
+        rc = MAKERESULT(Module_Libnx, LibnxError_ServerResponseTooLarge);
+
+    u32 object_ids[8];
+    Handle object_handles[8];
+    if (R_SUCCEEDED(rc))
+        rc = _sfServerExportObjects(session, &req, object_ids, object_handles);
+    if (R_FAILED(rc))
+        _sfServerDiscardOutput(&req);
+
+    _sfServerWriteResponse(base, rc, &req, is_domain, object_ids, object_handles);
+}
+
+static void _sfServerSetupReceive(SfServerSession* session, void* base)
+{
+    if (session->pointer_buffer) {
+        HipcRequest hipc = hipcMakeRequestInline(base, .num_recv_statics = 1);
+        hipc.recv_list[0] = hipcMakeRecvStatic(session->pointer_buffer, session->server->pointer_buffer_size);
+    } else
+        hipcMakeRequestInline(base);
+}
+
+static void _sfServerProcessSession(SfServer* srv, SfServerSession* session)
+{
+    void* base = armGetTls();
+    bool close = false;
+    s32 idx;
+
+    _sfServerSetupReceive(session, base);
+    Result rc = svcReplyAndReceive(&idx, &session->handle, 1, INVALID_HANDLE, 0);
+    if (R_SUCCEEDED(rc)) {
+        sfServerHandleMessage(session, base, &close);
+        if (!close)
+            rc = svcReplyAndReceive(&idx, NULL, 0, session->handle, 0);
+    }
+
+    // Replying without receiving anything always times out.
+    if (close || (R_FAILED(rc) && rc != KERNELRESULT(TimedOut))) {
+        _sfServerSessionDestroy(session);
+        return;
+    }
+
+    mutexLock(&srv->mutex);
+    session->busy = false;
+    mutexUnlock(&srv->mutex);
+    ueventSignal(&srv->wakeup);
+}
+
+static void _sfServerAccept(SfServer* srv, SfServerPort* port)
+{
+    Handle session;
+    Result rc = svcAcceptSession(&session, port->handle);
+    if (R_FAILED(rc))
+        return;
+
+    SfServerObject* obj = port->connect(port->userdata);
+    if (!obj) {
+        svcCloseHandle(session);
+        return;
+    }
+
+    _sfServerSessionCreate(srv, session, obj, NULL);
+}
+
+void sfServerCreate(SfServer* srv, u16 pointer_buffer_size)
+{
+    memset(srv, 0, sizeof(*srv));
+    mutexInit(&srv->mutex);
+    mutexInit(&srv->wait_mutex);
+    ueventCreate(&srv->wakeup, true);
+    srv->pointer_buffer_size = pointer_buffer_size;
+}
+
+void sfServerClose(SfServer* srv)
+{
+    while (srv->num_sessions)
+        _sfServerSessionDestroy(srv->sessions[srv->num_sessions-1]);
+
+    for (u32 i = 0; i < srv->num_ports; i ++) {
+        svcCloseHandle(srv->ports[i].handle);
+        if (srv->ports[i].name.name[0])
+            smUnregisterService(srv->ports[i].name);
+    }
+    srv->num_ports = 0;
+}
+
+static Result _sfServerAddPort(SfServer* srv, Handle port, SfServerConnectFunc connect, void* userdata, SmServiceName name)
+{
+    Result rc = 0;
+
+    mutexLock(&srv->mutex);
+    if (srv->num_ports < SF_SERVER_MAX_PORTS) {
+        srv->ports[srv->num_ports++] = (SfServerPort){
+            .handle   = port,
+            .connect  = connect,
+            .userdata = userdata,
+            .name     = name,
+        };
+    } else
+        rc = MAKERESULT(Module_Libnx, LibnxError_ServerFull);
+    mutexUnlock(&srv->mutex);
+
+    if (R_SUCCEEDED(rc))
+        ueventSignal(&srv->wakeup);
+    return rc;
+}
+
+Result sfServerAddPort(SfServer* srv, Handle port, SfServerConnectFunc connect, void* userdata)
+{
+    return _sfServerAddPort(srv, port, connect, userdata, (SmServiceName){});
+}
+
+Result sfServerRegisterService(SfServer* srv, SmServiceName name, s32 max_sessions, SfServerConnectFunc connect, void* userdata)
+{
+    Handle port;
+    Result rc = smRegisterService(&port, name, false, max_sessions);
+    if (R_FAILED(rc))
+        return rc;
+
+    rc = _sfServerAddPort(srv, port, connect, userdata, name);
+    if (R_FAILED(rc)) {
+        svcCloseHandle(port);
+        smUnregisterService(name);
+    }
+
+    return rc;
+}
+
+Result sfServerAddSession(SfServer* srv, Handle session, SfServerObject* obj)
+{
+    return _sfServerSessionCreate(srv, session, obj, NULL);
+}
+
+Result sfServerProcess(SfServer* srv, u64 timeout)
+{
+    Waiter waiters[1 + SF_SERVER_MAX_PORTS + SF_SERVER_MAX_SESSIONS];
+    SfServerSession* targets[1 + SF_SERVER_MAX_PORTS + SF_SERVER_MAX_SESSIONS];
+
+    mutexLock(&srv->wait_mutex);
+    for (;;) {
+        if (__atomic_load_n(&srv->exiting, __ATOMIC_ACQUIRE)) {
+            mutexUnlock(&srv->wait_mutex);
+            return KERNELRESULT(Cancelled);
+        }
+
+        // Build the wait list: the wakeup event, the ports, then every session not being processed by another worker.
+        s32 num_waiters = 0;
+        waiters[num_waiters++] = waiterForUEvent(&srv->wakeup);
+
+        mutexLock(&srv->mutex);
+        const s32 num_ports = srv->num_ports;
+        for (s32 i = 0; i < num_ports; i ++)
+            waiters[num_waiters++] = waiterForHandle(srv->ports[i].handle);
+        for (u32 i = 0; i < srv->num_sessions; i ++) {
+            if (!srv->sessions[i]->busy) {
+                targets[num_waiters] = srv->sessions[i];
+                waiters[num_waiters++] = waiterForHandle(srv->sessions[i]->handle);
+            }
+        }
+        mutexUnlock(&srv->mutex);
+
+        s32 idx = -1;
+        Result rc = waitObjects(&idx, waiters, num_waiters, timeout);
+        if (R_FAILED(rc)) {
+            mutexUnlock(&srv->wait_mutex);
+            return rc;
+        }
+
+        if (idx == 0)
+            continue;
+
+        if (idx <= num_ports) {
+            mutexUnlock(&srv->wait_mutex);
+            _sfServerAccept(srv, &srv->ports[idx-1]);
+            return 0;
+        }
+
+        SfServerSession* session = targets[idx];
+        mutexLock(&srv->mutex);
+        session->busy = true;
+        mutexUnlock(&srv->mutex);
+
+        // Hand the wait list over to the next worker while this request is being processed.
+        mutexUnlock(&srv->wait_mutex);
+        _sfServerProcessSession(srv, session);
+        return 0;
+    }
+}
+
+void sfServerLoop(SfServer* srv)
+{
+    while (sfServerProcess(srv, UINT64_MAX) != KERNELRESULT(Cancelled));
+}
+
+void sfServerRequestExit(SfServer* srv)
+{
+    __atomic_store_n(&srv->exiting, true, __ATOMIC_RELEASE);
+    ueventSignal(&srv->wakeup);
+}
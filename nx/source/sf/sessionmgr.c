@@ -1,6 +1,75 @@
+#include "arm/counter.h"
 #include "kernel/svc.h"
+#include "kernel/thread.h"
+#include "runtime/threadpool.h"
 #include "sf/cmif.h"
 #include "sf/sessionmgr.h"
+#include "sf/trace.h"
+#include "../internal.h"
+#include "../runtime/alloc.h"
+
+#define BATCH_HELPER_STACK_SIZE 0x4000
+#define NUM_SLOT_HINTS 4
+#define GROW_MIN_BACKOFF_NS 1000000ULL
+#define GROW_MAX_BACKOFF_NS 1000000000ULL
+
+#define LIKELY(expr)   (__builtin_expect_with_probability(!!(expr), 1, 1.0))
+#define UNLIKELY(expr) (__builtin_expect_with_probability(!!(expr), 0, 1.0))
+
+// Per-thread record of the last slot used with a given manager, so that a thread keeps reusing the same session.
+typedef struct {
+    SessionMgr* mgr;
+    int slot;
+} SessionMgrSlotHint;
+
+static __thread SessionMgrSlotHint g_sessionmgrSlotHints[NUM_SLOT_HINTS];
+
+typedef struct {
+    SessionMgrBatchFunc func;
+    void* userdata;
+} SessionMgrBatch;
+
+NX_INLINE u32 _LoadExclusive(u32 *ptr) {
+    u32 value;
+    __asm__ __volatile__("ldaxr %w[value], %[ptr]" : [value]"=&r"(value) : [ptr]"Q"(*ptr) : "memory");
+    return value;
+}
+
+NX_INLINE int _StoreExclusive(u32 *ptr, u32 value) {
+    int result;
+    __asm__ __volatile__("stlxr %w[result], %w[value], %[ptr]" : [result]"=&r"(result) : [value]"r"(value), [ptr]"Q"(*ptr) : "memory");
+    return result;
+}
+
+NX_INLINE void _ClearExclusive(void) {
+    __asm__ __volatile__("clrex" ::: "memory");
+}
+
+NX_INLINE SessionMgrSlotHint* _sessionmgrGetSlotHint(SessionMgr* mgr) {
+    return &g_sessionmgrSlotHints[((uintptr_t)mgr >> 4) % NUM_SLOT_HINTS];
+}
+
+static int _sessionmgrTryClaimSlot(SessionMgr* mgr, int preferred_slot) {
+    u32 mask = _LoadExclusive(&mgr->free_mask);
+    while (true) {
+        // If every slot is taken, the caller needs to wait.
+        if (UNLIKELY(mask == 0)) {
+            _ClearExclusive();
+            return -1;
+        }
+
+        // Prefer the slot this thread used last, otherwise take the lowest free one.
+        int slot = __builtin_ctz(mask);
+        if (preferred_slot >= 0 && (mask & (1U << preferred_slot)))
+            slot = preferred_slot;
+
+        // If we fail, try again.
+        if (LIKELY(_StoreExclusive(&mgr->free_mask, mask &~ (1U << slot)) == 0))
+            return slot;
+
+        mask = _LoadExclusive(&mgr->free_mask);
+    }
+}
 
 Result sessionmgrCreate(SessionMgr* mgr, Handle root_session, u32 num_sessions) {
     if (root_session == INVALID_HANDLE)
@@ -14,48 +83,271 @@ Result sessionmgrCreate(SessionMgr* mgr, Handle root_session, u32 num_sessions)
     mgr->sessions[0] = root_session;
     mgr->num_sessions = num_sessions;
     mgr->free_mask = (1U << num_sessions) - 1U;
+    mgr->min_sessions = num_sessions;
+    mgr->max_sessions = num_sessions;
+    mgr->stats.peak_sessions = num_sessions;
 
     Result rc = 0;
-    for (u32 i = 1; R_SUCCEEDED(rc) && i < num_sessions; i ++)
+    for (u32 i = 1; R_SUCCEEDED(rc) && i < num_sessions; i ++) {
         rc = cmifCloneCurrentObject(root_session, &mgr->sessions[i]);
+#if defined(NX_SERVICE_TRACE)
+        if (R_SUCCEEDED(rc))
+            sftraceCopyName(root_session, mgr->sessions[i]);
+#endif
+    }
 
     return rc;
 }
 
+static void _sessionmgrCloseBatchPool(SessionMgr* mgr) {
+    ThreadPool* pool = mgr->batch_pool;
+    if (!pool)
+        return;
+
+    for (u32 i = 0; i < pool->num_workers; i ++)
+        schedRemoveHelperThread(pool->workers[i].thread.handle);
+    threadpoolClose(pool);
+    __libnx_free(pool);
+    mgr->batch_pool = NULL;
+}
+
 void sessionmgrClose(SessionMgr* mgr) {
     if (mgr->sessions[0] == INVALID_HANDLE)
         return;
 
+    _sessionmgrCloseBatchPool(mgr);
+
     mgr->sessions[0] = INVALID_HANDLE;
     for (u32 i = 1; i < mgr->num_sessions; i ++) {
         if (mgr->sessions[i] != INVALID_HANDLE) {
             cmifMakeCloseRequest(armGetTls(), 0);
             svcSendSyncRequest(mgr->sessions[i]);
+#if defined(NX_SERVICE_TRACE)
+            sftraceUnregisterName(mgr->sessions[i]);
+#endif
             svcCloseHandle(mgr->sessions[i]);
             mgr->sessions[i] = INVALID_HANDLE;
         }
     }
 }
 
-int sessionmgrAttachClient(SessionMgr* mgr) {
-    mutexLock(&mgr->mutex);
+static bool _sessionmgrTryClaimSpecificSlot(SessionMgr* mgr, int slot) {
+    u32 mask = _LoadExclusive(&mgr->free_mask);
+    while (mask & (1U << slot)) {
+        if (_StoreExclusive(&mgr->free_mask, mask &~ (1U << slot)) == 0)
+            return true;
+        mask = _LoadExclusive(&mgr->free_mask);
+    }
+    _ClearExclusive();
+    return false;
+}
+
+static int _sessionmgrGrow(SessionMgr* mgr) {
+    // This function assumes the mutex is held.
+    // The new slot is handed to the caller, so its bit in free_mask stays clear.
+    u32 slot = mgr->num_sessions;
+    Result rc = cmifCloneCurrentObject(mgr->sessions[0], &mgr->sessions[slot]);
+    if (R_FAILED(rc)) {
+        mgr->sessions[slot] = INVALID_HANDLE;
+        return -1;
+    }
+#if defined(NX_SERVICE_TRACE)
+    sftraceCopyName(mgr->sessions[0], mgr->sessions[slot]);
+#endif
+
+    __atomic_store_n(&mgr->num_sessions, slot + 1, __ATOMIC_RELEASE);
+    mgr->stats.num_grows ++;
+    if (mgr->stats.peak_sessions < slot + 1)
+        mgr->stats.peak_sessions = slot + 1;
+    return slot;
+}
+
+static void _sessionmgrTryShrink(SessionMgr* mgr) {
+    u64 now = armGetSystemTick();
+    if (now - __atomic_load_n(&mgr->last_scale_tick, __ATOMIC_RELAXED) < mgr->idle_ticks)
+        return;
+
+    // Don't bother if someone else is already working with the manager.
+    if (!mutexTryLock(&mgr->mutex))
+        return;
+
+    // Only the most recently added session can be closed, and only if it's not in use.
+    u32 slot = mgr->num_sessions - 1;
+    if (slot >= mgr->min_sessions && !mgr->num_waiters && _sessionmgrTryClaimSpecificSlot(mgr, slot)) {
+        __atomic_store_n(&mgr->num_sessions, slot, __ATOMIC_RELEASE);
+        cmifMakeCloseRequest(armGetTls(), 0);
+        svcSendSyncRequest(mgr->sessions[slot]);
+#if defined(NX_SERVICE_TRACE)
+        sftraceUnregisterName(mgr->sessions[slot]);
+#endif
+        svcCloseHandle(mgr->sessions[slot]);
+        mgr->sessions[slot] = INVALID_HANDLE;
+        mgr->stats.num_shrinks ++;
+    }
+
+    // Close at most one session per idle period.
+    __atomic_store_n(&mgr->last_scale_tick, now, __ATOMIC_RELAXED);
+    mutexUnlock(&mgr->mutex);
+}
+
+static int _sessionmgrAttachClientSlow(SessionMgr* mgr) {
+    const u64 start_tick = armGetSystemTick();
     int slot;
-    for (;;) {
-        slot = __builtin_ffs(mgr->free_mask)-1;
-        if (slot >= 0) break;
-        mgr->num_waiters ++;
-        condvarWait(&mgr->condvar, &mgr->mutex);
-        mgr->num_waiters --;
-    }
-    mgr->free_mask &= ~(1U << slot);
+
+    // num_waiters is raised before re-checking free_mask, and DetachClient publishes the
+    // slot before checking num_waiters, so a release can't slip between the check and the wait.
+    mutexLock(&mgr->mutex);
+    u32 num_waiters = __atomic_add_fetch(&mgr->num_waiters, 1, __ATOMIC_SEQ_CST);
+    if (mgr->stats.peak_waiters < num_waiters)
+        mgr->stats.peak_waiters = num_waiters;
+
+    while ((slot = _sessionmgrTryClaimSlot(mgr, -1)) < 0) {
+        if (mgr->num_sessions >= mgr->max_sessions) {
+            condvarWait(&mgr->condvar, &mgr->mutex);
+            continue;
+        }
+
+        // The pool can still grow: do so once contention has lasted for long enough,
+        // and once the backoff after a refused clone has expired.
+        u64 now = armGetSystemTick();
+        u64 waited = now - start_tick;
+        u64 delay = waited < mgr->grow_delay_ticks ? mgr->grow_delay_ticks - waited : 0;
+        if ((s64)(mgr->grow_retry_tick - now) > (s64)delay)
+            delay = mgr->grow_retry_tick - now;
+        if (delay) {
+            condvarWaitTimeout(&mgr->condvar, &mgr->mutex, armTicksToNs(delay));
+            continue;
+        }
+
+        slot = _sessionmgrGrow(mgr);
+        if (slot >= 0) {
+            mgr->grow_backoff_ticks = 0;
+            break;
+        }
+
+        // The server refused to give us another session (it may be short on sessions for now), so back off.
+        u64 min_backoff = armNsToTicks(GROW_MIN_BACKOFF_NS), max_backoff = armNsToTicks(GROW_MAX_BACKOFF_NS);
+        mgr->grow_backoff_ticks = mgr->grow_backoff_ticks ? mgr->grow_backoff_ticks * 2 : min_backoff;
+        if (mgr->grow_backoff_ticks > max_backoff)
+            mgr->grow_backoff_ticks = max_backoff;
+        mgr->grow_retry_tick = now + mgr->grow_backoff_ticks;
+        mgr->stats.num_grow_failures ++;
+    }
+
+    __atomic_sub_fetch(&mgr->num_waiters, 1, __ATOMIC_SEQ_CST);
+
+    u64 end_tick = armGetSystemTick();
+    u64 wait_ticks = end_tick - start_tick;
+    mgr->stats.num_waits ++;
+    mgr->stats.total_wait_ticks += wait_ticks;
+    if (mgr->stats.max_wait_ticks < wait_ticks)
+        mgr->stats.max_wait_ticks = wait_ticks;
+    __atomic_store_n(&mgr->last_scale_tick, end_tick, __ATOMIC_RELAXED);
+
     mutexUnlock(&mgr->mutex);
     return slot;
 }
 
+int sessionmgrAttachClient(SessionMgr* mgr) {
+    SessionMgrSlotHint* hint = _sessionmgrGetSlotHint(mgr);
+
+    // Fast path: atomically claim a free slot without touching the mutex.
+    int slot = _sessionmgrTryClaimSlot(mgr, hint->mgr == mgr ? hint->slot : -1);
+
+    if (UNLIKELY(slot < 0)) {
+        // Slow path: every session is busy, so wait for one to be released (or grow the pool).
+        slot = _sessionmgrAttachClientSlow(mgr);
+    } else if (UNLIKELY(__atomic_load_n(&mgr->num_sessions, __ATOMIC_RELAXED) > mgr->min_sessions)) {
+        // The pool has grown: check whether it has been idle for long enough to give a session back.
+        _sessionmgrTryShrink(mgr);
+    }
+
+    hint->mgr = mgr;
+    hint->slot = slot;
+    return slot;
+}
+
 void sessionmgrDetachClient(SessionMgr* mgr, int slot) {
-    mutexLock(&mgr->mutex);
-    mgr->free_mask |= 1U << slot;
-    if (mgr->num_waiters)
+    u32 mask = _LoadExclusive(&mgr->free_mask);
+    while (UNLIKELY(_StoreExclusive(&mgr->free_mask, mask | (1U << slot)) != 0))
+        mask = _LoadExclusive(&mgr->free_mask);
+
+    if (UNLIKELY(__atomic_load_n(&mgr->num_waiters, __ATOMIC_SEQ_CST) != 0)) {
+        mutexLock(&mgr->mutex);
         condvarWakeOne(&mgr->condvar);
+        mutexUnlock(&mgr->mutex);
+    }
+}
+
+Result sessionmgrSetAutoScale(SessionMgr* mgr, u32 max_sessions, u64 grow_delay_ns, u64 idle_timeout_ns) {
+    if (mgr->sessions[0] == INVALID_HANDLE)
+        return MAKERESULT(Module_Libnx, LibnxError_NotInitialized);
+    if (max_sessions < mgr->min_sessions || max_sessions > NX_SESSION_MGR_MAX_SESSIONS)
+        return MAKERESULT(Module_Libnx, LibnxError_BadInput);
+
+    mutexLock(&mgr->mutex);
+    mgr->max_sessions = max_sessions;
+    mgr->grow_delay_ticks = armNsToTicks(grow_delay_ns);
+    mgr->idle_ticks = armNsToTicks(idle_timeout_ns);
+    __atomic_store_n(&mgr->last_scale_tick, armGetSystemTick(), __ATOMIC_RELAXED);
+    mutexUnlock(&mgr->mutex);
+
+    return 0;
+}
+
+void sessionmgrGetStats(SessionMgr* mgr, SessionMgrStats* out) {
+    mutexLock(&mgr->mutex);
+    *out = mgr->stats;
+    out->num_sessions = mgr->num_sessions;
+    mutexUnlock(&mgr->mutex);
+}
+
+static ThreadPool* _sessionmgrGetBatchPool(SessionMgr* mgr) {
+    ThreadPool* pool = __atomic_load_n(&mgr->batch_pool, __ATOMIC_ACQUIRE);
+    if (LIKELY(pool))
+        return pool;
+
+    mutexLock(&mgr->mutex);
+    pool = mgr->batch_pool;
+    if (!pool) {
+        // One session is left for the calling thread, which also works on the batch.
+        u32 max_sessions = mgr->max_sessions > mgr->num_sessions ? mgr->max_sessions : mgr->num_sessions;
+        u32 num_workers = max_sessions - 1;
+        if (num_workers > THREADPOOL_MAX_WORKERS)
+            num_workers = THREADPOOL_MAX_WORKERS;
+
+        s32 prio = 0x2C;
+        svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+
+        pool = num_workers ? (ThreadPool*)__libnx_aligned_alloc(__alignof__(ThreadPool), sizeof(ThreadPool)) : NULL;
+        if (pool && R_FAILED(threadpoolCreate(pool, num_workers, prio, BATCH_HELPER_STACK_SIZE))) {
+            __libnx_free(pool);
+            pool = NULL;
+        }
+
+        if (pool) {
+            for (u32 i = 0; i < pool->num_workers; i ++)
+                schedAddHelperThread(pool->workers[i].thread.handle);
+            __atomic_store_n(&mgr->batch_pool, pool, __ATOMIC_RELEASE);
+        }
+    }
     mutexUnlock(&mgr->mutex);
+
+    return pool;
+}
+
+static void _sessionmgrBatchRange(void* userdata, s64 begin, s64 end) {
+    SessionMgrBatch* batch = (SessionMgrBatch*)userdata;
+    for (s64 i = begin; i < end; i ++)
+        batch->func(batch->userdata, (u32)i);
+}
+
+void sessionmgrRunBatch(SessionMgr* mgr, u32 num_items, SessionMgrBatchFunc func, void* userdata) {
+    SessionMgrBatch batch = { func, userdata };
+
+    ThreadPool* pool = num_items > 1 ? _sessionmgrGetBatchPool(mgr) : NULL;
+    if (pool) // Each item is an IPC round trip of its own, so hand them out one at a time.
+        threadpoolParallelFor(pool, 0, num_items, 1, _sessionmgrBatchRange, &batch);
+    else
+        _sessionmgrBatchRange(&batch, 0, num_items);
 }
@@ -0,0 +1,318 @@
+#include <string.h>
+#include <inttypes.h>
+#include "result.h"
+#include "arm/counter.h"
+#include "kernel/svc.h"
+#include "kernel/mutex.h"
+#include "kernel/thread.h"
+#include "sf/trace.h"
+#include "../runtime/alloc.h"
+
+#define NUM_TRACE_NAMES 64
+
+enum {
+    SfTraceStatsState_Free     = 0,
+    SfTraceStatsState_Claiming = 1,
+    SfTraceStatsState_Ready    = 2,
+};
+
+typedef struct SfTraceRing SfTraceRing;
+
+// Each ring is only ever written by the thread currently owning it; readers only see whole records
+// up to the published position (unless the ring wraps around while being read).
+struct SfTraceRing {
+    SfTraceRing* next;
+    u64 thread_id;
+    u32 in_use;
+    u32 padding;
+    u64 pos;
+    SfTraceRecord records[SFTRACE_RING_SIZE];
+};
+
+typedef struct {
+    u32 state;
+    u32 padding;
+    SfTraceStats stats;
+} SfTraceStatsEntry;
+
+typedef struct {
+    Handle session;
+    char name[12];
+} SfTraceName;
+
+bool __nx_sftrace_enabled;
+
+static Mutex g_sftraceMutex;
+static s32 g_sftraceTlsSlot = -1;
+static SfTraceRing* g_sftraceRings;
+static SfTraceStatsEntry g_sftraceStats[SFTRACE_MAX_STATS];
+static SfTraceName g_sftraceNames[NUM_TRACE_NAMES];
+
+static void _sftraceReleaseRing(void* arg)
+{
+    SfTraceRing* ring = (SfTraceRing*)arg;
+    __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static SfTraceRing* _sftraceAcquireRing(void)
+{
+    u64 thread_id = 0;
+    svcGetThreadId(&thread_id, CUR_THREAD_HANDLE);
+
+    // Reuse the ring of a thread that has exited, if any.
+    SfTraceRing* ring;
+    for (ring = __atomic_load_n(&g_sftraceRings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        u32 expected = 0;
+        if (__atomic_compare_exchange_n(&ring->in_use, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            ring->thread_id = thread_id;
+            __atomic_store_n(&ring->pos, 0, __ATOMIC_RELEASE);
+            return ring;
+        }
+    }
+
+    ring = (SfTraceRing*)__libnx_alloc(sizeof(SfTraceRing));
+    if (!ring)
+        return NULL;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->thread_id = thread_id;
+    ring->in_use = 1;
+
+    ring->next = __atomic_load_n(&g_sftraceRings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&g_sftraceRings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return ring;
+}
+
+static inline u32 _sftraceGetBucket(u64 ticks)
+{
+    u32 bucket = ticks ? 63 - __builtin_clzll(ticks) : 0;
+    return bucket < SFTRACE_NUM_BUCKETS ? bucket : SFTRACE_NUM_BUCKETS-1;
+}
+
+static SfTraceStats* _sftraceFindStats(const SfTraceRecord* rec)
+{
+    u32 hash = rec->session * 0x9E3779B1u;
+    hash ^= rec->object_id * 0x85EBCA77u;
+    hash ^= rec->request_id * 0xC2B2AE3Du;
+    hash ^= hash >> 15;
+
+    for (u32 i = 0; i < SFTRACE_MAX_STATS; i ++) {
+        SfTraceStatsEntry* entry = &g_sftraceStats[(hash + i) % SFTRACE_MAX_STATS];
+        u32 state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+
+        if (state == SfTraceStatsState_Free) {
+            if (__atomic_compare_exchange_n(&entry->state, &state, SfTraceStatsState_Claiming, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                entry->stats.session = rec->session;
+                entry->stats.object_id = rec->object_id;
+                entry->stats.request_id = rec->request_id;
+                entry->stats.min_ticks = UINT64_MAX;
+                __atomic_store_n(&entry->state, SfTraceStatsState_Ready, __ATOMIC_RELEASE);
+                return &entry->stats;
+            }
+        }
+
+        // Another thread is filling in this entry, wait for it to be published.
+        while (state == SfTraceStatsState_Claiming)
+            state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+
+        if (entry->stats.session == rec->session && entry->stats.object_id == rec->object_id && entry->stats.request_id == rec->request_id)
+            return &entry->stats;
+    }
+
+    // Table is full, drop the statistics for this command.
+    return NULL;
+}
+
+void sftraceSetEnabled(bool enabled)
+{
+    if (enabled && g_sftraceTlsSlot < 0) {
+        mutexLock(&g_sftraceMutex);
+        if (g_sftraceTlsSlot < 0)
+            g_sftraceTlsSlot = threadTlsAlloc(_sftraceReleaseRing);
+        mutexUnlock(&g_sftraceMutex);
+
+        if (g_sftraceTlsSlot < 0)
+            return;
+    }
+
+    __atomic_store_n(&__nx_sftrace_enabled, enabled, __ATOMIC_RELEASE);
+}
+
+void sftraceRegisterName(Handle session, const char* name)
+{
+    if (session == INVALID_HANDLE)
+        return;
+
+    for (u32 i = 0; i < NUM_TRACE_NAMES; i ++) {
+        Handle expected = INVALID_HANDLE;
+        if (__atomic_compare_exchange_n(&g_sftraceNames[i].session, &expected, session, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            memset(g_sftraceNames[i].name, 0, sizeof(g_sftraceNames[i].name));
+            strncpy(g_sftraceNames[i].name, name, 8);
+            return;
+        }
+    }
+}
+
+void sftraceUnregisterName(Handle session)
+{
+    for (u32 i = 0; i < NUM_TRACE_NAMES; i ++) {
+        Handle expected = session;
+        if (__atomic_compare_exchange_n(&g_sftraceNames[i].session, &expected, INVALID_HANDLE, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return;
+    }
+}
+
+static const char* _sftraceGetName(Handle session)
+{
+    for (u32 i = 0; i < NUM_TRACE_NAMES; i ++)
+        if (__atomic_load_n(&g_sftraceNames[i].session, __ATOMIC_ACQUIRE) == session)
+            return g_sftraceNames[i].name;
+
+    return NULL;
+}
+
+void sftraceCopyName(Handle from, Handle to)
+{
+    const char* name = _sftraceGetName(from);
+    if (name)
+        sftraceRegisterName(to, name);
+}
+
+void sftraceRecord(const SfTraceRecord* rec)
+{
+    if (g_sftraceTlsSlot < 0)
+        return;
+
+    SfTraceRing* ring = (SfTraceRing*)threadTlsGet(g_sftraceTlsSlot);
+    if (!ring) {
+        ring = _sftraceAcquireRing();
+        if (!ring)
+            return;
+        threadTlsSet(g_sftraceTlsSlot, ring);
+    }
+
+    u64 pos = ring->pos;
+    ring->records[pos % SFTRACE_RING_SIZE] = *rec;
+    __atomic_store_n(&ring->pos, pos+1, __ATOMIC_RELEASE);
+
+    SfTraceStats* stats = _sftraceFindStats(rec);
+    if (!stats)
+        return;
+
+    __atomic_fetch_add(&stats->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->total_ticks, rec->duration, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->buckets[_sftraceGetBucket(rec->duration)], 1, __ATOMIC_RELAXED);
+
+    u64 cur = __atomic_load_n(&stats->min_ticks, __ATOMIC_RELAXED);
+    while (rec->duration < cur && !__atomic_compare_exchange_n(&stats->min_ticks, &cur, rec->duration, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    cur = __atomic_load_n(&stats->max_ticks, __ATOMIC_RELAXED);
+    while (rec->duration > cur && !__atomic_compare_exchange_n(&stats->max_ticks, &cur, rec->duration, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+size_t sftraceGetStats(SfTraceStats* out, size_t max_stats)
+{
+    size_t count = 0;
+    for (u32 i = 0; i < SFTRACE_MAX_STATS && count < max_stats; i ++) {
+        SfTraceStatsEntry* entry = &g_sftraceStats[i];
+        if (__atomic_load_n(&entry->state, __ATOMIC_ACQUIRE) != SfTraceStatsState_Ready)
+            continue;
+
+        SfTraceStats* stats = &out[count++];
+        stats->session = entry->stats.session;
+        stats->object_id = entry->stats.object_id;
+        stats->request_id = entry->stats.request_id;
+        stats->padding = 0;
+        stats->count = __atomic_load_n(&entry->stats.count, __ATOMIC_RELAXED);
+        stats->total_ticks = __atomic_load_n(&entry->stats.total_ticks, __ATOMIC_RELAXED);
+        stats->min_ticks = __atomic_load_n(&entry->stats.min_ticks, __ATOMIC_RELAXED);
+        stats->max_ticks = __atomic_load_n(&entry->stats.max_ticks, __ATOMIC_RELAXED);
+        for (u32 j = 0; j < SFTRACE_NUM_BUCKETS; j ++)
+            stats->buckets[j] = __atomic_load_n(&entry->stats.buckets[j], __ATOMIC_RELAXED);
+    }
+
+    return count;
+}
+
+static void _sftracePrintTarget(FILE* f, Handle session, u32 object_id, u32 request_id)
+{
+    const char* name = _sftraceGetName(session);
+    if (name)
+        fprintf(f, "%-8s", name);
+    else
+        fprintf(f, "%08" PRIx32, session);
+
+    if (object_id)
+        fprintf(f, " obj %-4" PRIu32, object_id);
+    else
+        fprintf(f, "         ");
+
+    fprintf(f, " cmd %-5" PRIu32, request_id);
+}
+
+void sftraceDumpStats(FILE* f)
+{
+    fprintf(f, "# IPC latency statistics (us)\n");
+    for (u32 i = 0; i < SFTRACE_MAX_STATS; i ++) {
+        if (__atomic_load_n(&g_sftraceStats[i].state, __ATOMIC_ACQUIRE) != SfTraceStatsState_Ready)
+            continue;
+
+        const SfTraceStats* entry = &g_sftraceStats[i].stats;
+        u64 count = __atomic_load_n(&entry->count, __ATOMIC_RELAXED);
+        if (!count)
+            continue;
+
+        u64 total = __atomic_load_n(&entry->total_ticks, __ATOMIC_RELAXED);
+        _sftracePrintTarget(f, entry->session, entry->object_id, entry->request_id);
+        fprintf(f, " count %-8" PRIu64 " avg %-8" PRIu64 " min %-8" PRIu64 " max %-8" PRIu64 "\n",
+            count, armTicksToNs(total / count) / 1000,
+            armTicksToNs(__atomic_load_n(&entry->min_ticks, __ATOMIC_RELAXED)) / 1000,
+            armTicksToNs(__atomic_load_n(&entry->max_ticks, __ATOMIC_RELAXED)) / 1000);
+
+        // Bucket bounds are printed in us with ns precision, as the lowest ones are well below 1us.
+        for (u32 j = 0; j < SFTRACE_NUM_BUCKETS; j ++) {
+            u64 bucket = __atomic_load_n(&entry->buckets[j], __ATOMIC_RELAXED);
+            if (!bucket)
+                continue;
+
+            // The last bucket also counts everything above it.
+            const bool last = j == SFTRACE_NUM_BUCKETS-1;
+            const u64 bound = armTicksToNs(last ? 1ULL << j : 2ULL << j);
+            fprintf(f, "    %s %6" PRIu64 ".%03" PRIu64 " %" PRIu64 "\n", last ? ">=" : "< ", bound / 1000, bound % 1000, bucket);
+        }
+    }
+}
+
+void sftraceDumpRecords(FILE* f)
+{
+    fprintf(f, "# IPC trace records: tick, duration (us), target, result, in size, out size\n");
+    for (SfTraceRing* ring = __atomic_load_n(&g_sftraceRings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        u64 end = __atomic_load_n(&ring->pos, __ATOMIC_ACQUIRE);
+        u64 start = end > SFTRACE_RING_SIZE ? end - SFTRACE_RING_SIZE : 0;
+        if (start == end)
+            continue;
+
+        fprintf(f, "thread %" PRIu64 ":\n", ring->thread_id);
+        for (u64 pos = start; pos < end; pos ++) {
+            SfTraceRecord rec = ring->records[pos % SFTRACE_RING_SIZE];
+            fprintf(f, "%016" PRIx64 " %-8" PRIu64 " ", rec.start_tick, armTicksToNs(rec.duration) / 1000);
+            _sftracePrintTarget(f, rec.session, rec.object_id, rec.request_id);
+            fprintf(f, " rc %08" PRIx32 " in %-6" PRIu32 " out %" PRIu32 "\n", rec.result, rec.in_size, rec.out_size);
+        }
+    }
+}
+
+void sftraceReset(void)
+{
+    for (u32 i = 0; i < SFTRACE_MAX_STATS; i ++) {
+        SfTraceStatsEntry* entry = &g_sftraceStats[i];
+        __atomic_store_n(&entry->state, SfTraceStatsState_Free, __ATOMIC_RELAXED);
+        memset(&entry->stats, 0, sizeof(entry->stats));
+    }
+
+    for (SfTraceRing* ring = __atomic_load_n(&g_sftraceRings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+        __atomic_store_n(&ring->pos, 0, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}